@@ -0,0 +1,655 @@
+/**
+ * userfs benchmarks. Each one prints a JSON object with its name, the
+ * number of operations, the time and, when built with heap_help
+ * (ENABLE_LEAK_CHECKS), the number of heap allocations per operation:
+ *
+ *     ./bench [name_filter]
+ *
+ * heap_help makes each allocation much slower, so the times of such a
+ * build are not representative. HHBACKTRACE=off makes it less so.
+ * Only the benchmarks with the filter in the name are run.
+ */
+#include "userfs.h"
+#include "ufs_aio.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if __has_include("heap_help.h")
+#include "heap_help.h"
+#define BENCH_HAVE_ALLOC_COUNT 1
+#else
+#define BENCH_HAVE_ALLOC_COUNT 0
+#endif
+
+/** A running benchmark. */
+struct bench {
+	const char *name;
+	uint64_t ops;
+	uint64_t bytes;
+	/** Block memory taken by the benchmark data, if it is of interest. */
+	uint64_t mem_bytes;
+	uint64_t start_ns;
+	uint64_t start_allocs;
+};
+
+static const char *bench_filter = NULL;
+static bool bench_is_first = true;
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+bench_allocs(void)
+{
+#if BENCH_HAVE_ALLOC_COUNT
+	return heaph_get_alloc_total();
+#else
+	return 0;
+#endif
+}
+
+static bool
+bench_is_enabled(const char *name)
+{
+	return bench_filter == NULL || strstr(name, bench_filter) != NULL;
+}
+
+/** Start measuring. Setup of the benchmark has to be done before. */
+static void
+bench_start(struct bench *b, const char *name)
+{
+	b->name = name;
+	b->ops = 0;
+	b->bytes = 0;
+	b->mem_bytes = 0;
+	b->start_allocs = bench_allocs();
+	b->start_ns = bench_now_ns();
+}
+
+static void
+bench_finish(struct bench *b)
+{
+	uint64_t ns = bench_now_ns() - b->start_ns;
+	uint64_t allocs = bench_allocs() - b->start_allocs;
+	uint64_t ops = b->ops != 0 ? b->ops : 1;
+	printf("%s\n    {\"name\": \"%s\", \"ops\": %llu, \"ns\": %llu, "
+	       "\"ns_per_op\": %.1f", bench_is_first ? "" : ",", b->name,
+	       (unsigned long long)b->ops, (unsigned long long)ns,
+	       (double)ns / ops);
+	if (b->bytes != 0) {
+		printf(", \"mb_per_sec\": %.1f",
+		       b->bytes / 1048576.0 / (ns / 1e9));
+	}
+	if (b->mem_bytes != 0) {
+		printf(", \"mem_bytes\": %llu, \"mem_ratio\": %.5f",
+		       (unsigned long long)b->mem_bytes,
+		       (double)b->mem_bytes / b->bytes);
+	}
+	if (BENCH_HAVE_ALLOC_COUNT) {
+		printf(", \"allocs\": %llu, \"allocs_per_op\": %.3f",
+		       (unsigned long long)allocs, (double)allocs / ops);
+	}
+	printf("}");
+	fflush(stdout);
+	bench_is_first = false;
+}
+
+static void
+bench_check(bool ok)
+{
+	if (!ok) {
+		fprintf(stderr, "benchmark failed: %d\n", ufs_errno());
+		abort();
+	}
+}
+
+static uint64_t
+bench_rand(uint64_t *state)
+{
+	/* xorshift64. */
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+enum {
+	/** Size of the files of the bulk I/O benchmarks. */
+	BENCH_FILE_SIZE = 32 * 1024 * 1024,
+	BENCH_CHUNK_MAX = 64 * 1024,
+};
+
+static char bench_buf[BENCH_CHUNK_MAX];
+
+static void
+bench_seq_io(size_t chunk)
+{
+	char name_write[64], name_read[64];
+	snprintf(name_write, sizeof(name_write), "seq_write_%zu", chunk);
+	snprintf(name_read, sizeof(name_read), "seq_read_%zu", chunk);
+	if (!bench_is_enabled(name_write) && !bench_is_enabled(name_read))
+		return;
+	/* Tiny chunks are slow, so write less of them. */
+	size_t total = chunk < 512 ? BENCH_FILE_SIZE / 8 : BENCH_FILE_SIZE;
+	size_t count = total / chunk;
+	struct bench b;
+
+	int fd = ufs_open("bench", UFS_CREATE);
+	bench_check(fd != -1);
+	bench_start(&b, name_write);
+	for (size_t i = 0; i < count; ++i)
+		bench_check(ufs_write(fd, bench_buf, chunk) == (ssize_t)chunk);
+	b.ops = count;
+	b.bytes = total;
+	if (bench_is_enabled(name_write))
+		bench_finish(&b);
+	bench_check(ufs_close(fd) == 0);
+
+	fd = ufs_open("bench", 0);
+	bench_check(fd != -1);
+	bench_start(&b, name_read);
+	for (size_t i = 0; i < count; ++i)
+		bench_check(ufs_read(fd, bench_buf, chunk) == (ssize_t)chunk);
+	b.ops = count;
+	b.bytes = total;
+	if (bench_is_enabled(name_read))
+		bench_finish(&b);
+	bench_check(ufs_close(fd) == 0);
+	bench_check(ufs_delete("bench") == 0);
+}
+
+static void
+bench_small_writes(const char *name, int flags)
+{
+	if (!bench_is_enabled(name))
+		return;
+	int count = 10 * 1000 * 1000;
+	struct bench b;
+	int fd = ufs_open("bench", UFS_CREATE | flags);
+	bench_check(fd != -1);
+	bench_start(&b, name);
+	for (int i = 0; i < count; ++i) {
+		char c = 'a' + i % 26;
+		bench_check(ufs_write(fd, &c, 1) == 1);
+	}
+	bench_check(ufs_close(fd) == 0);
+	b.ops = count;
+	b.bytes = count;
+	bench_finish(&b);
+	bench_check(ufs_delete("bench") == 0);
+}
+
+static void
+bench_random_io(const char *name, bool is_write)
+{
+	if (!bench_is_enabled(name))
+		return;
+	size_t chunk = 4096;
+	size_t count = 200 * 1000;
+	int fd = ufs_open("bench", UFS_CREATE);
+	bench_check(fd != -1);
+	for (size_t i = 0; i < BENCH_FILE_SIZE / BENCH_CHUNK_MAX; ++i) {
+		bench_check(ufs_write(fd, bench_buf, BENCH_CHUNK_MAX) ==
+			    BENCH_CHUNK_MAX);
+	}
+	uint64_t rnd = 0x9e3779b97f4a7c15ULL;
+	struct bench b;
+	bench_start(&b, name);
+	for (size_t i = 0; i < count; ++i) {
+		size_t pos = bench_rand(&rnd) % (BENCH_FILE_SIZE - chunk);
+		bench_check(ufs_seek(fd, pos) == 0);
+		ssize_t rc = is_write ? ufs_write(fd, bench_buf, chunk) :
+			ufs_read(fd, bench_buf, chunk);
+		bench_check(rc == (ssize_t)chunk);
+	}
+	b.ops = count;
+	b.bytes = count * chunk;
+	bench_finish(&b);
+	bench_check(ufs_close(fd) == 0);
+	bench_check(ufs_delete("bench") == 0);
+}
+
+static void
+bench_file_churn(void)
+{
+	if (!bench_is_enabled("file_create") &&
+	    !bench_is_enabled("file_open_close") &&
+	    !bench_is_enabled("file_delete"))
+		return;
+	int count = 1000 * 1000;
+	char name[32];
+	struct bench b;
+
+	bench_start(&b, "file_create");
+	for (int i = 0; i < count; ++i) {
+		snprintf(name, sizeof(name), "f%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		bench_check(fd != -1);
+		bench_check(ufs_close(fd) == 0);
+	}
+	b.ops = count;
+	if (bench_is_enabled(b.name))
+		bench_finish(&b);
+
+	bench_start(&b, "file_open_close");
+	for (int i = 0; i < count; ++i) {
+		snprintf(name, sizeof(name), "f%d", i);
+		int fd = ufs_open(name, 0);
+		bench_check(fd != -1);
+		bench_check(ufs_close(fd) == 0);
+	}
+	b.ops = count;
+	if (bench_is_enabled(b.name))
+		bench_finish(&b);
+
+	bench_start(&b, "file_delete");
+	for (int i = 0; i < count; ++i) {
+		snprintf(name, sizeof(name), "f%d", i);
+		bench_check(ufs_delete(name) == 0);
+	}
+	b.ops = count;
+	if (bench_is_enabled(b.name))
+		bench_finish(&b);
+}
+
+/**
+ * Many files made of a few templates. Dedup has to keep only the
+ * template blocks.
+ */
+static void
+bench_dedup(const char *name, bool is_enabled)
+{
+	if (!bench_is_enabled(name))
+		return;
+	int file_count = 64;
+	size_t file_size = 1024 * 1024;
+	int template_count = 4;
+	char path[32];
+	ufs_set_dedup(is_enabled);
+	struct bench b;
+	bench_start(&b, name);
+	for (int i = 0; i < file_count; ++i) {
+		snprintf(path, sizeof(path), "d%d", i);
+		int fd = ufs_open(path, UFS_CREATE);
+		bench_check(fd != -1);
+		memset(bench_buf, 'a' + i % template_count, BENCH_CHUNK_MAX);
+		for (size_t done = 0; done < file_size; done += BENCH_CHUNK_MAX) {
+			bench_check(ufs_write(fd, bench_buf, BENCH_CHUNK_MAX) ==
+				    BENCH_CHUNK_MAX);
+			++b.ops;
+		}
+		bench_check(ufs_close(fd) == 0);
+	}
+	b.bytes = file_count * file_size;
+	struct ufs_mem_stat st;
+	ufs_get_mem_stat(&st);
+	b.mem_bytes = st.physical_size;
+	bench_finish(&b);
+	for (int i = 0; i < file_count; ++i) {
+		snprintf(path, sizeof(path), "d%d", i);
+		bench_check(ufs_delete(path) == 0);
+	}
+	ufs_set_dedup(false);
+	memset(bench_buf, 'a', sizeof(bench_buf));
+}
+
+/**
+ * Scans of a max size file, with its blocks in huge page chunks or in
+ * small page ones. The small page chunks are advised against huge
+ * pages, so they are the baseline even with THP "always". The whole
+ * scanned volume is 1GB.
+ */
+static void
+bench_huge_scan(const char *name, bool is_huge)
+{
+	if (!bench_is_enabled(name))
+		return;
+	enum { PASS_COUNT = 10 };
+	size_t file_size = 100 * 1024 * 1024;
+	ufs_set_huge_pages(is_huge);
+	int fd = ufs_open("bench", UFS_CREATE);
+	bench_check(fd != -1);
+	for (size_t done = 0; done < file_size; done += BENCH_CHUNK_MAX)
+		bench_check(ufs_write(fd, bench_buf, BENCH_CHUNK_MAX) ==
+			    BENCH_CHUNK_MAX);
+	struct bench b;
+	bench_start(&b, name);
+	for (int i = 0; i < PASS_COUNT; ++i) {
+		bench_check(ufs_seek(fd, 0) == 0);
+		for (size_t done = 0; done < file_size;
+		     done += BENCH_CHUNK_MAX) {
+			bench_check(ufs_read(fd, bench_buf, BENCH_CHUNK_MAX) ==
+				    BENCH_CHUNK_MAX);
+			++b.ops;
+		}
+	}
+	b.bytes = PASS_COUNT * file_size;
+	bench_finish(&b);
+	bench_check(ufs_close(fd) == 0);
+	bench_check(ufs_delete("bench") == 0);
+	ufs_set_huge_pages(true);
+}
+
+/**
+ * Several writers appending records to one log file in turns. A
+ * buffered appender is flushed by the writes of the others, so the
+ * buffering helps only the runs of one writer.
+ */
+static void
+bench_append(const char *name, int flags, int run)
+{
+	if (!bench_is_enabled(name))
+		return;
+	enum { WRITER_COUNT = 8, RECORD_SIZE = 100 };
+	int fds[WRITER_COUNT];
+	for (int i = 0; i < WRITER_COUNT; ++i) {
+		fds[i] = ufs_open("log", UFS_CREATE | UFS_APPEND | flags);
+		bench_check(fds[i] != -1);
+	}
+	struct bench b;
+	bench_start(&b, name);
+	uint64_t seed = 1;
+	while (b.bytes + RECORD_SIZE * run <= BENCH_FILE_SIZE) {
+		int fd = fds[bench_rand(&seed) % WRITER_COUNT];
+		for (int i = 0; i < run; ++i) {
+			bench_check(ufs_write(fd, bench_buf, RECORD_SIZE) ==
+				    RECORD_SIZE);
+			b.bytes += RECORD_SIZE;
+			++b.ops;
+		}
+	}
+	for (int i = 0; i < WRITER_COUNT; ++i)
+		bench_check(ufs_close(fds[i]) == 0);
+	struct ufs_stat st;
+	bench_check(ufs_stat("log", &st) == 0 && st.size == b.bytes);
+	bench_finish(&b);
+	bench_check(ufs_delete("log") == 0);
+}
+
+/**
+ * Big writes through the async API, several in flight, while the caller
+ * does its own work on the buffers. With 0 workers the writes are done
+ * synchronously for comparison.
+ */
+static void
+bench_aio(const char *name, int worker_count)
+{
+	if (!bench_is_enabled(name))
+		return;
+	enum { QUEUE_SIZE = 8, REQ_SIZE = 1024 * 1024 };
+	static char bufs[QUEUE_SIZE][REQ_SIZE];
+	int fd = ufs_open("bench", UFS_CREATE);
+	bench_check(fd != -1);
+	struct ufs_aio *aio = NULL;
+	if (worker_count > 0) {
+		aio = ufs_aio_new(worker_count, QUEUE_SIZE);
+		bench_check(aio != NULL);
+	}
+	struct bench b;
+	bench_start(&b, name);
+	size_t offset = 0;
+	int in_flight = 0;
+	uint64_t sum = 0;
+	while (offset < BENCH_FILE_SIZE || in_flight > 0) {
+		int slot = -1;
+		if (in_flight == QUEUE_SIZE || offset == BENCH_FILE_SIZE) {
+			struct ufs_aio_completion c;
+			bench_check(ufs_aio_reap(aio, &c, 1, 1) == 1);
+			bench_check(c.result == REQ_SIZE);
+			slot = (int)c.user_data;
+			--in_flight;
+			if (offset == BENCH_FILE_SIZE)
+				continue;
+		} else {
+			slot = in_flight;
+		}
+		/* The caller's work: fill a buffer. */
+		for (size_t i = 0; i < REQ_SIZE; i += 64)
+			bufs[slot][i] = (char)(sum += i + offset);
+		if (aio == NULL) {
+			bench_check(ufs_pwrite(fd, bufs[slot], REQ_SIZE,
+					       offset) == REQ_SIZE);
+		} else {
+			struct ufs_aio_request req;
+			req.op = UFS_AIO_WRITE;
+			req.fd = fd;
+			req.buf = bufs[slot];
+			req.size = REQ_SIZE;
+			req.offset = offset;
+			req.user_data = slot;
+			bench_check(ufs_aio_submit(aio, &req, 1) == 1);
+			++in_flight;
+		}
+		offset += REQ_SIZE;
+		b.bytes += REQ_SIZE;
+		++b.ops;
+	}
+	bench_finish(&b);
+	if (aio != NULL)
+		ufs_aio_delete(aio);
+	bench_check(ufs_close(fd) == 0);
+	bench_check(ufs_delete("bench") == 0);
+}
+
+/** Sequential writes into a file of a known size. */
+static void
+bench_fallocate(const char *name, bool is_prealloc)
+{
+	if (!bench_is_enabled(name))
+		return;
+	enum { WRITE_SIZE = 4096 };
+	int fd = ufs_open("bench", UFS_CREATE);
+	bench_check(fd != -1);
+	struct bench b;
+	bench_start(&b, name);
+	if (is_prealloc)
+		bench_check(ufs_fallocate(fd, 0, BENCH_FILE_SIZE, 0) == 0);
+	for (size_t done = 0; done < BENCH_FILE_SIZE; done += WRITE_SIZE) {
+		bench_check(ufs_write(fd, bench_buf, WRITE_SIZE) ==
+			    WRITE_SIZE);
+		++b.ops;
+	}
+	b.bytes = BENCH_FILE_SIZE;
+	bench_finish(&b);
+	bench_check(ufs_close(fd) == 0);
+	bench_check(ufs_delete("bench") == 0);
+}
+
+/** Compression of cold text-like files and their reading back. */
+static void
+bench_compact(void)
+{
+	if (!bench_is_enabled("compact"))
+		return;
+	int file_count = 32;
+	size_t file_size = 1024 * 1024;
+	char path[32];
+	/* Random words from a small dictionary, like a text. */
+	const char *words[] = {"lorem ", "ipsum ", "dolor ", "sit ", "amet, ",
+			       "consectetur ", "adipiscing ", "elit. "};
+	uint64_t seed = 1;
+	for (size_t i = 0; i < BENCH_CHUNK_MAX;) {
+		const char *w = words[bench_rand(&seed) % 8];
+		for (; *w != 0 && i < BENCH_CHUNK_MAX; ++w, ++i)
+			bench_buf[i] = *w;
+	}
+	for (int i = 0; i < file_count; ++i) {
+		snprintf(path, sizeof(path), "c%d", i);
+		int fd = ufs_open(path, UFS_CREATE);
+		bench_check(fd != -1);
+		for (size_t done = 0; done < file_size; done += BENCH_CHUNK_MAX)
+			bench_check(ufs_write(fd, bench_buf, BENCH_CHUNK_MAX) ==
+				    BENCH_CHUNK_MAX);
+		bench_check(ufs_close(fd) == 0);
+	}
+	struct bench b;
+	struct ufs_mem_stat st;
+	bench_start(&b, "compact");
+	b.ops = ufs_compact(0);
+	b.bytes = file_count * file_size;
+	ufs_get_mem_stat(&st);
+	b.mem_bytes = st.physical_size + st.compressed_size;
+	bench_finish(&b);
+
+	bench_start(&b, "compact_read");
+	for (int i = 0; i < file_count; ++i) {
+		snprintf(path, sizeof(path), "c%d", i);
+		int fd = ufs_open(path, 0);
+		bench_check(fd != -1);
+		for (size_t done = 0; done < file_size; done += BENCH_CHUNK_MAX) {
+			bench_check(ufs_read(fd, bench_buf, BENCH_CHUNK_MAX) ==
+				    BENCH_CHUNK_MAX);
+			++b.ops;
+		}
+		bench_check(ufs_close(fd) == 0);
+	}
+	b.bytes = file_count * file_size;
+	ufs_get_mem_stat(&st);
+	b.mem_bytes = st.physical_size + st.compressed_size;
+	bench_finish(&b);
+	for (int i = 0; i < file_count; ++i) {
+		snprintf(path, sizeof(path), "c%d", i);
+		bench_check(ufs_delete(path) == 0);
+	}
+	memset(bench_buf, 'a', sizeof(bench_buf));
+}
+
+#if NEED_RESIZE
+
+static void
+bench_resize(void)
+{
+	if (!bench_is_enabled("resize"))
+		return;
+	int fd = ufs_open("bench", UFS_CREATE);
+	bench_check(fd != -1);
+	size_t step = 1024 * 1024;
+	size_t max = BENCH_FILE_SIZE;
+	struct bench b;
+	/* Growth of a written file: each step materializes one block. */
+	bench_start(&b, "resize_grow");
+	for (size_t size = step; size <= max; size += step) {
+		bench_check(ufs_resize(fd, size) == 0);
+		bench_check(ufs_seek(fd, size - 1) == 0);
+		bench_check(ufs_write(fd, "x", 1) == 1);
+		++b.ops;
+	}
+	bench_finish(&b);
+	bench_start(&b, "resize_shrink");
+	for (size_t size = max; size >= step; size -= step) {
+		bench_check(ufs_resize(fd, size - step) == 0);
+		++b.ops;
+	}
+	bench_finish(&b);
+	/* Grow and shrink a hole back and forth. */
+	bench_start(&b, "resize_flip");
+	for (int i = 0; i < 1000 * 1000; ++i) {
+		bench_check(ufs_resize(fd, (i % 2) * max) == 0);
+		++b.ops;
+	}
+	bench_finish(&b);
+	bench_check(ufs_close(fd) == 0);
+	bench_check(ufs_delete("bench") == 0);
+}
+
+#endif
+
+static void
+bench_many_descriptors(void)
+{
+	if (!bench_is_enabled("many_fds"))
+		return;
+	int fd_count = 10 * 1000;
+	int rounds = 100;
+	size_t chunk = 128;
+	int *fds = (int *)malloc(fd_count * sizeof(*fds));
+	bench_check(fds != NULL);
+	for (int i = 0; i < fd_count; ++i) {
+		fds[i] = ufs_open("bench", UFS_CREATE);
+		bench_check(fds[i] != -1);
+	}
+	struct bench b;
+	/*
+	 * The descriptors write in turn, each one at its own position, then
+	 * read the data back the same way.
+	 */
+	bench_start(&b, "many_fds_write");
+	for (int r = 0; r < rounds; ++r) {
+		for (int i = 0; i < fd_count; ++i) {
+			bench_check(ufs_write(fds[i], bench_buf, chunk) ==
+				    (ssize_t)chunk);
+		}
+	}
+	b.ops = (uint64_t)rounds * fd_count;
+	b.bytes = b.ops * chunk;
+	bench_finish(&b);
+	for (int i = 0; i < fd_count; ++i)
+		bench_check(ufs_seek(fds[i], 0) == 0);
+	bench_start(&b, "many_fds_read");
+	for (int r = 0; r < rounds; ++r) {
+		for (int i = 0; i < fd_count; ++i) {
+			bench_check(ufs_read(fds[i], bench_buf, chunk) ==
+				    (ssize_t)chunk);
+		}
+	}
+	b.ops = (uint64_t)rounds * fd_count;
+	b.bytes = b.ops * chunk;
+	bench_finish(&b);
+	for (int i = 0; i < fd_count; ++i)
+		bench_check(ufs_close(fds[i]) == 0);
+	free(fds);
+	bench_check(ufs_delete("bench") == 0);
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc > 1)
+		bench_filter = argv[1];
+	memset(bench_buf, 'a', sizeof(bench_buf));
+	printf("{\"alloc_count\": %s, \"benchmarks\": [",
+	       BENCH_HAVE_ALLOC_COUNT ? "true" : "false");
+
+	size_t chunks[] = {1, 64, 512, 4096, 65536};
+	for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); ++i)
+		bench_seq_io(chunks[i]);
+	bench_small_writes("small_write_direct", 0);
+	bench_small_writes("small_write_buffered", UFS_BUFFERED);
+	bench_random_io("random_read", false);
+	bench_random_io("random_write", true);
+	bench_dedup("dedup_off_write", false);
+	bench_dedup("dedup_on_write", true);
+	bench_compact();
+	bench_fallocate("fallocate_off_write", false);
+	bench_fallocate("fallocate_on_write", true);
+	bench_aio("aio_write_sync", 0);
+	bench_aio("aio_write_1_worker", 1);
+	bench_aio("aio_write_2_workers", 2);
+	bench_huge_scan("scan_small_pages", false);
+	bench_huge_scan("scan_huge_pages", true);
+	bench_append("append_interleaved", 0, 1);
+	bench_append("append_interleaved_buffered", UFS_BUFFERED, 1);
+	bench_append("append_runs_buffered", UFS_BUFFERED, 16);
+#if NEED_RESIZE
+	bench_resize();
+#endif
+	bench_many_descriptors();
+	/*
+	 * The last, because freeing 1M files fragments the heap, and the
+	 * next big malloc() would spend long time on its consolidation.
+	 */
+	bench_file_churn();
+
+	printf("\n]}\n");
+	ufs_destroy();
+	return 0;
+}
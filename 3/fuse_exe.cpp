@@ -0,0 +1,723 @@
+/**
+ * FUSE daemon serving userfs as a real mountable filesystem, so it can
+ * be used by unmodified programs like cp, dd, or fio:
+ *
+ *     ./ufs_fuse [fuse options] <mountpoint> [-o image=<path>]
+ *
+ * With an image option the image is loaded at start if it exists, and
+ * is saved back when the filesystem is unmounted.
+ *
+ * The low-level API is used. Inode numbers are indexes in a table of
+ * paths, because userfs has no inodes. An inode is never forgotten -
+ * the table is small compared to the file data. The requests are
+ * served by many threads, but userfs itself is not thread-safe, so
+ * all its calls are done under one mutex. Splicing is enabled both
+ * ways: the reads are replied with vmsplice() from the read buffer,
+ * and the writes come as pipes and are copied right into it.
+ */
+#define FUSE_USE_VERSION 34
+
+#include "userfs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse_lowlevel.h>
+#include <linux/falloc.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+enum {
+	/** How long the kernel may cache the attributes, in seconds. */
+	ATTR_TIMEOUT = 1,
+};
+
+/** Path of an inode which has been deleted or replaced. */
+static const char DEAD_PATH[] = "\n";
+
+static pthread_mutex_t ufs_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Paths of the inodes. An inode number is an index + 1. */
+static std::vector<std::string> inode_paths;
+static std::unordered_map<std::string, fuse_ino_t> path_inodes;
+
+struct daemon_opts {
+	char *image;
+};
+
+static const struct fuse_opt daemon_opt_spec[] = {
+	{"image=%s", offsetof(struct daemon_opts, image), 1},
+	FUSE_OPT_END,
+};
+
+static int
+errno_from_ufs(void)
+{
+	switch (ufs_errno()) {
+	case UFS_ERR_NO_ERR:
+		return 0;
+	case UFS_ERR_NO_FILE:
+		return ENOENT;
+	case UFS_ERR_NO_MEM:
+		return ENOSPC;
+	case UFS_ERR_NO_PERMISSION:
+		return EACCES;
+	case UFS_ERR_EXISTS:
+		return EEXIST;
+	case UFS_ERR_IS_DIR:
+		return EISDIR;
+	case UFS_ERR_NOT_DIR:
+		return ENOTDIR;
+	case UFS_ERR_NOT_EMPTY:
+		return ENOTEMPTY;
+	case UFS_ERR_INVALID:
+		return EINVAL;
+	case UFS_ERR_NOT_IMPLEMENTED:
+		return ENOSYS;
+	default:
+		return EIO;
+	}
+}
+
+/** Full path of a child entry. False when the parent is deleted. */
+static bool
+child_path(fuse_ino_t parent, const char *name, std::string *path)
+{
+	const std::string &dir = inode_paths[parent - 1];
+	if (dir == DEAD_PATH)
+		return false;
+	*path = dir;
+	*path += '/';
+	*path += name;
+	return true;
+}
+
+/** Get an inode of a path, a new one if the path is not known. */
+static fuse_ino_t
+inode_of(const std::string &path)
+{
+	auto it = path_inodes.find(path);
+	if (it != path_inodes.end())
+		return it->second;
+	inode_paths.push_back(path);
+	fuse_ino_t ino = inode_paths.size();
+	path_inodes.emplace(path, ino);
+	return ino;
+}
+
+/** Forget a path and the paths under it. */
+static void
+inode_drop(const std::string &path)
+{
+	std::string prefix = path + '/';
+	for (auto it = path_inodes.begin(); it != path_inodes.end();) {
+		if (it->first == path || it->first.compare(0, prefix.size(),
+							   prefix) == 0) {
+			inode_paths[it->second - 1] = DEAD_PATH;
+			it = path_inodes.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+/** Move the inodes of a path and of the paths under it. */
+static void
+inode_move(const std::string &old_path, const std::string &new_path)
+{
+	inode_drop(new_path);
+	std::string prefix = old_path + '/';
+	std::vector<std::pair<std::string, fuse_ino_t>> moved;
+	for (auto it = path_inodes.begin(); it != path_inodes.end();) {
+		if (it->first == old_path || it->first.compare(0, prefix.size(),
+							       prefix) == 0) {
+			moved.emplace_back(new_path +
+				it->first.substr(old_path.size()), it->second);
+			it = path_inodes.erase(it);
+		} else {
+			++it;
+		}
+	}
+	for (auto &it : moved) {
+		inode_paths[it.second - 1] = it.first;
+		path_inodes.emplace(it.first, it.second);
+	}
+}
+
+static void
+stat_fill(fuse_ino_t ino, const struct ufs_stat *ust, struct stat *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_ino = ino;
+	st->st_uid = getuid();
+	st->st_gid = getgid();
+	if (ust->is_dir) {
+		st->st_mode = S_IFDIR | 0755;
+		st->st_nlink = 2;
+	} else {
+		st->st_mode = S_IFREG | 0644;
+		st->st_nlink = 1;
+		st->st_size = ust->size;
+		st->st_blocks = ust->allocated / 512;
+	}
+	st->st_blksize = 4096;
+}
+
+/** Fill an entry of a path. Returns an errno. */
+static int
+entry_fill(const std::string &path, struct fuse_entry_param *e)
+{
+	struct ufs_stat ust;
+	if (ufs_stat(path.c_str(), &ust) != 0)
+		return errno_from_ufs();
+	memset(e, 0, sizeof(*e));
+	e->ino = inode_of(path);
+	e->attr_timeout = ATTR_TIMEOUT;
+	e->entry_timeout = ATTR_TIMEOUT;
+	stat_fill(e->ino, &ust, &e->attr);
+	return 0;
+}
+
+static int
+rights_from_flags(int flags)
+{
+	int result;
+	switch (flags & O_ACCMODE) {
+	case O_RDONLY:
+		result = UFS_READ_ONLY;
+		break;
+	case O_WRONLY:
+		result = UFS_WRITE_ONLY;
+		break;
+	default:
+		result = UFS_READ_WRITE;
+		break;
+	}
+	if ((flags & O_APPEND) != 0)
+		result |= UFS_APPEND;
+	return result;
+}
+
+static void
+ufs_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	(void)userdata;
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ |
+		FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+}
+
+static void
+ufs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct fuse_entry_param e;
+	int err = ENOENT;
+	pthread_mutex_lock(&ufs_lock);
+	try {
+		std::string path;
+		if (child_path(parent, name, &path))
+			err = entry_fill(path, &e);
+	} catch (const std::bad_alloc&) {
+		err = ENOMEM;
+	}
+	pthread_mutex_unlock(&ufs_lock);
+	if (err != 0)
+		fuse_reply_err(req, err);
+	else
+		fuse_reply_entry(req, &e);
+}
+
+static void
+ufs_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	(void)ino;
+	(void)nlookup;
+	fuse_reply_none(req);
+}
+
+static void
+ufs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct ufs_stat ust;
+	int rc;
+	pthread_mutex_lock(&ufs_lock);
+	if (fi != NULL)
+		rc = ufs_fstat(fi->fh, &ust);
+	else if (inode_paths[ino - 1] == DEAD_PATH)
+		rc = -1;
+	else
+		rc = ufs_stat(inode_paths[ino - 1].c_str(), &ust);
+	int err = rc == 0 ? 0 : errno_from_ufs();
+	pthread_mutex_unlock(&ufs_lock);
+	if (rc != 0) {
+		fuse_reply_err(req, err != 0 ? err : ENOENT);
+		return;
+	}
+	struct stat st;
+	stat_fill(ino, &ust, &st);
+	fuse_reply_attr(req, &st, ATTR_TIMEOUT);
+}
+
+static void
+ufs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+	       struct fuse_file_info *fi)
+{
+	/* Only the size is stored. The rest is silently ignored. */
+	if ((to_set & FUSE_SET_ATTR_SIZE) == 0) {
+		ufs_ll_getattr(req, ino, fi);
+		return;
+	}
+	int err = 0;
+	struct ufs_stat ust;
+	pthread_mutex_lock(&ufs_lock);
+	int fd = fi != NULL ? (int)fi->fh : -1;
+	if (fd < 0 && inode_paths[ino - 1] != DEAD_PATH)
+		fd = ufs_open(inode_paths[ino - 1].c_str(), 0);
+	if (fd < 0) {
+		err = inode_paths[ino - 1] == DEAD_PATH ? ENOENT :
+			errno_from_ufs();
+	} else {
+		if (ufs_resize(fd, attr->st_size) != 0)
+			err = errno_from_ufs();
+		if (err == 0 && ufs_fstat(fd, &ust) != 0)
+			err = errno_from_ufs();
+		if (fi == NULL)
+			ufs_close(fd);
+	}
+	pthread_mutex_unlock(&ufs_lock);
+	if (err != 0) {
+		fuse_reply_err(req, err);
+		return;
+	}
+	struct stat st;
+	stat_fill(ino, &ust, &st);
+	fuse_reply_attr(req, &st, ATTR_TIMEOUT);
+}
+
+static void
+ufs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	(void)mode;
+	struct fuse_entry_param e;
+	int err = ENOENT;
+	pthread_mutex_lock(&ufs_lock);
+	try {
+		std::string path;
+		if (child_path(parent, name, &path)) {
+			if (ufs_mkdir(path.c_str()) != 0)
+				err = errno_from_ufs();
+			else
+				err = entry_fill(path, &e);
+		}
+	} catch (const std::bad_alloc&) {
+		err = ENOMEM;
+	}
+	pthread_mutex_unlock(&ufs_lock);
+	if (err != 0)
+		fuse_reply_err(req, err);
+	else
+		fuse_reply_entry(req, &e);
+}
+
+static void
+ufs_ll_remove(fuse_req_t req, fuse_ino_t parent, const char *name,
+	      int (*remove)(const char *))
+{
+	int err = ENOENT;
+	pthread_mutex_lock(&ufs_lock);
+	try {
+		std::string path;
+		if (child_path(parent, name, &path)) {
+			if (remove(path.c_str()) != 0) {
+				err = errno_from_ufs();
+			} else {
+				inode_drop(path);
+				err = 0;
+			}
+		}
+	} catch (const std::bad_alloc&) {
+		err = ENOMEM;
+	}
+	pthread_mutex_unlock(&ufs_lock);
+	fuse_reply_err(req, err);
+}
+
+static void
+ufs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	ufs_ll_remove(req, parent, name, ufs_delete);
+}
+
+static void
+ufs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	ufs_ll_remove(req, parent, name, ufs_rmdir);
+}
+
+static void
+ufs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+	      fuse_ino_t newparent, const char *newname, unsigned int flags)
+{
+	if ((flags & ~RENAME_NOREPLACE) != 0) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	int err = ENOENT;
+	pthread_mutex_lock(&ufs_lock);
+	try {
+		std::string old_path, new_path;
+		struct ufs_stat ust;
+		if (!child_path(parent, name, &old_path) ||
+		    !child_path(newparent, newname, &new_path)) {
+			err = ENOENT;
+		} else if ((flags & RENAME_NOREPLACE) != 0 &&
+			   ufs_stat(new_path.c_str(), &ust) == 0) {
+			err = EEXIST;
+		} else if (ufs_rename(old_path.c_str(), new_path.c_str()) != 0) {
+			err = errno_from_ufs();
+		} else {
+			inode_move(old_path, new_path);
+			err = 0;
+		}
+	} catch (const std::bad_alloc&) {
+		err = ENOMEM;
+	}
+	pthread_mutex_unlock(&ufs_lock);
+	fuse_reply_err(req, err);
+}
+
+static void
+ufs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	int err = 0;
+	pthread_mutex_lock(&ufs_lock);
+	int fd = -1;
+	if (inode_paths[ino - 1] == DEAD_PATH)
+		err = ENOENT;
+	else
+		fd = ufs_open(inode_paths[ino - 1].c_str(),
+			      rights_from_flags(fi->flags));
+	if (err == 0 && fd < 0)
+		err = errno_from_ufs();
+	if (err == 0 && (fi->flags & O_TRUNC) != 0 &&
+	    ufs_resize(fd, 0) != 0) {
+		err = errno_from_ufs();
+		ufs_close(fd);
+	}
+	pthread_mutex_unlock(&ufs_lock);
+	if (err != 0) {
+		fuse_reply_err(req, err);
+		return;
+	}
+	fi->fh = fd;
+	fuse_reply_open(req, fi);
+}
+
+static void
+ufs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+	      mode_t mode, struct fuse_file_info *fi)
+{
+	(void)mode;
+	struct fuse_entry_param e;
+	int err = ENOENT;
+	int fd = -1;
+	pthread_mutex_lock(&ufs_lock);
+	try {
+		std::string path;
+		struct ufs_stat ust;
+		if (!child_path(parent, name, &path)) {
+			err = ENOENT;
+		} else if ((fi->flags & O_EXCL) != 0 &&
+			   ufs_stat(path.c_str(), &ust) == 0) {
+			err = EEXIST;
+		} else {
+			fd = ufs_open(path.c_str(), UFS_CREATE |
+				      rights_from_flags(fi->flags));
+			if (fd < 0)
+				err = errno_from_ufs();
+			else if ((fi->flags & O_TRUNC) != 0 &&
+				 ufs_resize(fd, 0) != 0)
+				err = errno_from_ufs();
+			else
+				err = entry_fill(path, &e);
+		}
+	} catch (const std::bad_alloc&) {
+		err = ENOMEM;
+	}
+	if (err != 0 && fd >= 0)
+		ufs_close(fd);
+	pthread_mutex_unlock(&ufs_lock);
+	if (err != 0) {
+		fuse_reply_err(req, err);
+		return;
+	}
+	fi->fh = fd;
+	fuse_reply_create(req, &e, fi);
+}
+
+static void
+ufs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+	    struct fuse_file_info *fi)
+{
+	(void)ino;
+	char *buf = (char *)malloc(size);
+	if (buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	pthread_mutex_lock(&ufs_lock);
+	ssize_t rc = ufs_seek(fi->fh, off);
+	if (rc == 0)
+		rc = ufs_read(fi->fh, buf, size);
+	int err = rc < 0 ? errno_from_ufs() : 0;
+	pthread_mutex_unlock(&ufs_lock);
+	if (rc < 0) {
+		fuse_reply_err(req, err);
+	} else {
+		struct fuse_bufvec bufv = FUSE_BUFVEC_INIT((size_t)rc);
+		bufv.buf[0].mem = buf;
+		fuse_reply_data(req, &bufv, FUSE_BUF_SPLICE_MOVE);
+	}
+	free(buf);
+}
+
+static void
+ufs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *in_buf,
+		 off_t off, struct fuse_file_info *fi)
+{
+	(void)ino;
+	size_t size = fuse_buf_size(in_buf);
+	char *buf = (char *)malloc(size);
+	if (buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	/* With splice the data is still in a pipe. Drain it first. */
+	struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+	bufv.buf[0].mem = buf;
+	ssize_t rc = fuse_buf_copy(&bufv, in_buf, (enum fuse_buf_copy_flags)0);
+	if (rc < 0) {
+		free(buf);
+		fuse_reply_err(req, -rc);
+		return;
+	}
+	pthread_mutex_lock(&ufs_lock);
+	ssize_t written = ufs_seek(fi->fh, off);
+	if (written == 0)
+		written = ufs_write(fi->fh, buf, rc);
+	int err = written < 0 ? errno_from_ufs() : 0;
+	pthread_mutex_unlock(&ufs_lock);
+	free(buf);
+	if (written < 0)
+		fuse_reply_err(req, err);
+	else
+		fuse_reply_write(req, written);
+}
+
+static void
+ufs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void)ino;
+	pthread_mutex_lock(&ufs_lock);
+	ufs_close(fi->fh);
+	pthread_mutex_unlock(&ufs_lock);
+	fuse_reply_err(req, 0);
+}
+
+static void
+ufs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset,
+		 off_t length, struct fuse_file_info *fi)
+{
+	(void)ino;
+	int ufs_mode = 0;
+	if ((mode & FALLOC_FL_KEEP_SIZE) != 0)
+		ufs_mode |= UFS_FALLOC_KEEP_SIZE;
+	if ((mode & FALLOC_FL_PUNCH_HOLE) != 0)
+		ufs_mode |= UFS_FALLOC_PUNCH_HOLE;
+	if ((mode & FALLOC_FL_ZERO_RANGE) != 0)
+		ufs_mode |= UFS_FALLOC_ZERO_RANGE;
+	if ((mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE |
+		      FALLOC_FL_ZERO_RANGE)) != 0 || offset < 0 || length <= 0) {
+		fuse_reply_err(req, EOPNOTSUPP);
+		return;
+	}
+	pthread_mutex_lock(&ufs_lock);
+	int err = 0;
+	if (ufs_fallocate(fi->fh, offset, length, ufs_mode) != 0)
+		err = errno_from_ufs();
+	pthread_mutex_unlock(&ufs_lock);
+	fuse_reply_err(req, err);
+}
+
+static void
+ufs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+	     struct fuse_file_info *fi)
+{
+	(void)ino;
+	(void)datasync;
+	(void)fi;
+	fuse_reply_err(req, 0);
+}
+
+struct dir_listing {
+	fuse_req_t req;
+	std::vector<char> *buf;
+	const std::string *path;
+};
+
+static void
+dir_listing_add(struct dir_listing *l, const char *name, fuse_ino_t ino,
+		mode_t mode)
+{
+	struct stat st;
+	memset(&st, 0, sizeof(st));
+	st.st_ino = ino;
+	st.st_mode = mode;
+	size_t old_size = l->buf->size();
+	size_t size = fuse_add_direntry(l->req, NULL, 0, name, NULL, 0);
+	l->buf->resize(old_size + size);
+	fuse_add_direntry(l->req, l->buf->data() + old_size, size, name, &st,
+			  old_size + size);
+}
+
+static int
+dir_listing_cb(const struct ufs_dirent *entry, void *arg)
+{
+	struct dir_listing *l = (struct dir_listing *)arg;
+	std::string path = *l->path + '/' + entry->name;
+	dir_listing_add(l, entry->name, inode_of(path),
+			entry->is_dir ? S_IFDIR : S_IFREG);
+	return 0;
+}
+
+static void
+ufs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+	       struct fuse_file_info *fi)
+{
+	(void)fi;
+	int err = 0;
+	std::vector<char> buf;
+	pthread_mutex_lock(&ufs_lock);
+	try {
+		/*
+		 * The listing is built anew for each call and is cut at the
+		 * requested offset. Good enough for not huge directories.
+		 */
+		std::string path = inode_paths[ino - 1];
+		struct dir_listing l = {req, &buf, &path};
+		if (path == DEAD_PATH) {
+			err = ENOENT;
+		} else {
+			dir_listing_add(&l, ".", ino, S_IFDIR);
+			dir_listing_add(&l, "..", ino, S_IFDIR);
+			if (ufs_readdir(path.c_str(), dir_listing_cb, &l) != 0)
+				err = errno_from_ufs();
+		}
+	} catch (const std::bad_alloc&) {
+		err = ENOMEM;
+	}
+	pthread_mutex_unlock(&ufs_lock);
+	if (err != 0) {
+		fuse_reply_err(req, err);
+	} else if ((size_t)off >= buf.size()) {
+		fuse_reply_buf(req, NULL, 0);
+	} else {
+		/* The kernel drops a trailing entry cut by the size limit. */
+		fuse_reply_buf(req, buf.data() + off,
+			       std::min(size, buf.size() - off));
+	}
+}
+
+static void
+ufs_ll_ops_create(struct fuse_lowlevel_ops *ops)
+{
+	memset(ops, 0, sizeof(*ops));
+	ops->init = ufs_ll_init;
+	ops->lookup = ufs_ll_lookup;
+	ops->forget = ufs_ll_forget;
+	ops->getattr = ufs_ll_getattr;
+	ops->setattr = ufs_ll_setattr;
+	ops->mkdir = ufs_ll_mkdir;
+	ops->unlink = ufs_ll_unlink;
+	ops->rmdir = ufs_ll_rmdir;
+	ops->rename = ufs_ll_rename;
+	ops->open = ufs_ll_open;
+	ops->read = ufs_ll_read;
+	ops->release = ufs_ll_release;
+	ops->fsync = ufs_ll_fsync;
+	ops->readdir = ufs_ll_readdir;
+	ops->create = ufs_ll_create;
+	ops->write_buf = ufs_ll_write_buf;
+	ops->fallocate = ufs_ll_fallocate;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct daemon_opts dopts = {NULL};
+	struct fuse_cmdline_opts opts;
+	if (fuse_opt_parse(&args, &dopts, daemon_opt_spec, NULL) != 0 ||
+	    fuse_parse_cmdline(&args, &opts) != 0)
+		return 1;
+	if (opts.show_help || opts.mountpoint == NULL) {
+		printf("usage: %s [options] <mountpoint> [-o image=<path>]\n",
+		       argv[0]);
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+		free(opts.mountpoint);
+		free(dopts.image);
+		fuse_opt_free_args(&args);
+		return opts.show_help ? 0 : 1;
+	}
+	int rc = 1;
+	struct fuse_session *se = NULL;
+	struct fuse_lowlevel_ops ops;
+	ufs_ll_ops_create(&ops);
+	/* The root is the inode 1. */
+	inode_of("");
+	if (dopts.image != NULL && access(dopts.image, F_OK) == 0 &&
+	    ufs_load(dopts.image) != 0) {
+		fprintf(stderr, "Couldn't load the image: %d\n", ufs_errno());
+		goto out_args;
+	}
+	se = fuse_session_new(&args, &ops, sizeof(ops), NULL);
+	if (se == NULL)
+		goto out_args;
+	if (fuse_set_signal_handlers(se) != 0)
+		goto out_session;
+	if (fuse_session_mount(se, opts.mountpoint) != 0)
+		goto out_signals;
+	fuse_daemonize(opts.foreground);
+	if (opts.singlethread) {
+		rc = fuse_session_loop(se);
+	} else {
+		struct fuse_loop_config config;
+		config.clone_fd = opts.clone_fd;
+		config.max_idle_threads = opts.max_idle_threads;
+		rc = fuse_session_loop_mt(se, &config);
+	}
+	fuse_session_unmount(se);
+	if (dopts.image != NULL && ufs_save(dopts.image) != 0) {
+		fprintf(stderr, "Couldn't save the image: %d\n", ufs_errno());
+		rc = 1;
+	}
+out_signals:
+	fuse_remove_signal_handlers(se);
+out_session:
+	fuse_session_destroy(se);
+out_args:
+	free(opts.mountpoint);
+	free(dopts.image);
+	fuse_opt_free_args(&args);
+	ufs_destroy();
+	return rc != 0 ? 1 : 0;
+}
@@ -0,0 +1,166 @@
+#include "lz.h"
+
+#include <stdint.h>
+
+#include <cstring>
+
+enum {
+	LZ_MIN_MATCH = 4,
+	LZ_MAX_OFFSET = 65535,
+	LZ_HASH_BITS = 12,
+	/** A length nibble with this value is continued in extra bytes. */
+	LZ_LEN_MASK = 15,
+};
+
+struct lz_writer {
+	char *pos;
+	char *end;
+	bool is_ok;
+};
+
+static void
+lz_put(lz_writer *w, const void *data, size_t size)
+{
+	if (!w->is_ok || size > static_cast<size_t>(w->end - w->pos)) {
+		w->is_ok = false;
+		return;
+	}
+	std::memcpy(w->pos, data, size);
+	w->pos += size;
+}
+
+static void
+lz_put_byte(lz_writer *w, uint8_t byte)
+{
+	lz_put(w, &byte, 1);
+}
+
+/** Put the rest of a length which didn't fit into a token nibble. */
+static void
+lz_put_len(lz_writer *w, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		lz_put_byte(w, 255);
+	lz_put_byte(w, static_cast<uint8_t>(len));
+}
+
+/** Put a sequence. A zero @a match_len means the last one, literals only. */
+static void
+lz_put_sequence(lz_writer *w, const char *literals, size_t literal_len,
+		size_t offset, size_t match_len)
+{
+	size_t lit_code = literal_len;
+	if (lit_code > LZ_LEN_MASK)
+		lit_code = LZ_LEN_MASK;
+	size_t match_code = 0;
+	if (match_len != 0) {
+		match_code = match_len - LZ_MIN_MATCH;
+		if (match_code > LZ_LEN_MASK)
+			match_code = LZ_LEN_MASK;
+	}
+	lz_put_byte(w, static_cast<uint8_t>(lit_code << 4 | match_code));
+	if (lit_code == LZ_LEN_MASK)
+		lz_put_len(w, literal_len - LZ_LEN_MASK);
+	lz_put(w, literals, literal_len);
+	if (match_len == 0)
+		return;
+	lz_put_byte(w, static_cast<uint8_t>(offset));
+	lz_put_byte(w, static_cast<uint8_t>(offset >> 8));
+	if (match_code == LZ_LEN_MASK)
+		lz_put_len(w, match_len - LZ_MIN_MATCH - LZ_LEN_MASK);
+}
+
+size_t
+lz_compress_bound(size_t size)
+{
+	return size + size / 255 + 16;
+}
+
+size_t
+lz_compress(const char *src, size_t size, char *dst, size_t capacity)
+{
+	if (size == 0)
+		return 0;
+	/* Positions + 1 of the last 4-byte sequences with a given hash. */
+	uint32_t table[1 << LZ_HASH_BITS] = {};
+	lz_writer w = {dst, dst + capacity, true};
+	size_t anchor = 0;
+	size_t pos = 0;
+	while (pos + LZ_MIN_MATCH <= size && w.is_ok) {
+		uint32_t seq;
+		std::memcpy(&seq, src + pos, sizeof(seq));
+		uint32_t hash = (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+		size_t candidate = table[hash];
+		table[hash] = static_cast<uint32_t>(pos + 1);
+		if (candidate == 0 || pos - (candidate - 1) > LZ_MAX_OFFSET ||
+		    std::memcmp(src + candidate - 1, src + pos,
+				LZ_MIN_MATCH) != 0) {
+			++pos;
+			continue;
+		}
+		size_t ref = candidate - 1;
+		size_t len = LZ_MIN_MATCH;
+		while (pos + len < size && src[ref + len] == src[pos + len])
+			++len;
+		lz_put_sequence(&w, src + anchor, pos - anchor, pos - ref, len);
+		pos += len;
+		anchor = pos;
+	}
+	lz_put_sequence(&w, src + anchor, size - anchor, 0, 0);
+	return w.is_ok ? static_cast<size_t>(w.pos - dst) : 0;
+}
+
+/** Read the rest of a length. False if the input ends. */
+static bool
+lz_get_len(const uint8_t *src, size_t size, size_t *pos, size_t *len)
+{
+	uint8_t byte;
+	do {
+		if (*pos >= size)
+			return false;
+		byte = src[(*pos)++];
+		*len += byte;
+	} while (byte == 255);
+	return true;
+}
+
+bool
+lz_decompress(const char *src_, size_t size, char *dst, size_t dst_size)
+{
+	const uint8_t *src = reinterpret_cast<const uint8_t *>(src_);
+	size_t ip = 0;
+	size_t op = 0;
+	while (ip < size) {
+		uint8_t token = src[ip++];
+		size_t literal_len = token >> 4;
+		if (literal_len == LZ_LEN_MASK &&
+		    !lz_get_len(src, size, &ip, &literal_len))
+			return false;
+		if (literal_len > size - ip || literal_len > dst_size - op)
+			return false;
+		std::memcpy(dst + op, src + ip, literal_len);
+		ip += literal_len;
+		op += literal_len;
+		if (ip == size)
+			break;
+		if (size - ip < 2)
+			return false;
+		size_t offset = src[ip] | static_cast<size_t>(src[ip + 1]) << 8;
+		ip += 2;
+		if (offset == 0 || offset > op)
+			return false;
+		size_t match_len = token & LZ_LEN_MASK;
+		if (match_len == LZ_LEN_MASK &&
+		    !lz_get_len(src, size, &ip, &match_len))
+			return false;
+		match_len += LZ_MIN_MATCH;
+		if (match_len > dst_size - op)
+			return false;
+		/* The match may overlap its own output, copy byte by byte. */
+		const char *ref = dst + op - offset;
+		for (size_t i = 0; i < match_len; ++i)
+			dst[op + i] = ref[i];
+		op += match_len;
+	}
+	return op == dst_size;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * A small LZ77 compressor in the LZ4 block format: a sequence is a token
+ * with literal and match lengths, the literals, and a 2-byte match
+ * offset. Fast to decompress, good on repetitive data, no dependencies.
+ */
+
+/** The biggest compressed size of @a size bytes. */
+size_t
+lz_compress_bound(size_t size);
+
+/**
+ * Compress @a size bytes of @a src into @a dst.
+ * @retval > 0 Compressed size.
+ * @retval 0 @a dst is too small, or @a size is 0.
+ */
+size_t
+lz_compress(const char *src, size_t size, char *dst, size_t capacity);
+
+/**
+ * Decompress @a size bytes of @a src into exactly @a dst_size bytes of
+ * @a dst. The input is validated, so a corrupted one can't make it go
+ * out of the buffers.
+ * @retval true Success.
+ * @retval false The input is corrupted.
+ */
+bool
+lz_decompress(const char *src, size_t size, char *dst, size_t dst_size);
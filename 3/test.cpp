@@ -1,8 +1,10 @@
 #include "userfs.h"
+#include "ufs_aio.h"
 #include "unit.h"
 #include <assert.h>
 #include <limits.h>
 #include <string.h>
+#include <unistd.h>
 
 static void
 test_open(void)
@@ -469,6 +471,844 @@ test_resize(void)
 #endif
 }
 
+static void
+test_sparse(void)
+{
+#if NEED_RESIZE
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	struct ufs_stat st;
+	size_t big_size = 1024 * 1024 * 100;
+	unit_check(ufs_resize(fd, big_size) == 0, "grow an empty file a lot");
+	unit_fail_if(ufs_fstat(fd, &st) != 0);
+	unit_check(st.size == big_size && st.allocated == 0,
+		   "the growth is a hole");
+	struct ufs_mem_stat mst;
+	ufs_get_mem_stat(&mst);
+	unit_check(mst.logical_size >= big_size &&
+		   mst.physical_size < big_size, "logical size is not physical");
+
+	char buf[2048];
+	memset(buf, 'x', sizeof(buf));
+	unit_check(ufs_read(fd, buf, sizeof(buf)) == sizeof(buf),
+		   "read the hole");
+	bool ok = true;
+	for (size_t i = 0; i < sizeof(buf) && ok; ++i)
+		ok = buf[i] == 0;
+	unit_check(ok, "the hole is zeros");
+	unit_check(ufs_write(fd, "abc", 3) == 3, "write in the middle");
+	unit_fail_if(ufs_fstat(fd, &st) != 0);
+	unit_check(st.allocated > 0 && st.allocated < sizeof(buf),
+		   "only the touched block is materialized");
+	unit_fail_if(ufs_close(fd) != 0);
+	/*
+	 * Shrink + grow back must not resurrect the old data.
+	 */
+	fd = ufs_open("file", 0);
+	unit_fail_if(fd == -1);
+	memset(buf, 'a', sizeof(buf));
+	unit_fail_if(ufs_write(fd, buf, sizeof(buf)) != sizeof(buf));
+	unit_fail_if(ufs_resize(fd, 10) != 0);
+	unit_fail_if(ufs_resize(fd, sizeof(buf)) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("file", 0);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_read(fd, buf, sizeof(buf)) != sizeof(buf));
+	ok = true;
+	for (size_t i = 0; i < sizeof(buf) && ok; ++i)
+		ok = buf[i] == (i < 10 ? 'a' : 0);
+	unit_check(ok, "the truncated tail reads as zeros");
+
+	unit_check(ufs_seek(fd, 5000) == 0, "seek beyond the end");
+	unit_check(ufs_read(fd, buf, sizeof(buf)) == 0, "read there is EOF");
+	unit_check(ufs_write(fd, "z", 1) == 1, "write there");
+	unit_fail_if(ufs_fstat(fd, &st) != 0);
+	unit_check(st.size == 5001, "the file grows");
+	unit_fail_if(ufs_seek(fd, 4999) != 0);
+	unit_check(ufs_read(fd, buf, 10) == 2 && buf[0] == 0 &&
+		   buf[1] == 'z', "the gap is zeros");
+	unit_check(ufs_seek(fd + 1, 0) == -1, "seek of a bad descriptor");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_memory_limit(void)
+{
+	unit_test_start();
+
+	struct ufs_mem_stat mst;
+	ufs_get_mem_stat(&mst);
+	size_t base = mst.physical_size;
+	char buf[2048];
+	memset(buf, 'a', sizeof(buf));
+	ufs_set_memory_limit(base + sizeof(buf));
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_write(fd, buf, sizeof(buf)) == sizeof(buf),
+		   "write up to the limit");
+	unit_check(ufs_write(fd, buf, 1) == -1, "can not write over it");
+	unit_check(ufs_errno() == UFS_ERR_NO_MEM, "errno is set");
+	struct ufs_stat st;
+	unit_fail_if(ufs_fstat(fd, &st) != 0);
+	unit_check(st.size == sizeof(buf), "the failed write changed nothing");
+	ufs_get_mem_stat(&mst);
+	unit_check(mst.physical_size == base + sizeof(buf) &&
+		   mst.mapped_size >= mst.physical_size &&
+		   mst.free_size + mst.physical_size <= mst.mapped_size,
+		   "memory stats are consistent");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	ufs_get_mem_stat(&mst);
+	unit_check(mst.physical_size == base, "the blocks are freed");
+	ufs_set_memory_limit(0);
+
+	unit_test_finish();
+}
+
+static void
+test_clone(void)
+{
+	unit_test_start();
+
+	char buf[2048], buf2[2048];
+	for (size_t i = 0; i < sizeof(buf); ++i)
+		buf[i] = 'a' + i % 26;
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, buf, sizeof(buf)) != sizeof(buf));
+	struct ufs_mem_stat mst1, mst2;
+	ufs_get_mem_stat(&mst1);
+
+	unit_check(ufs_clone("no_file", "copy") == -1, "clone of no file");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+	unit_check(ufs_clone("file", "copy") == 0, "clone");
+	ufs_get_mem_stat(&mst2);
+	unit_check(mst2.physical_size == mst1.physical_size,
+		   "the clone takes no memory for data");
+
+	int fd2 = ufs_open("copy", 0);
+	unit_fail_if(fd2 == -1);
+	unit_check(ufs_write(fd2, "XY", 2) == 2, "write into the clone");
+	ufs_get_mem_stat(&mst2);
+	unit_check(mst2.physical_size > mst1.physical_size &&
+		   mst2.physical_size < 2 * mst1.physical_size,
+		   "only the touched block is copied");
+	unit_fail_if(ufs_close(fd2) != 0);
+	fd2 = ufs_open("copy", 0);
+	unit_fail_if(ufs_read(fd2, buf2, sizeof(buf2)) != sizeof(buf2));
+	unit_check(memcmp(buf2, "XY", 2) == 0 &&
+		   memcmp(buf2 + 2, buf + 2, sizeof(buf) - 2) == 0,
+		   "the clone has the new data");
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("file", 0);
+	unit_fail_if(ufs_read(fd, buf2, sizeof(buf2)) != sizeof(buf2));
+	unit_check(memcmp(buf2, buf, sizeof(buf)) == 0,
+		   "the origin is not changed");
+	unit_fail_if(ufs_close(fd) != 0);
+	/*
+	 * Snapshot keeps the old content while the live files change.
+	 */
+	int snap = ufs_snapshot_create();
+	unit_check(snap >= 0, "create a snapshot");
+	fd = ufs_open("file", 0);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_resize(fd, 3) != 0);
+	unit_fail_if(ufs_write(fd, "123", 3) != 3);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("copy") != 0);
+
+	unit_check(ufs_snapshot_open(snap, "no_file") == -1,
+		   "no such file in the snapshot");
+	fd = ufs_snapshot_open(snap, "file");
+	unit_check(fd != -1, "open a file of the snapshot");
+	fd2 = ufs_snapshot_open(snap, "copy");
+	unit_check(fd2 != -1, "deleted live file is still in the snapshot");
+#if NEED_OPEN_FLAGS
+	unit_check(ufs_write(fd, "a", 1) == -1, "the snapshot is read only");
+	unit_check(ufs_errno() == UFS_ERR_NO_PERMISSION, "errno is set");
+#endif
+	unit_check(ufs_snapshot_delete(snap) == 0, "delete the snapshot");
+	unit_check(ufs_snapshot_open(snap, "file") == -1,
+		   "can not open after deletion");
+	unit_fail_if(ufs_read(fd, buf2, sizeof(buf2)) != sizeof(buf2));
+	unit_check(memcmp(buf2, buf, sizeof(buf)) == 0,
+		   "an opened descriptor still sees the old content");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_save_load(void)
+{
+	unit_test_start();
+
+	const char *path = "ufs_test.img";
+	char buf[2048], buf2[2048];
+	for (size_t i = 0; i < sizeof(buf); ++i)
+		buf[i] = 'a' + i % 26;
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, buf, sizeof(buf)) != sizeof(buf));
+	unit_fail_if(ufs_close(fd) != 0);
+#if NEED_RESIZE
+	fd = ufs_open("sparse", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_resize(fd, 10000) != 0);
+	unit_fail_if(ufs_write(fd, "end", 3) != 3);
+	unit_fail_if(ufs_close(fd) != 0);
+#endif
+	unit_fail_if(ufs_close(ufs_open("empty", UFS_CREATE)) != 0);
+
+	unit_check(ufs_save(path) == 0, "save");
+	unit_fail_if(ufs_delete("file") != 0);
+	unit_check(ufs_load("no_such_image") == -1, "load of no image");
+	unit_check(ufs_errno() == UFS_ERR_IO, "errno is set");
+	unit_check(ufs_load(path) == 0, "load");
+	struct ufs_mem_stat mst;
+	ufs_get_mem_stat(&mst);
+	unit_check(mst.image_size > 0 && mst.physical_size == 0,
+		   "the data is served from the image");
+
+	fd = ufs_open("file", 0);
+	unit_check(fd != -1, "the deleted file is back");
+	unit_fail_if(ufs_read(fd, buf2, sizeof(buf2)) != sizeof(buf2));
+	unit_check(memcmp(buf, buf2, sizeof(buf)) == 0, "with its data");
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("empty", 0);
+	unit_check(fd != -1, "empty file is loaded");
+	unit_check(ufs_read(fd, buf2, sizeof(buf2)) == 0, "and is empty");
+	unit_fail_if(ufs_close(fd) != 0);
+#if NEED_RESIZE
+	fd = ufs_open("sparse", 0);
+	unit_fail_if(fd == -1);
+	struct ufs_stat st;
+	unit_fail_if(ufs_fstat(fd, &st) != 0);
+	unit_check(st.size == 10000 && st.allocated < sizeof(buf),
+		   "holes are kept");
+	unit_check(ufs_write(fd, "xyz", 3) == 3, "write into a loaded file");
+	unit_fail_if(ufs_close(fd) != 0);
+	ufs_get_mem_stat(&mst);
+	unit_check(mst.physical_size > 0, "the written block is copied");
+	fd = ufs_open("sparse", 0);
+	unit_fail_if(ufs_read(fd, buf2, 3) != 3);
+	unit_check(memcmp(buf2, "xyz", 3) == 0, "new data is read");
+	unit_fail_if(ufs_close(fd) != 0);
+#endif
+	/*
+	 * Can overwrite the image the filesystem is loaded from.
+	 */
+	unit_check(ufs_save(path) == 0, "save into the loaded image");
+	unit_check(ufs_load(path) == 0, "load it back");
+	fd = ufs_open("file", 0);
+	unit_fail_if(ufs_read(fd, buf2, sizeof(buf2)) != sizeof(buf2));
+	unit_check(memcmp(buf, buf2, sizeof(buf)) == 0, "data is intact");
+	unit_fail_if(ufs_close(fd) != 0);
+
+	unit_fail_if(ufs_delete("file") != 0);
+	unit_fail_if(ufs_delete("empty") != 0);
+#if NEED_RESIZE
+	unit_fail_if(ufs_delete("sparse") != 0);
+#endif
+	unlink(path);
+
+	unit_test_finish();
+}
+
+static int
+test_dirs_count_cb(const struct ufs_dirent *entry, void *arg)
+{
+	int *count = (int *)arg;
+	if (entry->is_dir)
+		*count += 100;
+	else
+		*count += 1;
+	return 0;
+}
+
+static void
+test_dirs(void)
+{
+	unit_test_start();
+
+	unit_check(ufs_mkdir("a") == 0, "mkdir");
+	unit_check(ufs_mkdir("a") == -1, "mkdir of an existing dir");
+	unit_check(ufs_errno() == UFS_ERR_EXISTS, "errno is set");
+	unit_check(ufs_mkdir("x/y") == -1, "mkdir without a parent");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+	unit_check(ufs_mkdir("/a/b/") == 0, "mkdir of a nested dir");
+
+	int fd = ufs_open("a/b/file", UFS_CREATE);
+	unit_check(fd != -1, "create a file in a nested dir");
+	unit_fail_if(ufs_write(fd, "data", 4) != 4);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_open("file", 0) == -1, "the root doesn't see it");
+	fd = ufs_open("//a//b/file", 0);
+	unit_check(fd != -1, "repeated slashes are ignored");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_open("a/b", UFS_CREATE) == -1, "can't open a dir");
+	unit_check(ufs_errno() == UFS_ERR_IS_DIR, "errno is set");
+	unit_check(ufs_open("a/b/file/c", UFS_CREATE) == -1,
+		   "a file is not a dir");
+	unit_fail_if(ufs_close(ufs_open("a/f2", UFS_CREATE)) != 0);
+
+	int count = 0;
+	unit_check(ufs_readdir("a", test_dirs_count_cb, &count) == 0,
+		   "readdir");
+	unit_check(count == 101, "one dir and one file");
+	count = 0;
+	unit_check(ufs_readdir("/", test_dirs_count_cb, &count) == 0,
+		   "readdir of the root");
+	unit_check(count == 100, "one dir");
+
+	struct ufs_stat st;
+	unit_check(ufs_stat("a/b", &st) == 0 && st.is_dir, "stat of a dir");
+	unit_check(ufs_stat("a/b/file", &st) == 0 && !st.is_dir &&
+		   st.size == 4, "stat of a file");
+
+	unit_check(ufs_rmdir("a/b") == -1, "rmdir of a non-empty dir");
+	unit_check(ufs_errno() == UFS_ERR_NOT_EMPTY, "errno is set");
+	unit_check(ufs_rmdir("a/f2") == -1, "rmdir of a file");
+	unit_check(ufs_errno() == UFS_ERR_NOT_DIR, "errno is set");
+
+	fd = ufs_open("a/b/file", 0);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_rename("a/b", "c") == 0, "rename a dir");
+	unit_check(ufs_stat("a/b/file", &st) == -1, "the old path is gone");
+	unit_check(ufs_stat("c/file", &st) == 0, "the new path works");
+	unit_check(ufs_rename("c", "c/d") == -1, "move a dir into itself");
+	unit_check(ufs_errno() == UFS_ERR_INVALID, "errno is set");
+	char buf[8];
+	unit_check(ufs_read(fd, buf, sizeof(buf)) == 4 &&
+		   memcmp(buf, "data", 4) == 0, "the descriptor is still valid");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_rename("a/f2", "c/file") == 0, "replace a file");
+	unit_check(ufs_stat("c/file", &st) == 0 && st.size == 0,
+		   "the file is replaced");
+	unit_check(ufs_rename("c/file", "a") == -1, "replace a dir");
+	unit_check(ufs_errno() == UFS_ERR_EXISTS, "errno is set");
+
+	int id = ufs_snapshot_create();
+	unit_fail_if(id < 0);
+	fd = ufs_snapshot_open(id, "/c/file");
+	unit_check(fd != -1, "snapshots keep the paths");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_snapshot_delete(id) != 0);
+
+	const char *path = "ufs_test.img";
+	unit_check(ufs_save(path) == 0, "save the tree");
+	unit_fail_if(ufs_delete("c/file") != 0);
+	unit_fail_if(ufs_rmdir("c") != 0);
+	unit_check(ufs_load(path) == 0, "load the tree");
+	unit_check(ufs_stat("c/file", &st) == 0 && !st.is_dir,
+		   "the file is back");
+	unit_check(ufs_stat("a", &st) == 0 && st.is_dir,
+		   "the empty dir is back");
+	unlink(path);
+
+	unit_fail_if(ufs_delete("c/file") != 0);
+	unit_fail_if(ufs_rmdir("c") != 0);
+	unit_check(ufs_rmdir("a") == 0, "rmdir");
+	count = 0;
+	unit_fail_if(ufs_readdir("", test_dirs_count_cb, &count) != 0);
+	unit_check(count == 0, "the root is empty");
+
+	unit_test_finish();
+}
+
+static void
+test_buffered(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE | UFS_BUFFERED);
+	unit_fail_if(fd == -1);
+	int count = 10000;
+	bool ok = true;
+	for (int i = 0; i < count && ok; ++i) {
+		char c = 'a' + i % 26;
+		ok = ufs_write(fd, &c, 1) == 1;
+	}
+	unit_check(ok, "many small buffered writes");
+
+	int fd2 = ufs_open("file", 0);
+	unit_fail_if(fd2 == -1);
+	char buf[16];
+	unit_check(ufs_read(fd2, buf, 3) == 3 && memcmp(buf, "abc", 3) == 0,
+		   "another descriptor sees the buffered data");
+	struct ufs_stat st;
+	unit_fail_if(ufs_fstat(fd2, &st) != 0);
+	unit_check(st.size == (size_t)count, "and the size");
+
+	unit_fail_if(ufs_write(fd, "XY", 2) != 2);
+	unit_fail_if(ufs_write(fd2, "12", 2) != 2);
+	unit_fail_if(ufs_seek(fd2, count) != 0);
+	unit_check(ufs_read(fd2, buf, sizeof(buf)) == 2 &&
+		   memcmp(buf, "XY", 2) == 0, "an unbuffered write flushes");
+	unit_fail_if(ufs_seek(fd2, 3) != 0);
+	unit_check(ufs_read(fd2, buf, 2) == 2 && memcmp(buf, "12", 2) == 0,
+		   "and goes after the buffered data");
+
+	unit_fail_if(ufs_seek(fd, 0) != 0);
+	unit_fail_if(ufs_write(fd, "zz", 2) != 2);
+	unit_fail_if(ufs_seek(fd, 10) != 0);
+	unit_fail_if(ufs_write(fd, "qq", 2) != 2);
+	unit_fail_if(ufs_seek(fd2, 0) != 0);
+	unit_check(ufs_read(fd2, buf, 12) == 12 &&
+		   memcmp(buf, "zzc12fghijqq", 12) == 0, "seek flushes");
+#if NEED_RESIZE
+	unit_fail_if(ufs_seek(fd, count + 2) != 0);
+	unit_fail_if(ufs_write(fd, "end", 3) != 3);
+	unit_fail_if(ufs_resize(fd2, 5) != 0);
+	unit_fail_if(ufs_fstat(fd2, &st) != 0);
+	unit_check(st.size == 5, "resize goes after the buffered data");
+#endif
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	/* The buffered data of the destination is replaced by a clone. */
+	fd = ufs_open("dst", UFS_CREATE | UFS_BUFFERED);
+	unit_fail_if(fd == -1);
+	char data[100];
+	memset(data, 'x', sizeof(data));
+	unit_fail_if(ufs_write(fd, data, sizeof(data)) != sizeof(data));
+	fd2 = ufs_open("src", UFS_CREATE);
+	unit_fail_if(ufs_write(fd2, "abc", 3) != 3);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_clone("src", "dst") != 0);
+	fd2 = ufs_open("dst", 0);
+	unit_check(ufs_read(fd2, buf, sizeof(buf)) == 3 &&
+		   memcmp(buf, "abc", 3) == 0,
+		   "clone onto a buffered destination");
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_check(ufs_close(fd) == 0, "the buffer is flushed before");
+	unit_fail_if(ufs_delete("dst") != 0);
+	unit_fail_if(ufs_delete("src") != 0);
+
+	/* Zero limit means no limit, so some memory has to be taken. */
+	fd = ufs_open("fill", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, buf, sizeof(buf)) != sizeof(buf));
+	unit_fail_if(ufs_close(fd) != 0);
+	struct ufs_mem_stat mst;
+	ufs_get_mem_stat(&mst);
+	ufs_set_memory_limit(mst.physical_size);
+	fd = ufs_open("file", UFS_CREATE | UFS_BUFFERED);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_write(fd, "abc", 3) == 3, "over the limit is buffered");
+	unit_check(ufs_close(fd) == -1, "but close fails");
+	unit_check(ufs_errno() == UFS_ERR_NO_MEM, "errno is set");
+	unit_check(ufs_stat("file", &st) == 0 && st.size == 0,
+		   "the data is lost");
+	ufs_set_memory_limit(0);
+	unit_fail_if(ufs_delete("file") != 0);
+	unit_fail_if(ufs_delete("fill") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_dedup(void)
+{
+	unit_test_start();
+
+	ufs_set_dedup(true);
+	char buf[4096], buf2[4096];
+	for (size_t i = 0; i < sizeof(buf); ++i)
+		buf[i] = 'a' + i % 23;
+	struct ufs_mem_stat mst1, mst2;
+	ufs_get_mem_stat(&mst1);
+	int fd1 = ufs_open("file1", UFS_CREATE);
+	int fd2 = ufs_open("file2", UFS_CREATE);
+	unit_fail_if(fd1 == -1 || fd2 == -1);
+	unit_fail_if(ufs_write(fd1, buf, sizeof(buf)) != sizeof(buf));
+	/* Small pieces, so the blocks are completed by different writes. */
+	for (size_t i = 0; i < sizeof(buf); i += 100) {
+		size_t size = sizeof(buf) - i < 100 ? sizeof(buf) - i : 100;
+		unit_fail_if(ufs_write(fd2, buf + i, size) != (ssize_t)size);
+	}
+	ufs_get_mem_stat(&mst2);
+	unit_check(mst2.physical_size - mst1.physical_size == sizeof(buf),
+		   "equal files take memory once");
+	unit_check(mst2.dedup_logical_size == 2 * mst2.dedup_size,
+		   "dedup ratio is 2");
+
+	unit_fail_if(ufs_seek(fd2, 10) != 0);
+	unit_fail_if(ufs_write(fd2, "XYZ", 3) != 3);
+	unit_fail_if(ufs_seek(fd1, 0) != 0);
+	unit_fail_if(ufs_read(fd1, buf2, sizeof(buf2)) != sizeof(buf2));
+	unit_check(memcmp(buf, buf2, sizeof(buf)) == 0,
+		   "a write into a shared block copies it");
+	unit_fail_if(ufs_seek(fd2, 0) != 0);
+	unit_fail_if(ufs_read(fd2, buf2, sizeof(buf2)) != sizeof(buf2));
+	unit_check(memcmp(buf2 + 10, "XYZ", 3) == 0, "and changes the copy");
+	/* Write the old data back, the block becomes shared again. */
+	unit_fail_if(ufs_seek(fd2, 0) != 0);
+	unit_fail_if(ufs_write(fd2, buf, 512) != 512);
+	ufs_get_mem_stat(&mst2);
+	unit_check(mst2.physical_size - mst1.physical_size == sizeof(buf),
+		   "restored block is shared again");
+
+	int fd3 = ufs_open("zeros", UFS_CREATE);
+	unit_fail_if(fd3 == -1);
+	memset(buf2, 0, sizeof(buf2));
+	unit_fail_if(ufs_write(fd3, buf2, sizeof(buf2)) != sizeof(buf2));
+	struct ufs_stat st;
+	unit_fail_if(ufs_fstat(fd3, &st) != 0);
+	unit_check(st.size == sizeof(buf2) && st.allocated == 0,
+		   "zero blocks become holes");
+
+	unit_fail_if(ufs_close(fd1) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_close(fd3) != 0);
+	unit_fail_if(ufs_delete("file1") != 0);
+	unit_fail_if(ufs_delete("file2") != 0);
+	unit_fail_if(ufs_delete("zeros") != 0);
+	ufs_get_mem_stat(&mst2);
+	unit_check(mst2.physical_size == mst1.physical_size &&
+		   mst2.dedup_size == 0, "all is freed");
+	ufs_set_dedup(false);
+
+	unit_test_finish();
+}
+
+static void
+test_append(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("log", UFS_CREATE);
+	int fd1 = ufs_open("log", UFS_APPEND);
+	int fd2 = ufs_open("log", UFS_APPEND | UFS_BUFFERED);
+	unit_fail_if(fd == -1 || fd1 == -1 || fd2 == -1);
+	unit_fail_if(ufs_write(fd, "0123", 4) != 4);
+	unit_fail_if(ufs_write(fd1, "a", 1) != 1);
+	unit_fail_if(ufs_write(fd2, "b", 1) != 1);
+	unit_fail_if(ufs_write(fd2, "c", 1) != 1);
+	unit_fail_if(ufs_write(fd1, "d", 1) != 1);
+	unit_fail_if(ufs_seek(fd1, 0) != 0);
+	unit_fail_if(ufs_write(fd1, "e", 1) != 1);
+	/* A plain descriptor overwrites, and the appends still go last. */
+	unit_fail_if(ufs_write(fd, "XY", 2) != 2);
+	unit_fail_if(ufs_write(fd2, "f", 1) != 1);
+
+	char buf[16];
+	unit_fail_if(ufs_seek(fd, 0) != 0);
+	unit_check(ufs_read(fd, buf, sizeof(buf)) == 10 &&
+		   memcmp(buf, "0123XYcdef", 10) == 0, "writes go to the end");
+	unit_check(ufs_read(fd1, buf, sizeof(buf)) == 1 && buf[0] == 'f',
+		   "position is after the own written data");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_close(fd1) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("log") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_huge_pages(void)
+{
+	unit_test_start();
+
+	static char buf[64 * 1024];
+	memset(buf, 'x', sizeof(buf));
+	size_t size = 5 * 1024 * 1024;
+	struct ufs_mem_stat mst;
+	int fd = ufs_open("small", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, buf, sizeof(buf)) != sizeof(buf));
+	ufs_get_mem_stat(&mst);
+	unit_check(mst.huge_mapped_size == 0, "small file has small pages");
+
+	int fd2 = ufs_open("big", UFS_CREATE);
+	unit_fail_if(fd2 == -1);
+	for (size_t done = 0; done < size; done += sizeof(buf))
+		unit_fail_if(ufs_write(fd2, buf, sizeof(buf)) != sizeof(buf));
+	ufs_get_mem_stat(&mst);
+	unit_check(mst.huge_mapped_size != 0, "big file tail has huge pages");
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("big") != 0);
+
+	ufs_set_huge_pages(false);
+	fd2 = ufs_open("big", UFS_CREATE);
+	unit_fail_if(fd2 == -1);
+	for (size_t done = 0; done < size; done += sizeof(buf))
+		unit_fail_if(ufs_write(fd2, buf, sizeof(buf)) != sizeof(buf));
+	unit_fail_if(ufs_seek(fd2, size - 3) != 0);
+	unit_check(ufs_read(fd2, buf, 10) == 3 && memcmp(buf, "xxx", 3) == 0,
+		   "data is the same");
+	ufs_get_mem_stat(&mst);
+	/* One empty huge chunk is kept cached. */
+	unit_check(mst.huge_mapped_size <= 2 * 1024 * 1024,
+		   "no huge pages when disabled");
+	ufs_set_huge_pages(true);
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("small") != 0);
+	unit_fail_if(ufs_delete("big") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_aio(void)
+{
+	unit_test_start();
+
+	enum { REQ_COUNT = 16, REQ_SIZE = 64 * 1024 };
+	static char bufs[REQ_COUNT][REQ_SIZE];
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	struct ufs_aio *aio = ufs_aio_new(3, REQ_COUNT);
+	unit_fail_if(aio == NULL);
+
+	struct ufs_aio_request reqs[REQ_COUNT + 1];
+	for (int i = 0; i < REQ_COUNT; ++i) {
+		memset(bufs[i], 'a' + i, REQ_SIZE);
+		reqs[i].op = UFS_AIO_WRITE;
+		reqs[i].fd = fd;
+		reqs[i].buf = bufs[i];
+		reqs[i].size = REQ_SIZE;
+		reqs[i].offset = (size_t)i * REQ_SIZE;
+		reqs[i].user_data = i;
+	}
+	reqs[REQ_COUNT] = reqs[0];
+	unit_check(ufs_aio_submit(aio, reqs, REQ_COUNT + 1) == REQ_COUNT,
+		   "submit is limited by the queue size");
+	struct ufs_aio_completion cqes[REQ_COUNT];
+	int count = 0;
+	bool ok = true;
+	while (count < REQ_COUNT) {
+		int rc = ufs_aio_reap(aio, cqes, REQ_COUNT, 1);
+		for (int i = 0; i < rc; ++i) {
+			ok = ok && cqes[i].result == REQ_SIZE &&
+			     cqes[i].error == UFS_ERR_NO_ERR;
+		}
+		count += rc;
+	}
+	unit_check(ok, "all writes are done");
+	unit_check(ufs_aio_reap(aio, cqes, REQ_COUNT, 1) == 0,
+		   "reap doesn't wait when nothing is in flight");
+
+	for (int i = 0; i < REQ_COUNT; ++i) {
+		memset(bufs[i], 0, REQ_SIZE);
+		reqs[i].op = UFS_AIO_READ;
+		reqs[i].offset = (size_t)(REQ_COUNT - 1 - i) * REQ_SIZE;
+	}
+	reqs[0].fd = fd + 100;
+	unit_fail_if(ufs_aio_submit(aio, reqs, REQ_COUNT) != REQ_COUNT);
+	unit_fail_if(ufs_aio_reap(aio, cqes, REQ_COUNT, REQ_COUNT) !=
+		     REQ_COUNT);
+	ok = true;
+	for (int i = 0; i < REQ_COUNT; ++i) {
+		int id = (int)cqes[i].user_data;
+		if (id == 0) {
+			unit_check(cqes[i].result == -1 &&
+				   cqes[i].error == UFS_ERR_NO_FILE,
+				   "error is in the completion");
+			continue;
+		}
+		char c = 'a' + REQ_COUNT - 1 - id;
+		ok = ok && cqes[i].result == REQ_SIZE && bufs[id][0] == c &&
+		     bufs[id][REQ_SIZE - 1] == c;
+	}
+	unit_check(ok, "all reads are done");
+
+	reqs[0].op = UFS_AIO_RESIZE;
+	reqs[0].fd = fd;
+	reqs[0].size = 10;
+	unit_fail_if(ufs_aio_submit(aio, reqs, 1) != 1);
+	ufs_aio_delete(aio);
+	struct ufs_stat st;
+	unit_fail_if(ufs_fstat(fd, &st) != 0);
+	unit_check(st.size == 10, "delete waits for the requests");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_fallocate(void)
+{
+	unit_test_start();
+
+	static char buf[64 * 1024], buf2[64 * 1024];
+	memset(buf, 'x', sizeof(buf));
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	struct ufs_mem_stat mst1, mst2;
+	struct ufs_stat st;
+	ufs_get_mem_stat(&mst1);
+	unit_fail_if(ufs_fallocate(fd, 0, sizeof(buf), 0) != 0);
+	unit_fail_if(ufs_fstat(fd, &st) != 0);
+	unit_check(st.size == sizeof(buf) && st.allocated == sizeof(buf),
+		   "preallocation extends the file");
+	for (size_t i = 0; i < sizeof(buf); i += 100) {
+		size_t size = sizeof(buf) - i < 100 ? sizeof(buf) - i : 100;
+		unit_fail_if(ufs_write(fd, buf, size) != (ssize_t)size);
+	}
+	ufs_get_mem_stat(&mst2);
+	unit_check(mst2.physical_size - mst1.physical_size == sizeof(buf),
+		   "writes don't allocate more");
+
+	unit_fail_if(ufs_fallocate(fd, sizeof(buf), sizeof(buf),
+				   UFS_FALLOC_KEEP_SIZE) != 0);
+	unit_fail_if(ufs_fstat(fd, &st) != 0);
+	unit_check(st.size == sizeof(buf) && st.allocated == 2 * sizeof(buf),
+		   "keep size allocates beyond the end");
+	unit_fail_if(ufs_seek(fd, 0) != 0);
+	unit_check(ufs_read(fd, buf2, sizeof(buf2)) == sizeof(buf),
+		   "but reads stop at the end");
+	unit_fail_if(ufs_write(fd, "end", 3) != 3);
+	unit_fail_if(ufs_seek(fd, sizeof(buf)) != 0);
+	unit_check(ufs_read(fd, buf2, 10) == 3 &&
+		   memcmp(buf2, "end", 3) == 0, "and writes there fit");
+
+	unit_fail_if(ufs_fallocate(fd, 1000, 3000,
+				   UFS_FALLOC_PUNCH_HOLE) != 0);
+	unit_fail_if(ufs_fstat(fd, &st) != 0);
+	unit_check(st.allocated == 2 * sizeof(buf) - 5 * 512,
+		   "punch frees the whole blocks");
+	unit_fail_if(ufs_fallocate(fd, 5000, 10, UFS_FALLOC_ZERO_RANGE) != 0);
+	unit_fail_if(ufs_seek(fd, 0) != 0);
+	unit_fail_if(ufs_read(fd, buf2, 6000) != 6000);
+	bool ok = true;
+	for (size_t i = 0; i < 6000; ++i) {
+		bool is_zero = (i >= 1000 && i < 4000) || (i >= 5000 && i < 5010);
+		ok = ok && buf2[i] == (is_zero ? 0 : 'x');
+	}
+	unit_check(ok, "punched and zeroed ranges read as zeros");
+
+	unit_check(ufs_fallocate(fd, 0, 0, 0) == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID, "empty range");
+	unit_check(ufs_fallocate(fd, 0, 10, UFS_FALLOC_PUNCH_HOLE |
+				 UFS_FALLOC_ZERO_RANGE) == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID, "conflicting modes");
+	ufs_get_mem_stat(&mst2);
+	ufs_set_memory_limit(mst2.physical_size + 4096);
+	unit_check(ufs_fallocate(fd, 0, 1024 * 1024, 0) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_MEM, "over the limit");
+	ufs_set_memory_limit(0);
+	ufs_get_mem_stat(&mst1);
+	unit_fail_if(ufs_fstat(fd, &st) != 0);
+	unit_check(mst1.physical_size == mst2.physical_size &&
+		   st.size == sizeof(buf) + 3, "nothing is changed");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	/* A punch inside one shared block copies it once. */
+	fd = ufs_open("a", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, buf, sizeof(buf)) != sizeof(buf));
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_clone("a", "b") != 0);
+	fd = ufs_open("b", 0);
+	unit_fail_if(fd == -1);
+	ufs_get_mem_stat(&mst1);
+	ufs_set_memory_limit(mst1.physical_size + 512);
+	unit_check(ufs_fallocate(fd, 100, 100, UFS_FALLOC_PUNCH_HOLE |
+				 UFS_FALLOC_KEEP_SIZE) == 0,
+		   "punch inside a shared block with one free block");
+	ufs_set_memory_limit(0);
+	unit_fail_if(ufs_seek(fd, 0) != 0);
+	unit_fail_if(ufs_read(fd, buf2, 300) != 300);
+	ok = true;
+	for (size_t i = 0; i < 300; ++i)
+		ok = ok && buf2[i] == (i >= 100 && i < 200 ? 0 : buf[i]);
+	unit_check(ok, "the punched clone");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("a") != 0);
+	unit_fail_if(ufs_delete("b") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_compact(void)
+{
+	unit_test_start();
+
+	static char buf[100 * 1024], buf2[100 * 1024];
+	for (size_t i = 0; i < sizeof(buf); ++i)
+		buf[i] = 'a' + i % 23;
+	int fd1 = ufs_open("cold", UFS_CREATE);
+	int fd2 = ufs_open("noise", UFS_CREATE);
+	int fd3 = ufs_open("hot", UFS_CREATE);
+	unit_fail_if(fd1 == -1 || fd2 == -1 || fd3 == -1);
+	unit_fail_if(ufs_write(fd1, buf, sizeof(buf)) != sizeof(buf));
+	unsigned seed = 1;
+	for (size_t i = 0; i < 4096; ++i) {
+		seed = seed * 1103515245 + 12345;
+		buf2[i] = seed >> 16;
+	}
+	unit_fail_if(ufs_write(fd2, buf2, 4096) != 4096);
+	unit_fail_if(ufs_write(fd3, buf, 4096) != 4096);
+
+	struct ufs_mem_stat mst1, mst2;
+	ufs_get_mem_stat(&mst1);
+	unit_check(ufs_compact(mst1.physical_size) == 0,
+		   "nothing to do within the budget");
+	unit_check(ufs_compact(8192) == 1, "only the cold file is compressed");
+	ufs_get_mem_stat(&mst2);
+	unit_check(mst2.physical_size == mst1.physical_size - sizeof(buf),
+		   "its blocks are freed");
+	unit_check(mst2.compressed_logical_size == sizeof(buf) &&
+		   mst2.compressed_size < sizeof(buf) / 8, "data is compressed");
+	struct ufs_stat st;
+	unit_fail_if(ufs_fstat(fd1, &st) != 0);
+	unit_check(st.size == sizeof(buf) &&
+		   st.allocated == mst2.compressed_size,
+		   "stat shows the compressed size");
+
+	unit_check(ufs_compact(0) == 1, "hot file goes next");
+	unit_check(ufs_compact(0) == 0, "random data is not compressed");
+
+	unit_fail_if(ufs_seek(fd1, 0) != 0);
+	unit_fail_if(ufs_read(fd1, buf2, sizeof(buf2)) != sizeof(buf));
+	unit_check(memcmp(buf, buf2, sizeof(buf)) == 0, "read decompresses");
+	unit_fail_if(ufs_seek(fd3, 100) != 0);
+	unit_fail_if(ufs_write(fd3, "XYZ", 3) != 3);
+	unit_fail_if(ufs_seek(fd3, 0) != 0);
+	unit_fail_if(ufs_read(fd3, buf2, 4096) != 4096);
+	unit_check(memcmp(buf2, buf, 100) == 0 &&
+		   memcmp(buf2 + 100, "XYZ", 3) == 0 &&
+		   memcmp(buf2 + 103, buf + 103, 4096 - 103) == 0,
+		   "write decompresses");
+	ufs_get_mem_stat(&mst2);
+	unit_check(mst2.compressed_size == 0 &&
+		   mst2.physical_size == mst1.physical_size,
+		   "all is decompressed");
+
+	unit_check(ufs_compact(0) == 2, "compress again");
+	unit_fail_if(ufs_close(fd1) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_close(fd3) != 0);
+	unit_fail_if(ufs_delete("cold") != 0);
+	unit_fail_if(ufs_delete("noise") != 0);
+	unit_fail_if(ufs_delete("hot") != 0);
+	ufs_get_mem_stat(&mst2);
+	unit_check(mst2.compressed_size == 0 &&
+		   mst2.compressed_logical_size == 0, "delete drops the data");
+
+	unit_test_finish();
+}
+
 int
 main(int argc, char **argv)
 {
@@ -493,6 +1333,18 @@ main(int argc, char **argv)
 	test_max_file_size();
 	test_rights();
 	test_resize();
+	test_sparse();
+	test_memory_limit();
+	test_clone();
+	test_save_load();
+	test_dirs();
+	test_buffered();
+	test_dedup();
+	test_append();
+	test_huge_pages();
+	test_aio();
+	test_fallocate();
+	test_compact();
 
 	/* Free the memory to make the memory leak detector happy. */
 	ufs_destroy();
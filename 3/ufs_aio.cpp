@@ -0,0 +1,174 @@
+#include "ufs_aio.h"
+
+#include <new>
+#include <pthread.h>
+#include <vector>
+
+/** Serializes all the requests of all the contexts, userfs is global. */
+static pthread_mutex_t ufs_aio_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct ufs_aio {
+	std::vector<pthread_t> threads;
+	/** Submission ring. The requests wait there for a worker. */
+	std::vector<ufs_aio_request> sq;
+	/** Completion ring. The results wait there to be reaped. */
+	std::vector<ufs_aio_completion> cq;
+	/** Ring positions. They only grow and wrap around the capacity. */
+	size_t sq_head = 0;
+	size_t sq_tail = 0;
+	size_t cq_head = 0;
+	size_t cq_tail = 0;
+	/**
+	 * Requests submitted and not reaped. Limited by the capacity, so
+	 * neither ring overflows.
+	 */
+	size_t in_flight = 0;
+	bool is_stopping = false;
+	pthread_mutex_t mutex;
+	/** Signaled when a request is submitted or on stop. */
+	pthread_cond_t sq_cond;
+	/** Signaled when a request is completed. */
+	pthread_cond_t cq_cond;
+};
+
+static ufs_aio_completion
+ufs_aio_execute(const ufs_aio_request *req)
+{
+	ufs_aio_completion result;
+	result.user_data = req->user_data;
+	pthread_mutex_lock(&ufs_aio_lock);
+	switch (req->op) {
+	case UFS_AIO_READ:
+		result.result = ufs_pread(req->fd, req->buf, req->size,
+					  req->offset);
+		result.error = ufs_errno();
+		break;
+	case UFS_AIO_WRITE:
+		result.result = ufs_pwrite(req->fd, req->buf, req->size,
+					   req->offset);
+		result.error = ufs_errno();
+		break;
+	case UFS_AIO_RESIZE:
+#if NEED_RESIZE
+		result.result = ufs_resize(req->fd, req->size);
+		result.error = ufs_errno();
+#else
+		result.result = -1;
+		result.error = UFS_ERR_NOT_IMPLEMENTED;
+#endif
+		break;
+	default:
+		result.result = -1;
+		result.error = UFS_ERR_INVALID;
+		break;
+	}
+	pthread_mutex_unlock(&ufs_aio_lock);
+	return result;
+}
+
+static void *
+ufs_aio_worker(void *arg)
+{
+	ufs_aio *aio = static_cast<ufs_aio *>(arg);
+	size_t capacity = aio->sq.size();
+	pthread_mutex_lock(&aio->mutex);
+	while (true) {
+		while (aio->sq_head == aio->sq_tail && !aio->is_stopping)
+			pthread_cond_wait(&aio->sq_cond, &aio->mutex);
+		if (aio->sq_head == aio->sq_tail) {
+			pthread_mutex_unlock(&aio->mutex);
+			return nullptr;
+		}
+		ufs_aio_request req = aio->sq[aio->sq_head++ % capacity];
+		pthread_mutex_unlock(&aio->mutex);
+
+		ufs_aio_completion done = ufs_aio_execute(&req);
+
+		pthread_mutex_lock(&aio->mutex);
+		aio->cq[aio->cq_tail++ % capacity] = done;
+		pthread_cond_broadcast(&aio->cq_cond);
+	}
+}
+
+void
+ufs_aio_delete(struct ufs_aio *aio)
+{
+	pthread_mutex_lock(&aio->mutex);
+	aio->is_stopping = true;
+	pthread_cond_broadcast(&aio->sq_cond);
+	pthread_mutex_unlock(&aio->mutex);
+	for (pthread_t tid : aio->threads)
+		pthread_join(tid, nullptr);
+	pthread_cond_destroy(&aio->cq_cond);
+	pthread_cond_destroy(&aio->sq_cond);
+	pthread_mutex_destroy(&aio->mutex);
+	delete aio;
+}
+
+struct ufs_aio *
+ufs_aio_new(int worker_count, int queue_size)
+{
+	if (worker_count <= 0 || queue_size <= 0)
+		return nullptr;
+	ufs_aio *aio = nullptr;
+	try {
+		aio = new ufs_aio();
+		aio->sq.resize(queue_size);
+		aio->cq.resize(queue_size);
+		aio->threads.reserve(worker_count);
+	} catch (const std::bad_alloc&) {
+		delete aio;
+		return nullptr;
+	}
+	pthread_mutex_init(&aio->mutex, nullptr);
+	pthread_cond_init(&aio->sq_cond, nullptr);
+	pthread_cond_init(&aio->cq_cond, nullptr);
+	for (int i = 0; i < worker_count; ++i) {
+		pthread_t tid;
+		if (pthread_create(&tid, nullptr, ufs_aio_worker, aio) != 0) {
+			ufs_aio_delete(aio);
+			return nullptr;
+		}
+		aio->threads.push_back(tid);
+	}
+	return aio;
+}
+
+int
+ufs_aio_submit(struct ufs_aio *aio, const struct ufs_aio_request *reqs,
+	       int count)
+{
+	size_t capacity = aio->sq.size();
+	pthread_mutex_lock(&aio->mutex);
+	int submitted = 0;
+	for (; submitted < count && aio->in_flight < capacity; ++submitted) {
+		aio->sq[aio->sq_tail++ % capacity] = reqs[submitted];
+		++aio->in_flight;
+	}
+	if (submitted == 1)
+		pthread_cond_signal(&aio->sq_cond);
+	else if (submitted > 1)
+		pthread_cond_broadcast(&aio->sq_cond);
+	pthread_mutex_unlock(&aio->mutex);
+	return submitted;
+}
+
+int
+ufs_aio_reap(struct ufs_aio *aio, struct ufs_aio_completion *out, int max,
+	     int min)
+{
+	size_t capacity = aio->cq.size();
+	pthread_mutex_lock(&aio->mutex);
+	size_t wait_count = min > 0 ? min : 0;
+	if (wait_count > aio->in_flight)
+		wait_count = aio->in_flight;
+	while (aio->cq_tail - aio->cq_head < wait_count)
+		pthread_cond_wait(&aio->cq_cond, &aio->mutex);
+	int reaped = 0;
+	for (; reaped < max && aio->cq_head != aio->cq_tail; ++reaped) {
+		out[reaped] = aio->cq[aio->cq_head++ % capacity];
+		--aio->in_flight;
+	}
+	pthread_mutex_unlock(&aio->mutex);
+	return reaped;
+}
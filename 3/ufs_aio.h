@@ -0,0 +1,91 @@
+#pragma once
+
+#include "userfs.h"
+
+#include <stdint.h>
+
+/**
+ * Asynchronous userfs API. Requests are put into a submission queue,
+ * executed by a pool of worker threads, and their results are taken
+ * from a completion queue. Both queues are rings of a fixed capacity,
+ * and several requests can be submitted and reaped in one call.
+ *
+ * userfs itself is not thread safe, so the workers execute the
+ * requests one at a time under a global lock. The gain is that the
+ * caller doesn't wait for them and can do other work meanwhile. For
+ * the same reason the caller must not call the synchronous ufs_*()
+ * functions while it has requests in flight. ufs_errno() is not
+ * meaningful then either, the error of each request is returned in
+ * its completion.
+ */
+
+enum ufs_aio_op {
+	/** ufs_pread(fd, buf, size, offset). */
+	UFS_AIO_READ,
+	/** ufs_pwrite(fd, buf, size, offset). */
+	UFS_AIO_WRITE,
+	/** ufs_resize(fd, size). */
+	UFS_AIO_RESIZE,
+};
+
+struct ufs_aio_request {
+	enum ufs_aio_op op;
+	int fd;
+	/**
+	 * Buffer to read into or to write from. It must stay valid until
+	 * the request completes.
+	 */
+	char *buf;
+	size_t size;
+	size_t offset;
+	/** Any value of the caller, returned in the completion. */
+	uint64_t user_data;
+};
+
+struct ufs_aio_completion {
+	uint64_t user_data;
+	/** Result of the synchronous function, -1 on error. */
+	ssize_t result;
+	enum ufs_error_code error;
+};
+
+struct ufs_aio;
+
+/**
+ * Create an async context.
+ * @param worker_count Number of the worker threads.
+ * @param queue_size Max number of the requests submitted and not
+ *        reaped yet.
+ * @retval NULL Invalid arguments or no memory.
+ */
+struct ufs_aio *
+ufs_aio_new(int worker_count, int queue_size);
+
+/**
+ * Wait for all the submitted requests to complete and delete the
+ * context. Completions not reaped yet are dropped.
+ */
+void
+ufs_aio_delete(struct ufs_aio *aio);
+
+/**
+ * Submit requests. Never blocks.
+ * @retval Number of the submitted requests. It is less than @a count
+ *         when the queue is full.
+ */
+int
+ufs_aio_submit(struct ufs_aio *aio, const struct ufs_aio_request *reqs,
+	       int count);
+
+/**
+ * Take completions of the finished requests, in the order of
+ * completion.
+ * @param[out] out Completions.
+ * @param max Max number of completions to take.
+ * @param min Wait until at least this many are ready. It is cut to
+ *        the number of the requests in flight, so it doesn't hang.
+ * @retval Number of the taken completions.
+ */
+int
+ufs_aio_reap(struct ufs_aio *aio, struct ufs_aio_completion *out, int max,
+	     int min);
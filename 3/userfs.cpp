@@ -1,17 +1,46 @@
 #include "userfs.h"
+#include "lz.h"
 
 #include "rlist.h"
 
 #include <stddef.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
 #include <cstring>
 #include <new>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 enum {
 	BLOCK_SIZE = 512,
 	MAX_FILE_SIZE = 1024 * 1024 * 100,
+	/** Max number of resolved directory paths kept in the cache. */
+	DENTRY_CACHE_MAX = 64 * 1024,
+	/**
+	 * Capacity of a descriptor write buffer. Bigger writes go to the
+	 * blocks directly.
+	 */
+	WRITE_BUFFER_SIZE = 16 * BLOCK_SIZE,
+	/** Blocks are carved from mmap()ed chunks of this size and alignment. */
+	CHUNK_SIZE = 2 * 1024 * 1024,
+	/**
+	 * Blocks of a compressed file are compressed in segments of this
+	 * many blocks, so compression doesn't need a copy of the whole file.
+	 */
+	PACK_SEGMENT_BLOCKS = 128,
+	/**
+	 * File blocks beyond this offset are taken from the chunks backed
+	 * by huge pages, see ufs_set_huge_pages().
+	 */
+	HUGE_FILE_THRESHOLD = 2 * CHUNK_SIZE,
 };
 
 /** Global error code. Set from any function on any error. */
@@ -20,43 +49,236 @@ static ufs_error_code g_ufs_error_code = UFS_ERR_NO_ERR;
 struct block {
 	/** Block memory. */
 	char memory[BLOCK_SIZE];
-	/** A link in the block list of the owner-file. */
-	rlist in_block_list = RLIST_LINK_INITIALIZER;
+};
+
+/** A free block keeps a link to the next free one in its memory. */
+struct free_block {
+	free_block *next;
+};
+
+/**
+ * A chunk of blocks. The header lies in the first blocks of the chunk,
+ * the rest are the blocks themselves. Chunks are aligned by their size,
+ * so the chunk of any block is found by masking its address.
+ */
+struct block_chunk {
+	/** A link in the list of chunks having free blocks. */
+	rlist in_free_list;
+	/** Blocks freed back to the chunk. */
+	free_block *free_blocks;
+	/**
+	 * Index of the first block never allocated. The blocks are carved
+	 * lazily not to touch the whole chunk memory on creation.
+	 */
+	size_t carve_index;
+	/** Number of allocated blocks. */
+	size_t used;
+	/** The chunk is backed by a huge page. */
+	bool is_huge;
+	/**
+	 * Reference counters of the blocks, indexed by the block position in
+	 * the chunk. A block is shared by files after clone or snapshot and
+	 * is copied on write.
+	 */
+	uint32_t block_refs[CHUNK_SIZE / BLOCK_SIZE];
+	/** The blocks which are in the dedup table. */
+	bool block_is_deduped[CHUNK_SIZE / BLOCK_SIZE];
+};
+
+enum {
+	CHUNK_HEADER_BLOCKS =
+		(sizeof(block_chunk) + BLOCK_SIZE - 1) / BLOCK_SIZE,
+	CHUNK_BLOCKS = CHUNK_SIZE / BLOCK_SIZE - CHUNK_HEADER_BLOCKS,
+};
+
+/** Chunks of one kind, either with huge pages or without. */
+struct block_pool {
+	/** Chunks which have free blocks. */
+	rlist free_chunks = RLIST_HEAD_INITIALIZER(free_chunks);
+	/**
+	 * A fully free chunk is kept instead of being unmapped right away,
+	 * so as not to mmap() and munmap() on each block churn at a chunk
+	 * border. At most one such chunk is kept.
+	 */
+	block_chunk *empty_chunk = nullptr;
+};
+
+/**
+ * Slab allocator of the blocks. File creation and truncation churn goes
+ * through the chunk free lists instead of the general purpose heap.
+ * Big files take their tail blocks from a separate pool of huge page
+ * chunks, so a scan of them misses TLB less. Small files stay in the
+ * small page chunks not to pin a whole huge page each.
+ */
+struct block_allocator {
+	block_pool small_pool;
+	block_pool huge_pool;
+	size_t chunk_count = 0;
+	size_t huge_chunk_count = 0;
+	size_t used_blocks = 0;
+	/** Limit of the block memory in bytes. 0 means no limit. */
+	size_t limit = 0;
+	bool is_huge_enabled = true;
+};
+
+static block_allocator g_block_alloc;
+
+/**
+ * Block deduplication. The table keeps one block per content hash. A
+ * block in the table must not change, so it is removed from the table
+ * before an in-place write and on free. On a hash collision the second
+ * block simply stays out of the table.
+ */
+struct dedup_table {
+	bool is_enabled = false;
+	std::unordered_map<uint64_t, block*> blocks;
+};
+
+static dedup_table g_dedup;
+
+/**
+ * Image mapped by ufs_load(). Its blocks are served right from the
+ * mapping. They are read only and always treated as shared, so any
+ * write copies them into the slab.
+ */
+struct image_map {
+	char *base = nullptr;
+	size_t size = 0;
+	/** Block data area of the image. */
+	char *data = nullptr;
+	size_t data_size = 0;
+};
+
+static image_map g_image;
+
+struct dir;
+
+/**
+ * Blocks of a cold file compressed by ufs_compact(). The file has no
+ * block table while it is packed.
+ */
+struct packed_blocks {
+	/** Numbers of the materialized blocks, ascending. */
+	std::vector<size_t> indexes;
+	/** Compressed size of each segment of PACK_SEGMENT_BLOCKS blocks. */
+	std::vector<uint32_t> segment_sizes;
+	std::vector<char> data;
 };
 
 struct file {
 	/**
-	 * Doubly-linked intrusive list of file blocks. Intrusiveness of the
-	 * list gives you the full control over the lifetime of the items in the
-	 * list without having to use double pointers with performance penalty.
+	 * Block table indexed by the block number. A null entry is a hole - it
+	 * is not allocated and reads back as zeros. The table covers only the
+	 * materialized prefix of the file, so a block number beyond it is a
+	 * hole too. Thanks to that growing a file by resize does not touch
+	 * the table at all. Bytes of the materialized blocks beyond the file
+	 * size are zeros, except for the tail of the last block, which is
+	 * zeroed when the file grows.
 	 */
-	rlist blocks = RLIST_HEAD_INITIALIZER(blocks);
+	std::vector<block*> blocks;
 	/** How many file descriptors are opened on the file. */
 	int refs = 0;
-	/** File name. */
+	/**
+	 * File name - the last component of its path. Snapshot files have
+	 * the full path here, they are not in any directory.
+	 */
 	std::string name;
+	/** Directory of the file. NULL for deleted and snapshot files. */
+	dir *parent = nullptr;
 	/** A link in the global file list. */
 	rlist in_file_list = RLIST_LINK_INITIALIZER;
 	size_t size = 0;
+	/** Number of materialized (not hole) blocks. */
 	size_t block_count = 0;
+	/** Number of descriptors with not flushed writes. */
+	int dirty_descs = 0;
+	/** Compressed blocks or NULL. */
+	packed_blocks *packed = nullptr;
+	/**
+	 * Compression didn't save enough. Not retried until the file is
+	 * changed.
+	 */
+	bool is_incompressible = false;
 	bool is_deleted = false;
 };
 
+/** Directory entry - either a file or a subdirectory. */
+struct dentry {
+	file *f = nullptr;
+	dir *d = nullptr;
+};
+
+/**
+ * Directory. The entries are stored in a hash table, so a lookup in a
+ * directory costs the same regardless of its size, and a path lookup
+ * depends only on the path depth.
+ */
+struct dir {
+	std::string name;
+	/** NULL for the root. */
+	dir *parent = nullptr;
+	std::unordered_map<std::string, dentry> entries;
+};
+
+static dir root_dir;
+
+/**
+ * Cache of the resolved directory paths, keyed by the path exactly as it
+ * was given by a user. Files of the same directories are looked up with
+ * a single hash table lookup instead of a walk over all the components.
+ * Only existing directories are cached, so creation doesn't invalidate
+ * anything. Removal or rename of a directory drops the whole cache.
+ */
+static std::unordered_map<std::string, dir*> dentry_cache;
+
 /**
  * Intrusive list of all files. In this case the intrusiveness of the list also
  * grants the ability to remove items from any position in O(1) complexity
- * without having to know their iterator.
+ * without having to know their iterator. The files are moved to the tail on
+ * access, so the list is ordered from the coldest to the hottest one.
  */
 static rlist file_list = RLIST_HEAD_INITIALIZER(file_list);
 
+/** Global memory accounting, see ufs_mem_stat. */
+static ufs_mem_stat g_mem_stat;
+
 struct filedesc {
 	file *atfile = nullptr;
 	size_t pos = 0;
 #if NEED_OPEN_FLAGS
 	int rights = UFS_READ_WRITE;
 #endif
+	/** Opened with UFS_BUFFERED. */
+	bool is_buffered = false;
+	/** Opened with UFS_APPEND. */
+	bool is_append = false;
+	/** A flush has failed, and the caller doesn't know yet. */
+	bool is_flush_failed = false;
+	/**
+	 * Writes not applied to the file yet. They are contiguous and end
+	 * at pos.
+	 */
+	std::vector<char> wbuf;
+};
+
+/**
+ * A frozen copy of all the files. The copies share blocks with the live
+ * files, so only the blocks written after the snapshot creation take
+ * extra memory.
+ */
+struct snapshot {
+	/** Files of the snapshot. They are never visible by ufs_open(). */
+	rlist files = RLIST_HEAD_INITIALIZER(files);
+	/** The same files by their normalized full paths. */
+	std::unordered_map<std::string, file*> index;
 };
 
+/**
+ * An array of snapshots, indexed by their IDs. A deleted snapshot leaves
+ * NULL, which can be taken by the next one.
+ */
+static std::vector<snapshot*> snapshots;
+
 /**
  * An array of file descriptors. When a file descriptor is
  * created, its pointer drops here. When a file descriptor is
@@ -87,217 +309,1554 @@ get_filedesc(int fd)
 	return file_descriptors[static_cast<size_t>(fd)];
 }
 
-static file *
-find_file(const char *filename)
+/** Walk @a path from the root. All the components must be directories. */
+static dir *
+dir_walk(const char *path, size_t len)
 {
-	file *it;
-	rlist_foreach_entry(it, &file_list, in_file_list) {
-		if (!it->is_deleted && it->name == filename)
-			return it;
+	dir *d = &root_dir;
+	std::string name;
+	size_t pos = 0;
+	while (pos < len) {
+		size_t end = pos;
+		while (end < len && path[end] != '/')
+			++end;
+		if (end > pos) {
+			name.assign(path + pos, end - pos);
+			auto it = d->entries.find(name);
+			if (it == d->entries.end() || it->second.d == nullptr)
+				return nullptr;
+			d = it->second.d;
+		}
+		pos = end + 1;
 	}
-	return nullptr;
+	return d;
 }
 
-static size_t
-block_count_for_size(size_t size)
+/**
+ * Find a directory by the first @a len bytes of @a path, using the
+ * cache. Throws std::bad_alloc.
+ */
+static dir *
+dir_lookup(const char *path, size_t len)
 {
-	if (size == 0)
-		return 0;
-	return (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (len == 0)
+		return &root_dir;
+	std::string key(path, len);
+	auto it = dentry_cache.find(key);
+	if (it != dentry_cache.end())
+		return it->second;
+	dir *d = dir_walk(path, len);
+	if (d == nullptr)
+		return nullptr;
+	if (dentry_cache.size() >= DENTRY_CACHE_MAX)
+		dentry_cache.clear();
+	dentry_cache.emplace(std::move(key), d);
+	return d;
 }
 
-static block *
-get_block_by_index(file *f, size_t block_index)
+static void
+dentry_cache_drop(void)
 {
-	if (block_index >= f->block_count)
-		return nullptr;
-	if (block_index <= f->block_count / 2) {
-		rlist *it = rlist_first(&f->blocks);
-		for (size_t i = 0; i < block_index; ++i)
-			it = rlist_next(it);
-		return rlist_entry(it, block, in_block_list);
-	}
-	rlist *it = rlist_last(&f->blocks);
-	for (size_t i = f->block_count - 1; i > block_index; --i)
-		it = rlist_prev(it);
-	return rlist_entry(it, block, in_block_list);
+	std::unordered_map<std::string, dir*> empty_cache;
+	dentry_cache.swap(empty_cache);
 }
 
-static block *
-next_block_or_null(file *f, block *b)
+/** Parent directory and the last component of a path. */
+struct path_loc {
+	dir *parent = nullptr;
+	std::string name;
+};
+
+/**
+ * Resolve the parent directory of @a path. Slashes at the end of the
+ * path are ignored. Throws std::bad_alloc.
+ * @retval false No such directory, or the path has no components.
+ */
+static bool
+path_resolve(const char *path, path_loc *loc)
+{
+	size_t len = std::strlen(path);
+	while (len > 0 && path[len - 1] == '/')
+		--len;
+	size_t name_begin = len;
+	while (name_begin > 0 && path[name_begin - 1] != '/')
+		--name_begin;
+	if (name_begin == len)
+		return false;
+	loc->parent = dir_lookup(path, name_begin);
+	if (loc->parent == nullptr)
+		return false;
+	loc->name.assign(path + name_begin, len - name_begin);
+	return true;
+}
+
+/** Find a directory entry. NULL if there is none. */
+static dentry *
+path_loc_find(const path_loc *loc)
 {
-	rlist *next = rlist_next(&b->in_block_list);
-	if (next == &f->blocks)
+	auto it = loc->parent->entries.find(loc->name);
+	if (it == loc->parent->entries.end())
 		return nullptr;
-	return rlist_entry(next, block, in_block_list);
+	return &it->second;
 }
 
+/** Names which can't be created - they are reserved by the convention. */
 static bool
-append_block(file *f)
+name_is_valid(const std::string &name)
+{
+	return name != "." && name != "..";
+}
+
+/** Find a directory by its path. The root is an empty path or "/". */
+static dir *
+find_dir(const char *path)
 {
-	block *b = nullptr;
+	path_loc loc;
 	try {
-		b = new block();
+		if (!path_resolve(path, &loc)) {
+			for (const char *p = path; *p != 0; ++p) {
+				if (*p != '/')
+					return nullptr;
+			}
+			return &root_dir;
+		}
 	} catch (const std::bad_alloc&) {
-		return false;
+		return nullptr;
 	}
-	std::memset(b->memory, 0, sizeof(b->memory));
-	rlist_add_tail_entry(&f->blocks, b, in_block_list);
-	++f->block_count;
-	return true;
+	dentry *e = path_loc_find(&loc);
+	return e != nullptr ? e->d : nullptr;
 }
 
-static bool
-ensure_block_count(file *f, size_t target_block_count)
+static file *
+find_file(const char *filename)
 {
-	while (f->block_count < target_block_count) {
-		if (!append_block(f))
-			return false;
+	path_loc loc;
+	try {
+		if (!path_resolve(filename, &loc))
+			return nullptr;
+	} catch (const std::bad_alloc&) {
+		return nullptr;
 	}
-	return true;
+	dentry *e = path_loc_find(&loc);
+	return e != nullptr ? e->f : nullptr;
+}
+
+/**
+ * Normalized path - the components joined by single slashes, without
+ * slashes at the ends. Throws std::bad_alloc.
+ */
+static std::string
+path_normalize(const char *path)
+{
+	std::string result;
+	const char *p = path;
+	while (*p != 0) {
+		while (*p == '/')
+			++p;
+		const char *end = p;
+		while (*end != 0 && *end != '/')
+			++end;
+		if (end == p)
+			break;
+		if (!result.empty())
+			result += '/';
+		result.append(p, end - p);
+		p = end;
+	}
+	return result;
+}
+
+static block_chunk *
+block_chunk_new(bool is_huge)
+{
+	/*
+	 * mmap() does not guarantee any alignment bigger than a page. Map
+	 * twice more and cut the unaligned edges off.
+	 */
+	size_t map_size = 2 * CHUNK_SIZE;
+	void *map = mmap(nullptr, map_size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		return nullptr;
+	uintptr_t begin = reinterpret_cast<uintptr_t>(map);
+	uintptr_t aligned = (begin + CHUNK_SIZE - 1) & ~(uintptr_t)(CHUNK_SIZE - 1);
+	if (aligned != begin)
+		munmap(map, aligned - begin);
+	size_t tail = begin + map_size - aligned - CHUNK_SIZE;
+	if (tail != 0)
+		munmap(reinterpret_cast<void *>(aligned + CHUNK_SIZE), tail);
+
+	block_chunk *c = reinterpret_cast<block_chunk *>(aligned);
+#ifdef MADV_HUGEPAGE
+	/*
+	 * Only a hint, the chunk works with small pages too. MAP_HUGETLB
+	 * would need the huge pages reserved by the admin beforehand. The
+	 * small chunks are aligned as well, so with THP "always" they
+	 * would get huge pages too unless told not to.
+	 */
+	madvise(c, CHUNK_SIZE, is_huge ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+#endif
+	rlist_create(&c->in_free_list);
+	c->free_blocks = nullptr;
+	c->carve_index = 0;
+	c->used = 0;
+	c->is_huge = is_huge;
+	++g_block_alloc.chunk_count;
+	if (is_huge)
+		++g_block_alloc.huge_chunk_count;
+	return c;
 }
 
 static void
-remove_tail_blocks(file *f, size_t target_block_count)
+block_chunk_delete(block_chunk *c)
+{
+	rlist_del_entry(c, in_free_list);
+	--g_block_alloc.chunk_count;
+	if (c->is_huge)
+		--g_block_alloc.huge_chunk_count;
+	munmap(c, CHUNK_SIZE);
+}
+
+static block_chunk *
+block_chunk_of(block *b)
+{
+	uintptr_t addr = reinterpret_cast<uintptr_t>(b);
+	return reinterpret_cast<block_chunk *>(addr &
+		~(uintptr_t)(CHUNK_SIZE - 1));
+}
+
+static uint32_t *
+block_refs(block *b)
+{
+	block_chunk *c = block_chunk_of(b);
+	size_t index = (reinterpret_cast<char *>(b) -
+			reinterpret_cast<char *>(c)) / BLOCK_SIZE;
+	return &c->block_refs[index];
+}
+
+static bool *
+block_is_deduped(block *b)
 {
-	while (f->block_count > target_block_count) {
-		block *b = rlist_shift_tail_entry(&f->blocks, block,
-						  in_block_list);
-		delete b;
-		--f->block_count;
+	block_chunk *c = block_chunk_of(b);
+	size_t index = (reinterpret_cast<char *>(b) -
+			reinterpret_cast<char *>(c)) / BLOCK_SIZE;
+	return &c->block_is_deduped[index];
+}
+
+/** Content hash of a block. Four independent lanes to go faster. */
+static uint64_t
+block_hash(const block *b)
+{
+	const uint64_t prime = 0x9e3779b97f4a7c15ULL;
+	uint64_t h[4] = {prime, prime ^ 1, prime ^ 2, prime ^ 3};
+	for (size_t i = 0; i < BLOCK_SIZE; i += sizeof(h)) {
+		for (size_t j = 0; j < 4; ++j) {
+			uint64_t w;
+			std::memcpy(&w, b->memory + i + j * sizeof(w), sizeof(w));
+			h[j] = (h[j] ^ w) * 0xff51afd7ed558ccdULL;
+			h[j] ^= h[j] >> 29;
+		}
 	}
+	uint64_t res = h[0] ^ (h[1] * prime) ^ (h[2] * prime * prime) ^
+		(h[3] * prime * prime * prime);
+	res ^= res >> 32;
+	return res * 0xc4ceb9fe1a85ec53ULL;
 }
 
+static bool
+block_is_zero(const block *b)
+{
+	static const char zeros[BLOCK_SIZE] = {};
+	return std::memcmp(b->memory, zeros, BLOCK_SIZE) == 0;
+}
+
+/** Remove a block from the dedup table before it is changed or freed. */
 static void
-zero_file_range(file *f, size_t begin, size_t end)
+dedup_remove(block *b)
 {
-	if (begin >= end)
+	bool *is_deduped = block_is_deduped(b);
+	if (!*is_deduped)
 		return;
-	size_t pos = begin;
-	size_t block_index = pos / BLOCK_SIZE;
-	size_t offset = pos % BLOCK_SIZE;
-	block *b = get_block_by_index(f, block_index);
-	while (pos < end && b != nullptr) {
-		size_t chunk = std::min(end - pos, BLOCK_SIZE - offset);
-		std::memset(b->memory + offset, 0, chunk);
-		pos += chunk;
-		offset = 0;
-		if (pos < end)
-			b = next_block_or_null(f, b);
+	g_dedup.blocks.erase(block_hash(b));
+	*is_deduped = false;
+}
+
+static bool
+block_alloc_has_room(size_t count)
+{
+	size_t limit = g_block_alloc.limit;
+	if (limit == 0)
+		return true;
+	size_t used = g_block_alloc.used_blocks * BLOCK_SIZE;
+	return used <= limit && count <= (limit - used) / BLOCK_SIZE;
+}
+
+static block_pool *
+block_pool_of(bool is_huge)
+{
+	return is_huge ? &g_block_alloc.huge_pool : &g_block_alloc.small_pool;
+}
+
+/** Check if a file block with this index goes to a huge page chunk. */
+static bool
+block_index_is_huge(size_t block_index)
+{
+	return g_block_alloc.is_huge_enabled &&
+	       block_index >= HUGE_FILE_THRESHOLD / BLOCK_SIZE;
+}
+
+/**
+ * Allocate a block. The content is garbage. Returns NULL when the memory
+ * limit is reached or the system is out of memory.
+ */
+static block *
+block_alloc(bool is_huge)
+{
+	if (!block_alloc_has_room(1))
+		return nullptr;
+	block_pool *pool = block_pool_of(is_huge);
+	block_chunk *c;
+	if (rlist_empty(&pool->free_chunks)) {
+		c = block_chunk_new(is_huge);
+		if (c == nullptr)
+			return nullptr;
+		rlist_add_entry(&pool->free_chunks, c, in_free_list);
+	} else {
+		c = rlist_first_entry(&pool->free_chunks, block_chunk,
+				      in_free_list);
+	}
+	if (c == pool->empty_chunk)
+		pool->empty_chunk = nullptr;
+
+	block *b;
+	if (c->free_blocks != nullptr) {
+		free_block *fb = c->free_blocks;
+		c->free_blocks = fb->next;
+		b = reinterpret_cast<block *>(fb);
+	} else {
+		char *base = reinterpret_cast<char *>(c);
+		b = reinterpret_cast<block *>(base + (CHUNK_HEADER_BLOCKS +
+			c->carve_index++) * BLOCK_SIZE);
 	}
+	if (++c->used == CHUNK_BLOCKS)
+		rlist_del_entry(c, in_free_list);
+	++g_block_alloc.used_blocks;
+	*block_refs(b) = 1;
+	*block_is_deduped(b) = false;
+	return b;
 }
 
 static void
-file_clear_blocks(file *f)
+block_free(block *b)
 {
-	while (!rlist_empty(&f->blocks)) {
-		block *b = rlist_shift_entry(&f->blocks, block, in_block_list);
-		delete b;
+	dedup_remove(b);
+	block_chunk *c = block_chunk_of(b);
+	block_pool *pool = block_pool_of(c->is_huge);
+	free_block *fb = reinterpret_cast<free_block *>(b);
+	fb->next = c->free_blocks;
+	c->free_blocks = fb;
+	if (c->used-- == CHUNK_BLOCKS)
+		rlist_add_tail_entry(&pool->free_chunks, c, in_free_list);
+	--g_block_alloc.used_blocks;
+	if (c->used != 0)
+		return;
+	if (pool->empty_chunk == nullptr) {
+		pool->empty_chunk = c;
+		return;
 	}
-	f->block_count = 0;
-	f->size = 0;
+	block_chunk_delete(c);
+}
+
+static bool
+block_is_mapped(block *b)
+{
+	char *p = reinterpret_cast<char *>(b);
+	return p >= g_image.data && p < g_image.data + g_image.data_size;
 }
 
 static void
-file_destroy(file *f)
+block_ref(block *b)
 {
-	file_clear_blocks(f);
-	rlist_del_entry(f, in_file_list);
-	delete f;
+	if (!block_is_mapped(b))
+		++*block_refs(b);
 }
 
 static void
-clamp_fds_to_size(file *f, size_t size)
+block_unref(block *b)
 {
-	for (filedesc *desc : file_descriptors) {
-		if (desc != nullptr && desc->atfile == f && desc->pos > size)
-			desc->pos = size;
+	if (!block_is_mapped(b) && --*block_refs(b) == 0)
+		block_free(b);
+}
+
+static bool
+block_is_shared(block *b)
+{
+	return block_is_mapped(b) || *block_refs(b) > 1;
+}
+
+static void
+block_alloc_destroy(void)
+{
+	for (block_pool *pool : {&g_block_alloc.small_pool,
+				 &g_block_alloc.huge_pool}) {
+		if (pool->empty_chunk != nullptr)
+			block_chunk_delete(pool->empty_chunk);
+		pool->empty_chunk = nullptr;
 	}
+	decltype(g_dedup.blocks) empty_dedup;
+	g_dedup.blocks.swap(empty_dedup);
 }
 
-#if NEED_OPEN_FLAGS
-static int
-normalize_rights(int flags)
+static size_t
+block_count_for_size(size_t size)
 {
-	int rights = flags & UFS_READ_WRITE;
-	if (rights == 0)
-		rights = UFS_READ_WRITE;
-	return rights;
+	if (size == 0)
+		return 0;
+	return (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
 }
-#endif
 
-enum ufs_error_code
-ufs_errno()
+static void
+file_set_size(file *f, size_t size)
 {
-	return g_ufs_error_code;
+	g_mem_stat.logical_size -= f->size;
+	g_mem_stat.logical_size += size;
+	f->size = size;
 }
 
-int
-ufs_open(const char *filename, int flags)
+/** Get a materialized block or NULL if it is a hole. */
+static block *
+file_get_block(file *f, size_t block_index)
 {
-	if (filename == nullptr) {
-		set_error(UFS_ERR_NO_FILE);
-		return -1;
-	}
+	if (block_index >= f->blocks.size())
+		return nullptr;
+	return f->blocks[block_index];
+}
 
-	file *f = find_file(filename);
-	if (f == nullptr && (flags & UFS_CREATE) == 0) {
-		set_error(UFS_ERR_NO_FILE);
-		return -1;
-	}
-	bool is_new_file = false;
-	if (f == nullptr) {
-		try {
-			f = new file();
-		} catch (const std::bad_alloc&) {
-			set_error(UFS_ERR_NO_MEM);
-			return -1;
+/**
+ * Get a block for writing, materialize it if it is a hole. Only the
+ * bytes outside of [@a offset, @a offset + @a size) are zeroed, the
+ * rest is going to be overwritten by the caller anyway. A shared block
+ * is copied, also except for the range to be overwritten.
+ */
+static block *
+file_get_block_for_write(file *f, size_t block_index, size_t offset,
+			 size_t size)
+{
+	block *b = file_get_block(f, block_index);
+	if (b != nullptr) {
+		if (!block_is_shared(b)) {
+			dedup_remove(b);
+			return b;
 		}
-		f->name = filename;
-		rlist_add_tail_entry(&file_list, f, in_file_list);
-		is_new_file = true;
+		block *copy = block_alloc(block_index_is_huge(block_index));
+		if (copy == nullptr)
+			return nullptr;
+		std::memcpy(copy->memory, b->memory, offset);
+		std::memcpy(copy->memory + offset + size,
+			    b->memory + offset + size,
+			    BLOCK_SIZE - offset - size);
+		block_unref(b);
+		f->blocks[block_index] = copy;
+		return copy;
 	}
-
-	filedesc *desc = nullptr;
 	try {
-		desc = new filedesc();
+		if (block_index >= f->blocks.size())
+			f->blocks.resize(block_index + 1, nullptr);
 	} catch (const std::bad_alloc&) {
-		if (is_new_file)
-			file_destroy(f);
-		set_error(UFS_ERR_NO_MEM);
-		return -1;
+		return nullptr;
 	}
-	desc->atfile = f;
-	desc->pos = 0;
-#if NEED_OPEN_FLAGS
-	desc->rights = normalize_rights(flags);
-#endif
+	b = block_alloc(block_index_is_huge(block_index));
+	if (b == nullptr)
+		return nullptr;
+	std::memset(b->memory, 0, offset);
+	std::memset(b->memory + offset + size, 0, BLOCK_SIZE - offset - size);
+	f->blocks[block_index] = b;
+	++f->block_count;
+	return b;
+}
 
-	size_t fd_index = 0;
-	for (; fd_index < file_descriptors.size(); ++fd_index) {
-		if (file_descriptors[fd_index] == nullptr) {
-			file_descriptors[fd_index] = desc;
-			break;
-		}
+/**
+ * Count blocks to be allocated to write [@a begin, @a end). These are
+ * holes and shared blocks.
+ */
+static size_t
+file_count_new_blocks(file *f, size_t begin, size_t end)
+{
+	size_t first = begin / BLOCK_SIZE;
+	size_t last = block_count_for_size(end);
+	size_t count = 0;
+	size_t table_end = std::min(last, f->blocks.size());
+	for (size_t i = first; i < table_end; ++i) {
+		block *b = f->blocks[i];
+		count += b == nullptr || block_is_shared(b);
+	}
+	if (last > table_end)
+		count += last - std::max(first, table_end);
+	return count;
+}
+
+static void
+file_free_block(file *f, size_t block_index)
+{
+	block *b = f->blocks[block_index];
+	if (b == nullptr)
+		return;
+	block_unref(b);
+	f->blocks[block_index] = nullptr;
+	--f->block_count;
+}
+
+/** Drop all the blocks beyond @a size. */
+static void
+file_truncate_blocks(file *f, size_t size)
+{
+	size_t keep = block_count_for_size(size);
+	for (size_t i = keep; i < f->blocks.size(); ++i)
+		file_free_block(f, i);
+	if (f->blocks.size() > keep)
+		f->blocks.resize(keep);
+}
+
+/** Check if the tail of the last block needs a copy to be zeroed. */
+static bool
+file_tail_is_shared(file *f)
+{
+	block *b = file_get_block(f, f->size / BLOCK_SIZE);
+	return f->size % BLOCK_SIZE != 0 && b != nullptr && block_is_shared(b);
+}
+
+/**
+ * Zero the bytes of the last block after the file end before the file
+ * grows. They might keep old data after a shrink. It is not zeroed on
+ * shrink, because the block can be shared and would need a copy, which
+ * is not expected from a shrink.
+ */
+static bool
+file_zero_tail(file *f)
+{
+	size_t tail = f->size % BLOCK_SIZE;
+	size_t block_index = f->size / BLOCK_SIZE;
+	if (tail == 0 || file_get_block(f, block_index) == nullptr)
+		return true;
+	block *b = file_get_block_for_write(f, block_index, tail,
+					    BLOCK_SIZE - tail);
+	if (b == nullptr)
+		return false;
+	std::memset(b->memory + tail, 0, BLOCK_SIZE - tail);
+	return true;
+}
+
+/**
+ * Share a block of a file with an equal one, or drop it if it is
+ * zeros. Otherwise remember it for the next equal blocks.
+ */
+static void
+file_dedup_block(file *f, size_t block_index)
+{
+	block *b = f->blocks[block_index];
+	if (b == nullptr || block_is_mapped(b) || *block_is_deduped(b))
+		return;
+	if (block_is_zero(b)) {
+		file_free_block(f, block_index);
+		return;
+	}
+	uint64_t hash = block_hash(b);
+	auto it = g_dedup.blocks.find(hash);
+	if (it == g_dedup.blocks.end()) {
+		try {
+			g_dedup.blocks.emplace(hash, b);
+		} catch (const std::bad_alloc&) {
+			return;
+		}
+		*block_is_deduped(b) = true;
+		return;
+	}
+	block *twin = it->second;
+	if (std::memcmp(twin->memory, b->memory, BLOCK_SIZE) != 0)
+		return;
+	block_ref(twin);
+	f->blocks[block_index] = twin;
+	block_unref(b);
+}
+
+/** Dedup the blocks whose last byte is in [@a begin, @a end). */
+static void
+file_dedup_range(file *f, size_t begin, size_t end)
+{
+	for (size_t i = begin / BLOCK_SIZE; (i + 1) * BLOCK_SIZE <= end; ++i)
+		file_dedup_block(f, i);
+}
+
+/** Move a file to the hot end of the list. */
+static void
+file_touch(file *f)
+{
+	if (f->parent != nullptr)
+		rlist_move_tail_entry(&file_list, f, in_file_list);
+}
+
+static void
+file_drop_packed(file *f)
+{
+	packed_blocks *p = f->packed;
+	if (p == nullptr)
+		return;
+	g_mem_stat.compressed_size -= p->data.size();
+	g_mem_stat.compressed_logical_size -= p->indexes.size() * BLOCK_SIZE;
+	delete p;
+	f->packed = nullptr;
+}
+
+/** The file blocks can be compressed and freed. */
+static bool
+file_can_pack(file *f)
+{
+	if (f->packed != nullptr || f->is_incompressible ||
+	    f->block_count == 0 || f->dirty_descs != 0)
+		return false;
+	/* Shared blocks would stay in memory anyway. */
+	for (block *b : f->blocks) {
+		if (b != nullptr && block_is_shared(b))
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Compress the blocks of a file and free them. Fails if there is no
+ * memory or the data doesn't compress well.
+ */
+static bool
+file_pack(file *f)
+{
+	static char raw[PACK_SEGMENT_BLOCKS * BLOCK_SIZE];
+	packed_blocks *p = nullptr;
+	try {
+		p = new packed_blocks();
+		p->indexes.reserve(f->block_count);
+		for (size_t i = 0; i < f->blocks.size(); ++i) {
+			if (f->blocks[i] != nullptr)
+				p->indexes.push_back(i);
+		}
+		size_t count = p->indexes.size();
+		for (size_t k = 0; k < count; k += PACK_SEGMENT_BLOCKS) {
+			size_t n = std::min<size_t>(PACK_SEGMENT_BLOCKS, count - k);
+			for (size_t j = 0; j < n; ++j) {
+				block *b = f->blocks[p->indexes[k + j]];
+				std::memcpy(raw + j * BLOCK_SIZE, b->memory,
+					    BLOCK_SIZE);
+			}
+			size_t offset = p->data.size();
+			p->data.resize(offset + lz_compress_bound(n * BLOCK_SIZE));
+			size_t size = lz_compress(raw, n * BLOCK_SIZE,
+						  p->data.data() + offset,
+						  p->data.size() - offset);
+			p->data.resize(offset + size);
+			p->segment_sizes.push_back(static_cast<uint32_t>(size));
+		}
+		/* Not worth it if less than 1/8 of the memory is saved. */
+		size_t raw_size = count * BLOCK_SIZE;
+		if (p->data.size() > raw_size - raw_size / 8) {
+			f->is_incompressible = true;
+			delete p;
+			return false;
+		}
+		p->data.shrink_to_fit();
+	} catch (const std::bad_alloc&) {
+		delete p;
+		return false;
+	}
+	file_truncate_blocks(f, 0);
+	std::vector<block*> empty_blocks;
+	f->blocks.swap(empty_blocks);
+	f->packed = p;
+	g_mem_stat.compressed_size += p->data.size();
+	g_mem_stat.compressed_logical_size += p->indexes.size() * BLOCK_SIZE;
+	return true;
+}
+
+/**
+ * Decompress the blocks of a packed file back into the block table.
+ * Fails if there is no memory. Then the file stays packed.
+ */
+static bool
+file_unpack(file *f)
+{
+	static char raw[PACK_SEGMENT_BLOCKS * BLOCK_SIZE];
+	packed_blocks *p = f->packed;
+	if (p == nullptr)
+		return true;
+	size_t count = p->indexes.size();
+	if (!block_alloc_has_room(count))
+		return false;
+	try {
+		f->blocks.resize(p->indexes.back() + 1, nullptr);
+	} catch (const std::bad_alloc&) {
+		return false;
+	}
+	const char *src = p->data.data();
+	size_t done = 0;
+	for (uint32_t segment_size : p->segment_sizes) {
+		size_t n = std::min<size_t>(PACK_SEGMENT_BLOCKS, count - done);
+		bool ok = lz_decompress(src, segment_size, raw, n * BLOCK_SIZE);
+		assert(ok);
+		(void)ok;
+		src += segment_size;
+		for (size_t j = 0; j < n; ++j, ++done) {
+			size_t index = p->indexes[done];
+			block *b = block_alloc(block_index_is_huge(index));
+			if (b == nullptr) {
+				file_truncate_blocks(f, 0);
+				return false;
+			}
+			std::memcpy(b->memory, raw + j * BLOCK_SIZE, BLOCK_SIZE);
+			f->blocks[index] = b;
+			++f->block_count;
+		}
+	}
+	file_drop_packed(f);
+	return true;
+}
+
+static void
+file_clear_blocks(file *f)
+{
+	file_drop_packed(f);
+	file_truncate_blocks(f, 0);
+	std::vector<block*> empty_blocks;
+	f->blocks.swap(empty_blocks);
+	file_set_size(f, 0);
+}
+
+/**
+ * Make @a dst a copy of @a src sharing all the blocks. The old content
+ * of @a dst is dropped.
+ */
+static bool
+file_share_blocks(file *dst, file *src)
+{
+	if (dst == src)
+		return true;
+	std::vector<block*> blocks;
+	try {
+		blocks = src->blocks;
+	} catch (const std::bad_alloc&) {
+		return false;
+	}
+	for (block *b : blocks) {
+		if (b != nullptr)
+			block_ref(b);
+	}
+	file_clear_blocks(dst);
+	dst->blocks.swap(blocks);
+	dst->block_count = src->block_count;
+	file_set_size(dst, src->size);
+	return true;
+}
+
+/** Remove the file from its directory and make it a ghost. */
+static void
+file_unlink(file *f)
+{
+	if (f->parent != nullptr) {
+		f->parent->entries.erase(f->name);
+		f->parent = nullptr;
+	}
+	f->is_deleted = true;
+}
+
+static void
+file_destroy(file *f)
+{
+	file_unlink(f);
+	file_clear_blocks(f);
+	rlist_del_entry(f, in_file_list);
+	delete f;
+}
+
+static void
+clamp_fds_to_size(file *f, size_t size)
+{
+	for (filedesc *desc : file_descriptors) {
+		if (desc != nullptr && desc->atfile == f && desc->pos > size)
+			desc->pos = size;
+	}
+}
+
+static int
+normalize_rights(int flags)
+{
+#if NEED_OPEN_FLAGS
+	int rights = flags & UFS_READ_WRITE;
+	if (rights == 0)
+		rights = UFS_READ_WRITE;
+	return rights;
+#else
+	(void)flags;
+	return 0;
+#endif
+}
+
+/**
+ * Create a descriptor for the file @a f.
+ * @retval >= 0 The descriptor.
+ * @retval -1 No memory.
+ */
+static int
+fd_install(file *f, int rights)
+{
+	filedesc *desc = nullptr;
+	try {
+		desc = new filedesc();
+	} catch (const std::bad_alloc&) {
+		return -1;
+	}
+	desc->atfile = f;
+	desc->pos = 0;
+#if NEED_OPEN_FLAGS
+	desc->rights = rights;
+#else
+	(void)rights;
+#endif
+
+	size_t fd_index = 0;
+	for (; fd_index < file_descriptors.size(); ++fd_index) {
+		if (file_descriptors[fd_index] == nullptr) {
+			file_descriptors[fd_index] = desc;
+			break;
+		}
+	}
+	if (fd_index == file_descriptors.size()) {
+		try {
+			file_descriptors.push_back(desc);
+		} catch (const std::bad_alloc&) {
+			delete desc;
+			return -1;
+		}
+	}
+	++f->refs;
+	return static_cast<int>(fd_index);
+}
+
+static file *
+file_new(const char *filename, rlist *list)
+{
+	file *f = nullptr;
+	try {
+		f = new file();
+		f->name = filename;
+	} catch (const std::bad_alloc&) {
+		delete f;
+		return nullptr;
+	}
+	rlist_add_tail_entry(list, f, in_file_list);
+	return f;
+}
+
+/** Create a file in a directory. Returns NULL on no memory. */
+static file *
+dir_create_file(dir *d, const std::string &name)
+{
+	file *f = file_new(name.c_str(), &file_list);
+	if (f == nullptr)
+		return nullptr;
+	try {
+		d->entries.emplace(name, dentry{f, nullptr});
+	} catch (const std::bad_alloc&) {
+		file_destroy(f);
+		return nullptr;
+	}
+	f->parent = d;
+	return f;
+}
+
+/** Delete all the subdirectories recursively. The files must be gone. */
+static void
+dir_destroy_children(dir *d)
+{
+	for (auto &it : d->entries) {
+		if (it.second.d == nullptr)
+			continue;
+		dir_destroy_children(it.second.d);
+		delete it.second.d;
+	}
+	std::unordered_map<std::string, dentry> empty_entries;
+	d->entries.swap(empty_entries);
+}
+
+/** Callback of dir_foreach(). Return false to stop the iteration. */
+typedef bool (*dir_foreach_f)(const std::string &path, dentry *entry,
+			      void *arg);
+
+/**
+ * Call @a cb for each entry of the tree under @a d with its full path.
+ * Directories are visited before their content. Throws std::bad_alloc.
+ */
+static bool
+dir_foreach(dir *d, std::string *path, dir_foreach_f cb, void *arg)
+{
+	size_t path_len = path->size();
+	for (auto &it : d->entries) {
+		if (path_len != 0)
+			*path += '/';
+		*path += it.first;
+		bool is_ok = cb(*path, &it.second, arg);
+		if (is_ok && it.second.d != nullptr)
+			is_ok = dir_foreach(it.second.d, path, cb, arg);
+		path->resize(path_len);
+		if (!is_ok)
+			return false;
+	}
+	return true;
+}
+
+static void
+snapshot_delete(snapshot *snap)
+{
+	file *it, *tmp;
+	rlist_foreach_entry_safe(it, &snap->files, in_file_list, tmp) {
+		if (it->refs == 0) {
+			file_destroy(it);
+			continue;
+		}
+		/*
+		 * Opened files of the snapshot become ghosts like deleted
+		 * ones and live until their descriptors are closed.
+		 */
+		it->is_deleted = true;
+		rlist_move_tail_entry(&file_list, it, in_file_list);
+	}
+	delete snap;
+}
+
+enum ufs_error_code
+ufs_errno()
+{
+	return g_ufs_error_code;
+}
+
+int
+ufs_open(const char *filename, int flags)
+{
+	if (filename == nullptr) {
+		set_error(UFS_ERR_NO_FILE);
+		return -1;
+	}
+
+	path_loc loc;
+	try {
+		if (!path_resolve(filename, &loc)) {
+			set_error(UFS_ERR_NO_FILE);
+			return -1;
+		}
+	} catch (const std::bad_alloc&) {
+		set_error(UFS_ERR_NO_MEM);
+		return -1;
+	}
+	dentry *e = path_loc_find(&loc);
+	if (e != nullptr && e->d != nullptr) {
+		set_error(UFS_ERR_IS_DIR);
+		return -1;
+	}
+	file *f = e != nullptr ? e->f : nullptr;
+	if (f == nullptr && (flags & UFS_CREATE) == 0) {
+		set_error(UFS_ERR_NO_FILE);
+		return -1;
+	}
+	bool is_new_file = false;
+	if (f == nullptr) {
+		if (!name_is_valid(loc.name)) {
+			set_error(UFS_ERR_INVALID);
+			return -1;
+		}
+		f = dir_create_file(loc.parent, loc.name);
+		if (f == nullptr) {
+			set_error(UFS_ERR_NO_MEM);
+			return -1;
+		}
+		is_new_file = true;
+	}
+
+	int fd = fd_install(f, normalize_rights(flags));
+	if (fd == -1) {
+		if (is_new_file)
+			file_destroy(f);
+		set_error(UFS_ERR_NO_MEM);
+		return -1;
+	}
+	file_descriptors[fd]->is_buffered = (flags & UFS_BUFFERED) != 0;
+	file_descriptors[fd]->is_append = (flags & UFS_APPEND) != 0;
+	set_error(UFS_ERR_NO_ERR);
+	return fd;
+}
+
+static ssize_t
+file_write(filedesc *desc, const char *buf, size_t size);
+
+/**
+ * Apply the buffered writes of a descriptor to the file. If they don't
+ * fit into the memory, they are dropped, and the failure is remembered
+ * for the descriptor owner.
+ */
+static void
+filedesc_flush(filedesc *desc)
+{
+	if (desc->wbuf.empty())
+		return;
+	size_t size = desc->wbuf.size();
+	size_t end = desc->pos;
+	ssize_t rc = -1;
+	/* The buffer ends at the position, unless something moved it. */
+	if (end >= size) {
+		desc->pos = end - size;
+		rc = file_write(desc, desc->wbuf.data(), size);
+		desc->pos = end;
+	}
+	if (rc != static_cast<ssize_t>(size))
+		desc->is_flush_failed = true;
+	desc->wbuf.clear();
+	--desc->atfile->dirty_descs;
+}
+
+/**
+ * Flush own writes of a descriptor.
+ * @retval false The flush failed now or in the past. The data is lost.
+ */
+static bool
+filedesc_sync(filedesc *desc)
+{
+	filedesc_flush(desc);
+	bool is_ok = !desc->is_flush_failed;
+	desc->is_flush_failed = false;
+	return is_ok;
+}
+
+/**
+ * Flush all the descriptors of a file, except @a skip, so the file
+ * content is up to date.
+ */
+static void
+file_flush(file *f, filedesc *skip = nullptr)
+{
+	if (f->dirty_descs == 0)
+		return;
+	for (filedesc *desc : file_descriptors) {
+		if (desc != nullptr && desc != skip && desc->atfile == f)
+			filedesc_flush(desc);
+	}
+}
+
+/** Flush all the descriptors of all files. */
+static void
+file_flush_all(void)
+{
+	for (filedesc *desc : file_descriptors) {
+		if (desc != nullptr)
+			filedesc_flush(desc);
+	}
+}
+
+ssize_t
+ufs_write(int fd, const char *buf, size_t size)
+{
+	filedesc *desc = get_filedesc(fd);
+	if (desc == nullptr) {
+		set_error(UFS_ERR_NO_FILE);
+		return -1;
+	}
+#if NEED_OPEN_FLAGS
+	if ((desc->rights & UFS_WRITE_ONLY) == 0) {
+		set_error(UFS_ERR_NO_PERMISSION);
+		return -1;
+	}
+#endif
+	if (size == 0) {
+		set_error(UFS_ERR_NO_ERR);
+		return 0;
+	}
+	if (buf == nullptr) {
+		set_error(UFS_ERR_NO_MEM);
+		return -1;
+	}
+	file *f = desc->atfile;
+	/* Writes of the other descriptors go first, they were made before. */
+	if (f->dirty_descs > (desc->wbuf.empty() ? 0 : 1))
+		file_flush(f, desc);
+	/*
+	 * A non-empty buffer already ends at the file end, because any
+	 * change of the file by others would have flushed it.
+	 */
+	if (desc->is_append && desc->wbuf.empty())
+		desc->pos = f->size;
+	if (desc->pos > MAX_FILE_SIZE || size > MAX_FILE_SIZE - desc->pos) {
+		set_error(UFS_ERR_NO_MEM);
+		return -1;
+	}
+	if (desc->is_buffered && size < WRITE_BUFFER_SIZE) {
+		if (desc->wbuf.size() + size > WRITE_BUFFER_SIZE &&
+		    !filedesc_sync(desc)) {
+			set_error(UFS_ERR_NO_MEM);
+			return -1;
+		}
+		try {
+			desc->wbuf.reserve(WRITE_BUFFER_SIZE);
+		} catch (const std::bad_alloc&) {
+			set_error(UFS_ERR_NO_MEM);
+			return -1;
+		}
+		if (desc->wbuf.empty())
+			++f->dirty_descs;
+		desc->wbuf.insert(desc->wbuf.end(), buf, buf + size);
+		desc->pos += size;
+		set_error(UFS_ERR_NO_ERR);
+		return static_cast<ssize_t>(size);
+	}
+	if (!filedesc_sync(desc)) {
+		set_error(UFS_ERR_NO_MEM);
+		return -1;
+	}
+	return file_write(desc, buf, size);
+}
+
+/** Write at the descriptor position right into the blocks. */
+static ssize_t
+file_write(filedesc *desc, const char *buf, size_t size)
+{
+	file *f = desc->atfile;
+	if (desc->pos > MAX_FILE_SIZE || size > MAX_FILE_SIZE - desc->pos ||
+	    !file_unpack(f)) {
+		set_error(UFS_ERR_NO_MEM);
+		return -1;
+	}
+	/*
+	 * Check the limit beforehand so the write either fits entirely or
+	 * fails without touching anything.
+	 */
+	size_t new_blocks = file_count_new_blocks(f, desc->pos,
+						  desc->pos + size);
+	bool need_zero_tail = desc->pos > f->size;
+	if (need_zero_tail && file_tail_is_shared(f))
+		++new_blocks;
+	if (!block_alloc_has_room(new_blocks) ||
+	    (need_zero_tail && !file_zero_tail(f))) {
+		set_error(UFS_ERR_NO_MEM);
+		return -1;
+	}
+
+	size_t pos = desc->pos;
+	size_t remaining = size;
+	const char *src = buf;
+	while (remaining > 0) {
+		size_t offset = pos % BLOCK_SIZE;
+		size_t chunk = std::min(remaining, BLOCK_SIZE - offset);
+		block *b = file_get_block_for_write(f, pos / BLOCK_SIZE, offset,
+						    chunk);
+		if (b == nullptr)
+			break;
+		std::memcpy(b->memory + offset, src, chunk);
+		src += chunk;
+		pos += chunk;
+		remaining -= chunk;
+	}
+	size_t written = size - remaining;
+	if (written == 0) {
+		set_error(UFS_ERR_NO_MEM);
+		return -1;
+	}
+
+	if (g_dedup.is_enabled)
+		file_dedup_range(f, desc->pos, pos);
+	desc->pos = pos;
+	if (pos > f->size)
+		file_set_size(f, pos);
+	f->is_incompressible = false;
+	file_touch(f);
+	set_error(UFS_ERR_NO_ERR);
+	return static_cast<ssize_t>(written);
+}
+
+ssize_t
+ufs_read(int fd, char *buf, size_t size)
+{
+	filedesc *desc = get_filedesc(fd);
+	if (desc == nullptr) {
+		set_error(UFS_ERR_NO_FILE);
+		return -1;
+	}
+#if NEED_OPEN_FLAGS
+	if ((desc->rights & UFS_READ_ONLY) == 0) {
+		set_error(UFS_ERR_NO_PERMISSION);
+		return -1;
+	}
+#endif
+	if (size == 0) {
+		set_error(UFS_ERR_NO_ERR);
+		return 0;
+	}
+	if (buf == nullptr) {
+		set_error(UFS_ERR_NO_MEM);
+		return -1;
+	}
+	file *f = desc->atfile;
+	file_flush(f, desc);
+	if (!filedesc_sync(desc)) {
+		set_error(UFS_ERR_NO_MEM);
+		return -1;
+	}
+	if (desc->pos >= f->size) {
+		set_error(UFS_ERR_NO_ERR);
+		return 0;
+	}
+	if (!file_unpack(f)) {
+		set_error(UFS_ERR_NO_MEM);
+		return -1;
+	}
+	file_touch(f);
+
+	size_t to_read = std::min(size, f->size - desc->pos);
+	size_t pos = desc->pos;
+	size_t remaining = to_read;
+	char *dst = buf;
+	while (remaining > 0) {
+		size_t offset = pos % BLOCK_SIZE;
+		size_t chunk = std::min(remaining, BLOCK_SIZE - offset);
+		block *b = file_get_block(f, pos / BLOCK_SIZE);
+		if (b != nullptr)
+			std::memcpy(dst, b->memory + offset, chunk);
+		else
+			std::memset(dst, 0, chunk);
+		dst += chunk;
+		pos += chunk;
+		remaining -= chunk;
+	}
+
+	desc->pos = pos;
+	set_error(UFS_ERR_NO_ERR);
+	return static_cast<ssize_t>(to_read);
+}
+
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, size_t offset)
+{
+	filedesc *desc = get_filedesc(fd);
+	if (desc == nullptr) {
+		set_error(UFS_ERR_NO_FILE);
+		return -1;
+	}
+	if (!filedesc_sync(desc)) {
+		set_error(UFS_ERR_NO_MEM);
+		return -1;
+	}
+	size_t pos = desc->pos;
+	bool is_buffered = desc->is_buffered;
+	desc->pos = offset;
+	desc->is_buffered = false;
+	ssize_t rc = ufs_write(fd, buf, size);
+	desc->pos = pos;
+	desc->is_buffered = is_buffered;
+	return rc;
+}
+
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, size_t offset)
+{
+	filedesc *desc = get_filedesc(fd);
+	if (desc == nullptr) {
+		set_error(UFS_ERR_NO_FILE);
+		return -1;
+	}
+	if (!filedesc_sync(desc)) {
+		set_error(UFS_ERR_NO_MEM);
+		return -1;
+	}
+	size_t pos = desc->pos;
+	desc->pos = offset;
+	ssize_t rc = ufs_read(fd, buf, size);
+	desc->pos = pos;
+	return rc;
+}
+
+int
+ufs_seek(int fd, size_t pos)
+{
+	filedesc *desc = get_filedesc(fd);
+	if (desc == nullptr) {
+		set_error(UFS_ERR_NO_FILE);
+		return -1;
+	}
+	/* Seek to the current position keeps the buffered writes going. */
+	if (pos != desc->pos && !filedesc_sync(desc)) {
+		set_error(UFS_ERR_NO_MEM);
+		return -1;
+	}
+	desc->pos = pos;
+	set_error(UFS_ERR_NO_ERR);
+	return 0;
+}
+
+int
+ufs_close(int fd)
+{
+	filedesc *desc = get_filedesc(fd);
+	if (desc == nullptr) {
+		set_error(UFS_ERR_NO_FILE);
+		return -1;
+	}
+	bool is_ok = filedesc_sync(desc);
+	file_descriptors[static_cast<size_t>(fd)] = nullptr;
+	file *f = desc->atfile;
+	delete desc;
+	--f->refs;
+	if (f->refs == 0 && f->is_deleted)
+		file_destroy(f);
+	if (!is_ok) {
+		set_error(UFS_ERR_NO_MEM);
+		return -1;
+	}
+	set_error(UFS_ERR_NO_ERR);
+	return 0;
+}
+
+int
+ufs_delete(const char *filename)
+{
+	if (filename == nullptr) {
+		set_error(UFS_ERR_NO_FILE);
+		return -1;
+	}
+
+	if (find_dir(filename) != nullptr) {
+		set_error(UFS_ERR_IS_DIR);
+		return -1;
+	}
+	file *f = find_file(filename);
+	if (f == nullptr) {
+		set_error(UFS_ERR_NO_FILE);
+		return -1;
+	}
+
+	file_unlink(f);
+	if (f->refs == 0)
+		file_destroy(f);
+	set_error(UFS_ERR_NO_ERR);
+	return 0;
+}
+
+int
+ufs_mkdir(const char *path)
+{
+	if (path == nullptr) {
+		set_error(UFS_ERR_NO_FILE);
+		return -1;
+	}
+	path_loc loc;
+	try {
+		if (!path_resolve(path, &loc)) {
+			set_error(find_dir(path) != nullptr ? UFS_ERR_EXISTS :
+				  UFS_ERR_NO_FILE);
+			return -1;
+		}
+	} catch (const std::bad_alloc&) {
+		set_error(UFS_ERR_NO_MEM);
+		return -1;
+	}
+	if (path_loc_find(&loc) != nullptr) {
+		set_error(UFS_ERR_EXISTS);
+		return -1;
+	}
+	if (!name_is_valid(loc.name)) {
+		set_error(UFS_ERR_INVALID);
+		return -1;
+	}
+	dir *d = nullptr;
+	try {
+		d = new dir();
+		d->name = loc.name;
+		d->parent = loc.parent;
+		loc.parent->entries.emplace(loc.name, dentry{nullptr, d});
+	} catch (const std::bad_alloc&) {
+		delete d;
+		set_error(UFS_ERR_NO_MEM);
+		return -1;
+	}
+	set_error(UFS_ERR_NO_ERR);
+	return 0;
+}
+
+int
+ufs_rmdir(const char *path)
+{
+	if (path == nullptr) {
+		set_error(UFS_ERR_NO_FILE);
+		return -1;
 	}
-	if (fd_index == file_descriptors.size()) {
-		try {
-			file_descriptors.push_back(desc);
-		} catch (const std::bad_alloc&) {
-			delete desc;
-			if (is_new_file)
-				file_destroy(f);
-			set_error(UFS_ERR_NO_MEM);
+	dir *d = find_dir(path);
+	if (d == nullptr) {
+		set_error(find_file(path) != nullptr ? UFS_ERR_NOT_DIR :
+			  UFS_ERR_NO_FILE);
+		return -1;
+	}
+	if (d == &root_dir) {
+		set_error(UFS_ERR_INVALID);
+		return -1;
+	}
+	if (!d->entries.empty()) {
+		set_error(UFS_ERR_NOT_EMPTY);
+		return -1;
+	}
+	d->parent->entries.erase(d->name);
+	delete d;
+	dentry_cache_drop();
+	set_error(UFS_ERR_NO_ERR);
+	return 0;
+}
+
+int
+ufs_readdir(const char *path, ufs_readdir_f cb, void *arg)
+{
+	if (path == nullptr) {
+		set_error(UFS_ERR_NO_FILE);
+		return -1;
+	}
+	dir *d = find_dir(path);
+	if (d == nullptr) {
+		set_error(find_file(path) != nullptr ? UFS_ERR_NOT_DIR :
+			  UFS_ERR_NO_FILE);
+		return -1;
+	}
+	for (const auto &it : d->entries) {
+		ufs_dirent entry;
+		entry.name = it.first.c_str();
+		entry.is_dir = it.second.d != nullptr;
+		if (cb(&entry, arg) != 0)
+			break;
+	}
+	set_error(UFS_ERR_NO_ERR);
+	return 0;
+}
+
+/** Check if @a d is @a ancestor or lies somewhere inside of it. */
+static bool
+dir_is_inside(const dir *d, const dir *ancestor)
+{
+	for (; d != nullptr; d = d->parent) {
+		if (d == ancestor)
+			return true;
+	}
+	return false;
+}
+
+int
+ufs_rename(const char *old_path, const char *new_path)
+{
+	if (old_path == nullptr || new_path == nullptr) {
+		set_error(UFS_ERR_NO_FILE);
+		return -1;
+	}
+	path_loc src, dst;
+	try {
+		if (!path_resolve(old_path, &src) ||
+		    !path_resolve(new_path, &dst)) {
+			set_error(UFS_ERR_NO_FILE);
 			return -1;
 		}
+	} catch (const std::bad_alloc&) {
+		set_error(UFS_ERR_NO_MEM);
+		return -1;
+	}
+	dentry *src_entry = path_loc_find(&src);
+	if (src_entry == nullptr) {
+		set_error(UFS_ERR_NO_FILE);
+		return -1;
+	}
+	dentry moved = *src_entry;
+	if (src.parent == dst.parent && src.name == dst.name) {
+		set_error(UFS_ERR_NO_ERR);
+		return 0;
+	}
+	if (!name_is_valid(dst.name) ||
+	    (moved.d != nullptr && dir_is_inside(dst.parent, moved.d))) {
+		set_error(UFS_ERR_INVALID);
+		return -1;
+	}
+	dentry *dst_entry = path_loc_find(&dst);
+	if (dst_entry != nullptr) {
+		/* Only a file can replace a file, like in POSIX. */
+		if (dst_entry->d != nullptr) {
+			set_error(UFS_ERR_EXISTS);
+			return -1;
+		}
+		if (moved.d != nullptr) {
+			set_error(UFS_ERR_NOT_DIR);
+			return -1;
+		}
+	}
+	std::string name;
+	try {
+		name = dst.name;
+		if (dst_entry == nullptr) {
+			dst_entry = &dst.parent->entries.emplace(
+				dst.name, dentry()).first->second;
+		}
+	} catch (const std::bad_alloc&) {
+		set_error(UFS_ERR_NO_MEM);
+		return -1;
+	}
+	if (dst_entry->f != nullptr) {
+		/* The replaced file becomes a ghost, its entry is reused. */
+		file *old = dst_entry->f;
+		old->parent = nullptr;
+		old->is_deleted = true;
+		if (old->refs == 0)
+			file_destroy(old);
+	}
+	*dst_entry = moved;
+	src.parent->entries.erase(src.name);
+	if (moved.f != nullptr) {
+		moved.f->name.swap(name);
+		moved.f->parent = dst.parent;
+	} else {
+		moved.d->name.swap(name);
+		moved.d->parent = dst.parent;
+		dentry_cache_drop();
 	}
-	++f->refs;
 	set_error(UFS_ERR_NO_ERR);
-	return static_cast<int>(fd_index);
+	return 0;
 }
 
-ssize_t
-ufs_write(int fd, const char *buf, size_t size)
+int
+ufs_stat(const char *path, struct ufs_stat *stat)
+{
+	if (path == nullptr) {
+		set_error(UFS_ERR_NO_FILE);
+		return -1;
+	}
+	if (find_dir(path) != nullptr) {
+		stat->size = 0;
+		stat->allocated = 0;
+		stat->is_dir = true;
+		set_error(UFS_ERR_NO_ERR);
+		return 0;
+	}
+	file *f = find_file(path);
+	if (f == nullptr) {
+		set_error(UFS_ERR_NO_FILE);
+		return -1;
+	}
+	file_flush(f);
+	stat->size = f->size;
+	stat->allocated = f->block_count * BLOCK_SIZE;
+	if (f->packed != nullptr)
+		stat->allocated += f->packed->data.size();
+	stat->is_dir = false;
+	set_error(UFS_ERR_NO_ERR);
+	return 0;
+}
+
+#if NEED_RESIZE
+
+int
+ufs_resize(int fd, size_t new_size)
 {
 	filedesc *desc = get_filedesc(fd);
 	if (desc == nullptr) {
@@ -310,223 +1869,977 @@ ufs_write(int fd, const char *buf, size_t size)
 		return -1;
 	}
 #endif
-	if (size == 0) {
-		set_error(UFS_ERR_NO_ERR);
-		return 0;
-	}
-	if (buf == nullptr) {
+	if (new_size > MAX_FILE_SIZE) {
 		set_error(UFS_ERR_NO_MEM);
 		return -1;
 	}
+
 	file *f = desc->atfile;
-	if (desc->pos > MAX_FILE_SIZE || size > MAX_FILE_SIZE - desc->pos) {
+	file_flush(f, desc);
+	if (!filedesc_sync(desc) || !file_unpack(f)) {
+		set_error(UFS_ERR_NO_MEM);
+		return -1;
+	}
+	/*
+	 * Growth only moves the size - the new range is a hole. Only the tail
+	 * of the last block is zeroed. Shrink has to free the blocks behind
+	 * the new end.
+	 */
+	if (new_size < f->size) {
+		file_truncate_blocks(f, new_size);
+		clamp_fds_to_size(f, new_size);
+	} else if (new_size > f->size && !file_zero_tail(f)) {
 		set_error(UFS_ERR_NO_MEM);
 		return -1;
 	}
+	file_set_size(f, new_size);
+	f->is_incompressible = false;
+	file_touch(f);
+	set_error(UFS_ERR_NO_ERR);
+	return 0;
+}
 
-	size_t end_pos = desc->pos + size;
-	size_t new_size = std::max(f->size, end_pos);
-	if (new_size > MAX_FILE_SIZE) {
+#endif
+
+/**
+ * Allocate the holes and copy the shared blocks of [@a begin, @a end),
+ * as chosen by @a fill_holes and @a copy_shared. The new blocks are
+ * zeroed. On failure the allocated holes are freed back, so the file
+ * content is not changed.
+ */
+static bool
+file_prepare_range(file *f, size_t begin, size_t end, bool fill_holes,
+		   bool copy_shared)
+{
+	size_t first = begin / BLOCK_SIZE;
+	size_t last = block_count_for_size(end);
+	std::vector<size_t> filled;
+	for (size_t i = first; i < last; ++i) {
+		block *b = file_get_block(f, i);
+		if (b != nullptr ? !copy_shared || !block_is_shared(b) :
+		    !fill_holes)
+			continue;
+		bool is_ok = false;
+		try {
+			if (b == nullptr)
+				filled.push_back(i);
+			is_ok = file_get_block_for_write(f, i, 0, 0) != nullptr;
+		} catch (const std::bad_alloc&) {
+		}
+		if (!is_ok) {
+			for (size_t index : filled)
+				file_free_block(f, index);
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Zero [@a begin, @a end) of the blocks. They have to be allocated and
+ * not shared, see file_prepare_range().
+ */
+static void
+file_zero_range(file *f, size_t begin, size_t end)
+{
+	for (size_t pos = begin; pos < end;) {
+		size_t offset = pos % BLOCK_SIZE;
+		size_t size = std::min(end - pos, BLOCK_SIZE - offset);
+		block *b = f->blocks[pos / BLOCK_SIZE];
+		dedup_remove(b);
+		std::memset(b->memory + offset, 0, size);
+		pos += size;
+	}
+}
+
+/** Free the blocks in [@a begin, @a end), zero the partial ones. */
+static void
+file_punch_range(file *f, size_t begin, size_t end)
+{
+	for (size_t pos = begin; pos < end;) {
+		size_t offset = pos % BLOCK_SIZE;
+		size_t size = std::min(end - pos, BLOCK_SIZE - offset);
+		size_t block_index = pos / BLOCK_SIZE;
+		if (block_index >= f->blocks.size())
+			break;
+		if (size == BLOCK_SIZE)
+			file_free_block(f, block_index);
+		else if (f->blocks[block_index] != nullptr)
+			file_zero_range(f, pos, pos + size);
+		pos += size;
+	}
+}
+
+int
+ufs_fallocate(int fd, size_t offset, size_t len, int mode)
+{
+	filedesc *desc = get_filedesc(fd);
+	if (desc == nullptr) {
+		set_error(UFS_ERR_NO_FILE);
+		return -1;
+	}
+#if NEED_OPEN_FLAGS
+	if ((desc->rights & UFS_WRITE_ONLY) == 0) {
+		set_error(UFS_ERR_NO_PERMISSION);
+		return -1;
+	}
+#endif
+	int op = mode & (UFS_FALLOC_PUNCH_HOLE | UFS_FALLOC_ZERO_RANGE);
+	if (len == 0 || op == (UFS_FALLOC_PUNCH_HOLE | UFS_FALLOC_ZERO_RANGE) ||
+	    (mode & ~(op | UFS_FALLOC_KEEP_SIZE)) != 0) {
+		set_error(UFS_ERR_INVALID);
+		return -1;
+	}
+	if (offset > MAX_FILE_SIZE || len > MAX_FILE_SIZE - offset) {
+		set_error(UFS_ERR_NO_MEM);
+		return -1;
+	}
+	file *f = desc->atfile;
+	file_flush(f, desc);
+	if (!filedesc_sync(desc) || !file_unpack(f)) {
+		set_error(UFS_ERR_NO_MEM);
+		return -1;
+	}
+	size_t end = offset + len;
+	size_t first = offset / BLOCK_SIZE;
+	size_t last = block_count_for_size(end);
+	bool is_growing = op != UFS_FALLOC_PUNCH_HOLE && end > f->size &&
+			  (mode & UFS_FALLOC_KEEP_SIZE) == 0;
+	/*
+	 * Count all the blocks beforehand, so the call either succeeds
+	 * entirely or fails without touching anything. Preallocation
+	 * leaves the shared blocks as is, they are already allocated.
+	 */
+	size_t new_blocks = 0;
+	if (op == UFS_FALLOC_PUNCH_HOLE) {
+		/* The partial edges, once if they are the same block. */
+		size_t head_end = std::min(end, (first + 1) * BLOCK_SIZE);
+		block *b = file_get_block(f, first);
+		new_blocks += head_end - offset != BLOCK_SIZE && b != nullptr &&
+			      block_is_shared(b);
+		b = file_get_block(f, end / BLOCK_SIZE);
+		new_blocks += end % BLOCK_SIZE != 0 &&
+			      end / BLOCK_SIZE != first && b != nullptr &&
+			      block_is_shared(b);
+	} else if (op == UFS_FALLOC_ZERO_RANGE) {
+		new_blocks = file_count_new_blocks(f, offset, end);
+	} else {
+		for (size_t i = first; i < last; ++i)
+			new_blocks += file_get_block(f, i) == nullptr;
+	}
+	if (is_growing && file_tail_is_shared(f))
+		++new_blocks;
+	if (!block_alloc_has_room(new_blocks)) {
+		set_error(UFS_ERR_NO_MEM);
+		return -1;
+	}
+	/* The whole table at once, not block by block on each write. */
+	size_t old_table_size = f->blocks.size();
+	try {
+		if (op != UFS_FALLOC_PUNCH_HOLE && last > f->blocks.size())
+			f->blocks.resize(last, nullptr);
+	} catch (const std::bad_alloc&) {
+		set_error(UFS_ERR_NO_MEM);
+		return -1;
+	}
+	/*
+	 * The limit doesn't guarantee the memory. All the blocks are taken
+	 * before any visible change, the punch needs only the partial
+	 * edges. The tail zeroing is beyond the size, so is not visible.
+	 */
+	bool is_ok;
+	if (op == UFS_FALLOC_PUNCH_HOLE) {
+		size_t head_end = std::min(end, (first + 1) * BLOCK_SIZE);
+		size_t tail_begin = std::max(head_end, end - end % BLOCK_SIZE);
+		is_ok = (head_end - offset == BLOCK_SIZE ||
+			 file_prepare_range(f, offset, head_end, false,
+					    true)) &&
+			(tail_begin == end ||
+			 file_prepare_range(f, tail_begin, end, false, true));
+	} else {
+		is_ok = (!is_growing || file_zero_tail(f)) &&
+			file_prepare_range(f, offset, end, true,
+					   op == UFS_FALLOC_ZERO_RANGE);
+	}
+	if (!is_ok) {
+		if (f->blocks.size() > old_table_size)
+			f->blocks.resize(old_table_size);
 		set_error(UFS_ERR_NO_MEM);
 		return -1;
 	}
 
-	size_t required_blocks = block_count_for_size(new_size);
-	if (!ensure_block_count(f, required_blocks)) {
+	if (op == UFS_FALLOC_PUNCH_HOLE)
+		file_punch_range(f, offset, end);
+	else if (op == UFS_FALLOC_ZERO_RANGE)
+		file_zero_range(f, offset, end);
+	if (is_growing)
+		file_set_size(f, end);
+	f->is_incompressible = false;
+	file_touch(f);
+	set_error(UFS_ERR_NO_ERR);
+	return 0;
+}
+
+static void
+image_unmap(image_map *image)
+{
+	if (image->base != nullptr)
+		munmap(image->base, image->size);
+	*image = image_map();
+}
+
+/** Drop all the files, descriptors, snapshots, and the image. */
+static void
+ufs_reset(void)
+{
+	for (filedesc *desc : file_descriptors) {
+		if (desc == nullptr)
+			continue;
+		--desc->atfile->refs;
+		delete desc;
+	}
+	std::vector<filedesc*> empty_fds;
+	file_descriptors.swap(empty_fds);
+
+	for (snapshot *snap : snapshots) {
+		if (snap != nullptr)
+			snapshot_delete(snap);
+	}
+	std::vector<snapshot*> empty_snapshots;
+	snapshots.swap(empty_snapshots);
+
+	file *it, *tmp;
+	rlist_foreach_entry_safe(it, &file_list, in_file_list, tmp)
+		file_destroy(it);
+	dir_destroy_children(&root_dir);
+	dentry_cache_drop();
+	block_alloc_destroy();
+	image_unmap(&g_image);
+}
+
+void
+ufs_destroy(void)
+{
+	ufs_reset();
+	set_error(UFS_ERR_NO_ERR);
+}
+
+int
+ufs_clone(const char *src_name, const char *dst_name)
+{
+	if (src_name == nullptr || dst_name == nullptr) {
+		set_error(UFS_ERR_NO_FILE);
+		return -1;
+	}
+	file *src = find_file(src_name);
+	if (src == nullptr) {
+		set_error(UFS_ERR_NO_FILE);
+		return -1;
+	}
+	file_flush(src);
+	if (!file_unpack(src)) {
+		set_error(UFS_ERR_NO_MEM);
+		return -1;
+	}
+	path_loc loc;
+	try {
+		if (!path_resolve(dst_name, &loc)) {
+			set_error(UFS_ERR_NO_FILE);
+			return -1;
+		}
+	} catch (const std::bad_alloc&) {
+		set_error(UFS_ERR_NO_MEM);
+		return -1;
+	}
+	dentry *e = path_loc_find(&loc);
+	if (e != nullptr && e->d != nullptr) {
+		set_error(UFS_ERR_IS_DIR);
+		return -1;
+	}
+	file *dst = e != nullptr ? e->f : nullptr;
+	bool is_new_file = false;
+	if (dst == nullptr) {
+		if (!name_is_valid(loc.name)) {
+			set_error(UFS_ERR_INVALID);
+			return -1;
+		}
+		dst = dir_create_file(loc.parent, loc.name);
+		if (dst == nullptr) {
+			set_error(UFS_ERR_NO_MEM);
+			return -1;
+		}
+		is_new_file = true;
+	}
+	/* The buffered writes are older than the clone, and are replaced. */
+	file_flush(dst);
+	if (!file_share_blocks(dst, src)) {
+		if (is_new_file)
+			file_destroy(dst);
 		set_error(UFS_ERR_NO_MEM);
 		return -1;
 	}
+	clamp_fds_to_size(dst, dst->size);
+	set_error(UFS_ERR_NO_ERR);
+	return 0;
+}
 
-	if (desc->pos > f->size)
-		zero_file_range(f, f->size, desc->pos);
+static bool
+snapshot_add_entry(const std::string &path, dentry *entry, void *arg)
+{
+	if (entry->f == nullptr)
+		return true;
+	if (!file_unpack(entry->f))
+		return false;
+	snapshot *snap = static_cast<snapshot *>(arg);
+	file *copy = file_new(path.c_str(), &snap->files);
+	if (copy == nullptr || !file_share_blocks(copy, entry->f))
+		return false;
+	snap->index.emplace(path, copy);
+	return true;
+}
 
-	size_t block_index = desc->pos / BLOCK_SIZE;
-	size_t offset = desc->pos % BLOCK_SIZE;
-	block *b = get_block_by_index(f, block_index);
-	if (b == nullptr) {
+int
+ufs_snapshot_create(void)
+{
+	snapshot *snap;
+	try {
+		snap = new snapshot();
+	} catch (const std::bad_alloc&) {
 		set_error(UFS_ERR_NO_MEM);
 		return -1;
 	}
-	size_t remaining = size;
-	const char *src = buf;
-	while (remaining > 0) {
-		size_t chunk = std::min(remaining, BLOCK_SIZE - offset);
-		std::memcpy(b->memory + offset, src, chunk);
-		src += chunk;
-		remaining -= chunk;
-		offset = 0;
-		if (remaining > 0) {
-			b = next_block_or_null(f, b);
-			if (b == nullptr) {
-				set_error(UFS_ERR_NO_MEM);
-				return -1;
-			}
+	file_flush_all();
+	bool is_ok;
+	try {
+		std::string path;
+		is_ok = dir_foreach(&root_dir, &path, snapshot_add_entry, snap);
+	} catch (const std::bad_alloc&) {
+		is_ok = false;
+	}
+	if (!is_ok) {
+		snapshot_delete(snap);
+		set_error(UFS_ERR_NO_MEM);
+		return -1;
+	}
+
+	size_t id = 0;
+	for (; id < snapshots.size(); ++id) {
+		if (snapshots[id] == nullptr) {
+			snapshots[id] = snap;
+			break;
+		}
+	}
+	if (id == snapshots.size()) {
+		try {
+			snapshots.push_back(snap);
+		} catch (const std::bad_alloc&) {
+			snapshot_delete(snap);
+			set_error(UFS_ERR_NO_MEM);
+			return -1;
 		}
 	}
-
-	desc->pos = end_pos;
-	if (new_size > f->size)
-		f->size = new_size;
 	set_error(UFS_ERR_NO_ERR);
-	return static_cast<ssize_t>(size);
+	return static_cast<int>(id);
 }
 
-ssize_t
-ufs_read(int fd, char *buf, size_t size)
+static snapshot *
+get_snapshot(int id)
 {
-	filedesc *desc = get_filedesc(fd);
-	if (desc == nullptr) {
+	if (id < 0 || static_cast<size_t>(id) >= snapshots.size())
+		return nullptr;
+	return snapshots[static_cast<size_t>(id)];
+}
+
+int
+ufs_snapshot_open(int snapshot_id, const char *filename)
+{
+	snapshot *snap = get_snapshot(snapshot_id);
+	if (snap == nullptr || filename == nullptr) {
 		set_error(UFS_ERR_NO_FILE);
 		return -1;
 	}
-#if NEED_OPEN_FLAGS
-	if ((desc->rights & UFS_READ_ONLY) == 0) {
-		set_error(UFS_ERR_NO_PERMISSION);
-		return -1;
-	}
-#endif
-	if (size == 0) {
-		set_error(UFS_ERR_NO_ERR);
-		return 0;
-	}
-	if (buf == nullptr) {
+	file *f = nullptr;
+	try {
+		auto it = snap->index.find(path_normalize(filename));
+		if (it != snap->index.end())
+			f = it->second;
+	} catch (const std::bad_alloc&) {
 		set_error(UFS_ERR_NO_MEM);
 		return -1;
 	}
-	file *f = desc->atfile;
-	if (desc->pos >= f->size) {
-		set_error(UFS_ERR_NO_ERR);
-		return 0;
+	if (f == nullptr) {
+		set_error(UFS_ERR_NO_FILE);
+		return -1;
 	}
-
-	size_t to_read = std::min(size, f->size - desc->pos);
-	size_t block_index = desc->pos / BLOCK_SIZE;
-	size_t offset = desc->pos % BLOCK_SIZE;
-	block *b = get_block_by_index(f, block_index);
-	if (b == nullptr) {
+#if NEED_OPEN_FLAGS
+	int fd = fd_install(f, UFS_READ_ONLY);
+#else
+	int fd = fd_install(f, 0);
+#endif
+	if (fd == -1) {
 		set_error(UFS_ERR_NO_MEM);
 		return -1;
 	}
-	size_t remaining = to_read;
-	char *dst = buf;
-	while (remaining > 0) {
-		size_t chunk = std::min(remaining, BLOCK_SIZE - offset);
-		std::memcpy(dst, b->memory + offset, chunk);
-		dst += chunk;
-		remaining -= chunk;
-		offset = 0;
-		if (remaining > 0) {
-			b = next_block_or_null(f, b);
-			if (b == nullptr) {
-				set_error(UFS_ERR_NO_MEM);
-				return -1;
-			}
-		}
-	}
-
-	desc->pos += to_read;
 	set_error(UFS_ERR_NO_ERR);
-	return static_cast<ssize_t>(to_read);
+	return fd;
 }
 
 int
-ufs_close(int fd)
+ufs_snapshot_delete(int snapshot_id)
 {
-	filedesc *desc = get_filedesc(fd);
-	if (desc == nullptr) {
+	snapshot *snap = get_snapshot(snapshot_id);
+	if (snap == nullptr) {
 		set_error(UFS_ERR_NO_FILE);
 		return -1;
 	}
-	file_descriptors[static_cast<size_t>(fd)] = nullptr;
-	file *f = desc->atfile;
-	delete desc;
-	--f->refs;
-	if (f->refs == 0 && f->is_deleted)
-		file_destroy(f);
+	snapshots[static_cast<size_t>(snapshot_id)] = nullptr;
+	snapshot_delete(snap);
 	set_error(UFS_ERR_NO_ERR);
 	return 0;
 }
 
+void
+ufs_get_mem_stat(struct ufs_mem_stat *stat)
+{
+	const block_allocator *a = &g_block_alloc;
+	size_t capacity = a->chunk_count * CHUNK_BLOCKS * BLOCK_SIZE;
+	*stat = g_mem_stat;
+	stat->physical_size = a->used_blocks * BLOCK_SIZE;
+	stat->mapped_size = a->chunk_count * CHUNK_SIZE;
+	stat->free_size = capacity - stat->physical_size;
+	stat->huge_mapped_size = a->huge_chunk_count * CHUNK_SIZE;
+	stat->fragmented_size = stat->free_size;
+	if (a->small_pool.empty_chunk != nullptr)
+		stat->fragmented_size -= CHUNK_BLOCKS * BLOCK_SIZE;
+	if (a->huge_pool.empty_chunk != nullptr)
+		stat->fragmented_size -= CHUNK_BLOCKS * BLOCK_SIZE;
+	stat->limit = a->limit;
+	stat->image_size = g_image.size;
+	stat->dedup_size = g_dedup.blocks.size() * BLOCK_SIZE;
+	stat->dedup_logical_size = 0;
+	for (auto &it : g_dedup.blocks)
+		stat->dedup_logical_size += *block_refs(it.second) * BLOCK_SIZE;
+}
+
+void
+ufs_set_memory_limit(size_t limit)
+{
+	g_block_alloc.limit = limit;
+}
+
+void
+ufs_set_dedup(bool enable)
+{
+	g_dedup.is_enabled = enable;
+}
+
+void
+ufs_set_huge_pages(bool enable)
+{
+	g_block_alloc.is_huge_enabled = enable;
+}
+
 int
-ufs_delete(const char *filename)
+ufs_compact(size_t budget)
 {
-	if (filename == nullptr) {
-		set_error(UFS_ERR_NO_FILE);
-		return -1;
+	file_flush_all();
+	int count = 0;
+	file *f, *tmp;
+	rlist_foreach_entry_safe(f, &file_list, in_file_list, tmp) {
+		if (g_block_alloc.used_blocks * BLOCK_SIZE <= budget)
+			break;
+		if (f->parent != nullptr && file_can_pack(f) && file_pack(f))
+			++count;
 	}
+	set_error(UFS_ERR_NO_ERR);
+	return count;
+}
 
-	file *f = find_file(filename);
-	if (f == nullptr) {
+int
+ufs_fstat(int fd, struct ufs_stat *stat)
+{
+	filedesc *desc = get_filedesc(fd);
+	if (desc == nullptr) {
 		set_error(UFS_ERR_NO_FILE);
 		return -1;
 	}
-
-	f->is_deleted = true;
-	if (f->refs == 0)
-		file_destroy(f);
+	file *f = desc->atfile;
+	file_flush(f);
+	stat->size = f->size;
+	stat->allocated = f->block_count * BLOCK_SIZE;
+	if (f->packed != nullptr)
+		stat->allocated += f->packed->data.size();
+	stat->is_dir = false;
 	set_error(UFS_ERR_NO_ERR);
 	return 0;
 }
 
-#if NEED_RESIZE
+/**
+ * Image layout. All the parts follow each other in this order. Numbers
+ * are in the host byte order.
+ *
+ *     image_header
+ *     image_file[file_count]
+ *     image_extent[extent_count]
+ *     names - full paths of the entries, not zero terminated
+ *     padding up to a page
+ *     data - block data of the extents, one after another
+ */
+static const char IMAGE_MAGIC[8] = {'U', 'F', 'S', 'I', 'M', 'G', '0', '2'};
+
+enum {
+	IMAGE_DATA_ALIGN = 4096,
+	IMAGE_WRITE_BUFFER_SIZE = 1024 * 1024,
+	/** The entry is a directory. It has no size and extents. */
+	IMAGE_ENTRY_DIR = 1,
+};
+
+struct image_header {
+	char magic[8];
+	uint64_t block_size;
+	uint64_t file_count;
+	uint64_t extent_count;
+	uint64_t names_size;
+	uint64_t data_offset;
+	uint64_t data_size;
+};
+
+struct image_file {
+	uint64_t name_offset;
+	uint64_t name_size;
+	uint64_t size;
+	/** Extents of the file in the extent table. */
+	uint64_t first_extent;
+	uint64_t extent_count;
+	uint64_t flags;
+};
+
+/** A run of materialized blocks stored contiguously in the data area. */
+struct image_extent {
+	/** Number of the first block in the file. */
+	uint64_t block_index;
+	uint64_t block_count;
+	/** Offset of the first block from the data area start. */
+	uint64_t data_offset;
+};
+
+/** Buffered writer of an image file. */
+struct image_writer {
+	int fd = -1;
+	std::vector<char> buffer;
+	bool is_ok = true;
+};
+
+static void
+image_writer_flush(image_writer *w)
+{
+	const char *p = w->buffer.data();
+	size_t size = w->buffer.size();
+	while (w->is_ok && size > 0) {
+		ssize_t rc = write(w->fd, p, size);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0) {
+			w->is_ok = false;
+			break;
+		}
+		p += rc;
+		size -= static_cast<size_t>(rc);
+	}
+	w->buffer.clear();
+}
+
+static void
+image_writer_append(image_writer *w, const void *data, size_t size)
+{
+	if (w->buffer.size() + size > IMAGE_WRITE_BUFFER_SIZE)
+		image_writer_flush(w);
+	const char *p = static_cast<const char *>(data);
+	w->buffer.insert(w->buffer.end(), p, p + size);
+}
+
+/** Metadata of an image being built by ufs_save(). */
+struct image_builder {
+	std::vector<image_file> files;
+	std::vector<image_extent> extents;
+	std::vector<file*> sources;
+	std::string names;
+	uint64_t data_size = 0;
+};
+
+static bool
+image_add_entry(const std::string &path, dentry *d, void *arg)
+{
+	image_builder *b = static_cast<image_builder *>(arg);
+	file *f = d->f;
+	if (f != nullptr && !file_unpack(f))
+		return false;
+	image_file entry;
+	entry.name_offset = b->names.size();
+	entry.name_size = path.size();
+	entry.size = f != nullptr ? f->size : 0;
+	entry.first_extent = b->extents.size();
+	entry.flags = f != nullptr ? 0 : IMAGE_ENTRY_DIR;
+	b->names += path;
+	size_t block_end = f == nullptr ? 0 : std::min(f->blocks.size(),
+		block_count_for_size(f->size));
+	for (size_t i = 0; i < block_end; ++i) {
+		if (f->blocks[i] == nullptr)
+			continue;
+		if (b->extents.size() == entry.first_extent ||
+		    b->extents.back().block_index +
+		    b->extents.back().block_count != i)
+			b->extents.push_back({i, 0, b->data_size});
+		++b->extents.back().block_count;
+		b->data_size += BLOCK_SIZE;
+	}
+	entry.extent_count = b->extents.size() - entry.first_extent;
+	b->files.push_back(entry);
+	b->sources.push_back(f);
+	return true;
+}
 
 int
-ufs_resize(int fd, size_t new_size)
+ufs_save(const char *path)
 {
-	filedesc *desc = get_filedesc(fd);
-	if (desc == nullptr) {
-		set_error(UFS_ERR_NO_FILE);
+	if (path == nullptr) {
+		set_error(UFS_ERR_IO);
 		return -1;
 	}
-#if NEED_OPEN_FLAGS
-	if ((desc->rights & UFS_WRITE_ONLY) == 0) {
-		set_error(UFS_ERR_NO_PERMISSION);
-		return -1;
+	file_flush_all();
+	image_builder b;
+	bool is_ok;
+	try {
+		std::string entry_path;
+		is_ok = dir_foreach(&root_dir, &entry_path, image_add_entry,
+				    &b);
+	} catch (const std::bad_alloc&) {
+		is_ok = false;
 	}
-#endif
-	if (new_size > MAX_FILE_SIZE) {
+	if (!is_ok) {
 		set_error(UFS_ERR_NO_MEM);
 		return -1;
 	}
+	const std::vector<image_file> &files = b.files;
+	const std::vector<image_extent> &extents = b.extents;
+	const std::string &names = b.names;
+	uint64_t data_size = b.data_size;
 
-	file *f = desc->atfile;
-	if (new_size > f->size) {
-		size_t target_blocks = block_count_for_size(new_size);
-		if (!ensure_block_count(f, target_blocks)) {
-			set_error(UFS_ERR_NO_MEM);
-			return -1;
+	image_header header;
+	std::memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+	header.block_size = BLOCK_SIZE;
+	header.file_count = files.size();
+	header.extent_count = extents.size();
+	header.names_size = names.size();
+	uint64_t meta_size = sizeof(header) +
+		files.size() * sizeof(image_file) +
+		extents.size() * sizeof(image_extent) + names.size();
+	header.data_offset = (meta_size + IMAGE_DATA_ALIGN - 1) /
+		IMAGE_DATA_ALIGN * IMAGE_DATA_ALIGN;
+	header.data_size = data_size;
+
+	std::string tmp_path;
+	image_writer w;
+	try {
+		tmp_path = std::string(path) + ".tmp";
+		w.buffer.reserve(IMAGE_WRITE_BUFFER_SIZE);
+	} catch (const std::bad_alloc&) {
+		set_error(UFS_ERR_NO_MEM);
+		return -1;
+	}
+	w.fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		    0644);
+	if (w.fd < 0) {
+		set_error(UFS_ERR_IO);
+		return -1;
+	}
+	static const char zeros[IMAGE_DATA_ALIGN] = {};
+	image_writer_append(&w, &header, sizeof(header));
+	image_writer_append(&w, files.data(), files.size() * sizeof(image_file));
+	image_writer_append(&w, extents.data(),
+			    extents.size() * sizeof(image_extent));
+	image_writer_append(&w, names.data(), names.size());
+	image_writer_append(&w, zeros, header.data_offset - meta_size);
+	for (size_t i = 0; i < files.size(); ++i) {
+		const image_file *entry = &files[i];
+		file *f = b.sources[i];
+		for (uint64_t j = 0; j < entry->extent_count; ++j) {
+			const image_extent *e = &extents[entry->first_extent + j];
+			for (uint64_t k = 0; k < e->block_count; ++k) {
+				block *bl = f->blocks[e->block_index + k];
+				image_writer_append(&w, bl->memory, BLOCK_SIZE);
+			}
 		}
-		zero_file_range(f, f->size, new_size);
-		f->size = new_size;
-		set_error(UFS_ERR_NO_ERR);
-		return 0;
 	}
-	if (new_size < f->size) {
-		size_t target_blocks = block_count_for_size(new_size);
-		remove_tail_blocks(f, target_blocks);
-		f->size = new_size;
-		clamp_fds_to_size(f, new_size);
+	image_writer_flush(&w);
+	if (w.is_ok && fsync(w.fd) != 0)
+		w.is_ok = false;
+	if (close(w.fd) != 0)
+		w.is_ok = false;
+	if (!w.is_ok || rename(tmp_path.c_str(), path) != 0) {
+		unlink(tmp_path.c_str());
+		set_error(UFS_ERR_IO);
+		return -1;
 	}
 	set_error(UFS_ERR_NO_ERR);
 	return 0;
 }
 
-#endif
+/** Map an image and validate its metadata. */
+static bool
+image_map_open(const char *path, image_map *image)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(image_header)) {
+		close(fd);
+		return false;
+	}
+	size_t size = static_cast<size_t>(st.st_size);
+	void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return false;
+	image->base = static_cast<char *>(map);
+	image->size = size;
 
-void
-ufs_destroy(void)
+	const image_header *h = reinterpret_cast<image_header *>(image->base);
+	uint64_t meta_size = sizeof(*h);
+	bool is_ok = std::memcmp(h->magic, IMAGE_MAGIC, sizeof(h->magic)) == 0 &&
+		h->block_size == BLOCK_SIZE &&
+		h->file_count <= size / sizeof(image_file) &&
+		h->extent_count <= size / sizeof(image_extent);
+	if (is_ok) {
+		meta_size += h->file_count * sizeof(image_file) +
+			h->extent_count * sizeof(image_extent) + h->names_size;
+		is_ok = h->names_size <= size && meta_size <= h->data_offset &&
+			h->data_offset % IMAGE_DATA_ALIGN == 0 &&
+			h->data_offset <= size &&
+			h->data_size <= size - h->data_offset &&
+			h->data_size % BLOCK_SIZE == 0;
+	}
+	if (!is_ok) {
+		image_unmap(image);
+		return false;
+	}
+	image->data = image->base + h->data_offset;
+	image->data_size = h->data_size;
+	return true;
+}
+
+static const image_file *
+image_files(const image_map *image)
 {
-	for (filedesc *desc : file_descriptors) {
-		if (desc == nullptr)
+	return reinterpret_cast<const image_file *>(image->base +
+		sizeof(image_header));
+}
+
+static const image_extent *
+image_extents(const image_map *image)
+{
+	const image_header *h = reinterpret_cast<image_header *>(image->base);
+	return reinterpret_cast<const image_extent *>(image_files(image) +
+		h->file_count);
+}
+
+static const char *
+image_names(const image_map *image)
+{
+	const image_header *h = reinterpret_cast<image_header *>(image->base);
+	return reinterpret_cast<const char *>(image_extents(image) +
+		h->extent_count);
+}
+
+/** Check the file and extent tables of a mapped image. */
+static bool
+image_validate(const image_map *image)
+{
+	const image_header *h = reinterpret_cast<image_header *>(image->base);
+	const image_file *files = image_files(image);
+	const image_extent *extents = image_extents(image);
+	const char *names = image_names(image);
+	for (uint64_t i = 0; i < h->file_count; ++i) {
+		const image_file *entry = &files[i];
+		if (entry->name_offset > h->names_size ||
+		    entry->name_size > h->names_size - entry->name_offset ||
+		    std::memchr(names + entry->name_offset, 0,
+				entry->name_size) != nullptr ||
+		    entry->size > MAX_FILE_SIZE ||
+		    entry->first_extent > h->extent_count ||
+		    entry->extent_count > h->extent_count - entry->first_extent ||
+		    (entry->flags & ~(uint64_t)IMAGE_ENTRY_DIR) != 0 ||
+		    ((entry->flags & IMAGE_ENTRY_DIR) != 0 &&
+		     (entry->size != 0 || entry->extent_count != 0)))
+			return false;
+		uint64_t block_end = block_count_for_size(entry->size);
+		uint64_t prev_end = 0;
+		for (uint64_t j = 0; j < entry->extent_count; ++j) {
+			const image_extent *e = &extents[entry->first_extent + j];
+			if (e->block_index < prev_end ||
+			    e->block_index > block_end ||
+			    e->block_count > block_end - e->block_index ||
+			    e->data_offset % BLOCK_SIZE != 0 ||
+			    e->data_offset > image->data_size ||
+			    e->block_count > (image->data_size -
+					      e->data_offset) / BLOCK_SIZE)
+				return false;
+			prev_end = e->block_index + e->block_count;
+		}
+	}
+	return true;
+}
+
+/**
+ * Find or create the directory @a path with all its parents. Throws
+ * std::bad_alloc.
+ * @retval nullptr A file is on the way, or a name is invalid.
+ */
+static dir *
+image_make_dir(const std::string &path)
+{
+	dir *d = &root_dir;
+	size_t pos = 0;
+	while (pos < path.size()) {
+		size_t end = path.find('/', pos);
+		if (end == std::string::npos)
+			end = path.size();
+		std::string name = path.substr(pos, end - pos);
+		pos = end + 1;
+		if (name.empty())
 			continue;
-		--desc->atfile->refs;
-		delete desc;
+		auto it = d->entries.find(name);
+		if (it != d->entries.end()) {
+			if (it->second.d == nullptr)
+				return nullptr;
+			d = it->second.d;
+			continue;
+		}
+		if (!name_is_valid(name))
+			return nullptr;
+		dir *child = new dir();
+		child->name = name;
+		child->parent = d;
+		try {
+			d->entries.emplace(name, dentry{nullptr, child});
+		} catch (const std::bad_alloc&) {
+			delete child;
+			throw;
+		}
+		d = child;
 	}
-	std::vector<filedesc*> empty_fds;
-	file_descriptors.swap(empty_fds);
+	return d;
+}
 
-	file *it, *tmp;
-	rlist_foreach_entry_safe(it, &file_list, in_file_list, tmp)
-		file_destroy(it);
+/**
+ * Link a file of an image into the tree.
+ * @retval 0 Success.
+ * @retval UFS_ERR_NO_MEM Not enough memory.
+ * @retval UFS_ERR_IO The path clashes with another entry.
+ */
+static int
+image_create_file(const std::string &path, file **out)
+{
+	size_t name_begin = path.rfind('/');
+	name_begin = name_begin == std::string::npos ? 0 : name_begin + 1;
+	try {
+		std::string name = path.substr(name_begin);
+		dir *d = image_make_dir(path.substr(0, name_begin));
+		if (d == nullptr || !name_is_valid(name) ||
+		    d->entries.count(name) != 0)
+			return UFS_ERR_IO;
+		*out = dir_create_file(d, name);
+	} catch (const std::bad_alloc&) {
+		return UFS_ERR_NO_MEM;
+	}
+	return *out != nullptr ? 0 : UFS_ERR_NO_MEM;
+}
+
+/**
+ * Build the tree of a mapped and validated image.
+ * @retval 0 Success.
+ * @retval UFS_ERR_NO_MEM Not enough memory.
+ * @retval UFS_ERR_IO The paths of the image clash.
+ */
+static int
+image_load_files(const image_map *image)
+{
+	const image_header *h = reinterpret_cast<image_header *>(image->base);
+	const image_file *files = image_files(image);
+	const image_extent *extents = image_extents(image);
+	const char *names = image_names(image);
+	for (uint64_t i = 0; i < h->file_count; ++i) {
+		const image_file *entry = &files[i];
+		file *f = nullptr;
+		try {
+			std::string path(names + entry->name_offset,
+					 entry->name_size);
+			if ((entry->flags & IMAGE_ENTRY_DIR) != 0) {
+				if (image_make_dir(path) == nullptr)
+					return UFS_ERR_IO;
+				continue;
+			}
+			int rc = image_create_file(path, &f);
+			if (rc != 0)
+				return rc;
+		} catch (const std::bad_alloc&) {
+			return UFS_ERR_NO_MEM;
+		}
+		if (entry->extent_count > 0) {
+			const image_extent *last = &extents[entry->first_extent +
+				entry->extent_count - 1];
+			try {
+				f->blocks.resize(last->block_index +
+						 last->block_count, nullptr);
+			} catch (const std::bad_alloc&) {
+				return UFS_ERR_NO_MEM;
+			}
+		}
+		for (uint64_t j = 0; j < entry->extent_count; ++j) {
+			const image_extent *e = &extents[entry->first_extent + j];
+			char *data = image->data + e->data_offset;
+			for (uint64_t k = 0; k < e->block_count; ++k) {
+				f->blocks[e->block_index + k] =
+					reinterpret_cast<block *>(data);
+				data += BLOCK_SIZE;
+			}
+			f->block_count += e->block_count;
+		}
+		file_set_size(f, entry->size);
+	}
+	return 0;
+}
+
+int
+ufs_load(const char *path)
+{
+	if (path == nullptr) {
+		set_error(UFS_ERR_IO);
+		return -1;
+	}
+	image_map image;
+	if (!image_map_open(path, &image)) {
+		set_error(UFS_ERR_IO);
+		return -1;
+	}
+	if (!image_validate(&image)) {
+		image_unmap(&image);
+		set_error(UFS_ERR_IO);
+		return -1;
+	}
+	/*
+	 * The old content has to be dropped before the files are built, so
+	 * as their names wouldn't clash with the new ones.
+	 */
+	ufs_reset();
+	g_image = image;
+	int rc = image_load_files(&g_image);
+	if (rc != 0) {
+		ufs_reset();
+		set_error(static_cast<ufs_error_code>(rc));
+		return -1;
+	}
 	set_error(UFS_ERR_NO_ERR);
+	return 0;
 }
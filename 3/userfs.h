@@ -1,12 +1,25 @@
 #pragma once
 
+#include <stdbool.h>
 #include <sys/types.h>
 
 /**
  * User-defined in-memory filesystem. It is as simple as possible.
- * Each file lies in the memory as an array of blocks. A file
- * has an unique file name, and there are no directories, so the
- * FS is a monolithic flat contiguous folder.
+ * Each file lies in the memory as an array of blocks.
+ *
+ * Files are organized in directories. A path consists of names
+ * separated by '/'. Slashes at the beginning and at the end, as
+ * well as repeated ones, are ignored, so "a/b", "/a/b" and "a//b/"
+ * are the same path. A path without slashes is a file in the root,
+ * like in the flat namespace. The names "." and ".." have no
+ * special meaning and can't be created.
+ *
+ * Files are sparse. A block which was never written is a hole - it
+ * takes no memory and reads back as zeros.
+ *
+ * Blocks are reference counted and copied on write. It makes clones
+ * and snapshots cheap - they share all the blocks with the origin
+ * until either side writes.
  */
 
 /**
@@ -52,6 +65,25 @@ enum open_flags {
 	 */
 	UFS_READ_WRITE = UFS_READ_ONLY | UFS_WRITE_ONLY,
 #endif
+	/**
+	 * Collect small writes in a descriptor buffer and apply them
+	 * to the file in bulk. The buffer is flushed when it is full,
+	 * on a seek to another position, on close, and when the file
+	 * is read, resized, stat-ed, cloned, or written by another
+	 * descriptor. So the buffering is not visible, except for the
+	 * memory limit: a write can't fail because of it until the
+	 * flush. Then the buffered data is lost, and the error is
+	 * reported by the next call on the descriptor, including
+	 * ufs_close().
+	 */
+	UFS_BUFFERED = 0b1000,
+	/**
+	 * Each write goes to the end of the file, wherever the
+	 * descriptor position is. The position is moved after the
+	 * written data. So the writes of several such descriptors
+	 * never overwrite each other.
+	 */
+	UFS_APPEND = 0b10000,
 };
 
 /** Possible errors from all functions. */
@@ -60,6 +92,18 @@ enum ufs_error_code {
 	UFS_ERR_NO_FILE,
 	UFS_ERR_NO_MEM,
 	UFS_ERR_NOT_IMPLEMENTED,
+	/** Can't read or write an image, or it is corrupted. */
+	UFS_ERR_IO,
+	/** A file or a directory already exists. */
+	UFS_ERR_EXISTS,
+	/** A directory is used where a file is expected. */
+	UFS_ERR_IS_DIR,
+	/** A file is used where a directory is expected. */
+	UFS_ERR_NOT_DIR,
+	/** Can't remove a directory which is not empty. */
+	UFS_ERR_NOT_EMPTY,
+	/** The operation makes no sense for its arguments. */
+	UFS_ERR_INVALID,
 
 #if NEED_OPEN_FLAGS
 	UFS_ERR_NO_PERMISSION,
@@ -78,7 +122,9 @@ ufs_errno();
  * @retval > 0 File descriptor.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - no such file, and UFS_CREATE flag is
- *       not specified.
+ *       not specified. Or the parent directory doesn't exist.
+ *     - UFS_ERR_IS_DIR - the path is a directory.
+ *     - UFS_ERR_INVALID - the name can't be created.
  */
 int
 ufs_open(const char *filename, int flags);
@@ -107,16 +153,51 @@ ufs_write(int fd, const char *buf, size_t size);
  * @retval 0 EOF.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - buffered writes of the descriptor are
+ *       lost, see UFS_BUFFERED.
  */
 ssize_t
 ufs_read(int fd, char *buf, size_t size);
 
+/**
+ * Write data at the given offset. The descriptor position is not
+ * changed, and the write is not buffered. With UFS_APPEND the data
+ * still goes to the file end. Errors are the same as of ufs_write().
+ */
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, size_t offset);
+
+/**
+ * Read data from the given offset. The descriptor position is not
+ * changed. Errors are the same as of ufs_read().
+ */
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, size_t offset);
+
+/**
+ * Move the position of a descriptor. The position may be beyond
+ * the file end: reads there return EOF, and a write fills the gap
+ * with zeros.
+ * @param fd File descriptor from ufs_open().
+ * @param pos New position from the file start.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - buffered writes of the descriptor are
+ *       lost, the position is not changed.
+ */
+int
+ufs_seek(int fd, size_t pos);
+
 /**
  * Close a file.
  * @param fd File descriptor from ufs_open().
  * @retval 0 Success.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - buffered writes are lost. The descriptor
+ *       is closed anyway.
  */
 int
 ufs_close(int fd);
@@ -132,16 +213,97 @@ ufs_close(int fd);
  * @param filename Name of a file to delete.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - no such file.
+ *     - UFS_ERR_IS_DIR - the path is a directory, see ufs_rmdir().
  */
 int
 ufs_delete(const char *filename);
 
+/**
+ * Create a directory. Its parent has to exist.
+ * @param path Path of the new directory.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no parent directory.
+ *     - UFS_ERR_EXISTS - a file or a directory exists at the path.
+ *     - UFS_ERR_INVALID - the name can't be created.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_mkdir(const char *path);
+
+/**
+ * Delete an empty directory.
+ * @param path Path of the directory.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such directory.
+ *     - UFS_ERR_NOT_DIR - the path is a file.
+ *     - UFS_ERR_NOT_EMPTY - the directory has entries.
+ *     - UFS_ERR_INVALID - the path is the root.
+ */
+int
+ufs_rmdir(const char *path);
+
+/** Directory entry, see ufs_readdir(). */
+struct ufs_dirent {
+	/** Name of the entry, without the directory path. */
+	const char *name;
+	bool is_dir;
+};
+
+/**
+ * Callback of ufs_readdir(). It must not change the filesystem.
+ * @retval 0 Continue the iteration.
+ * @retval != 0 Stop it.
+ */
+typedef int (*ufs_readdir_f)(const struct ufs_dirent *entry, void *arg);
+
+/**
+ * Call @a cb for each entry of a directory. The order is not
+ * defined.
+ * @param path Path of the directory. "" or "/" is the root.
+ * @param cb Callback.
+ * @param arg Argument passed to the callback as is.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such directory.
+ *     - UFS_ERR_NOT_DIR - the path is a file.
+ */
+int
+ufs_readdir(const char *path, ufs_readdir_f cb, void *arg);
+
+/**
+ * Move a file or a directory. An existing file at @a new_path is
+ * replaced - it behaves like deleted by ufs_delete(). An existing
+ * directory is never replaced. Opened descriptors of the moved
+ * files stay valid.
+ * @param old_path Current path.
+ * @param new_path New path. Its parent directory has to exist.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no source, or no parent directory of
+ *       the target.
+ *     - UFS_ERR_EXISTS - the target is a directory.
+ *     - UFS_ERR_NOT_DIR - the source is a directory, and the
+ *       target is a file.
+ *     - UFS_ERR_INVALID - a directory is moved inside itself, or
+ *       the new name can't be created.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_rename(const char *old_path, const char *new_path);
+
 #if NEED_RESIZE
 
 /**
  * Resize a file opened by the file descriptor @a fd. If current
- * file size is less than @a new_size, then new empty blocks are
- * created and positions of opened file descriptors are not
+ * file size is less than @a new_size, then the file is extended
+ * by a hole, which reads as zeros and takes no memory until it is
+ * written, and positions of opened file descriptors are not
  * changed. If the current size is bigger than @a new_size, then
  * the blocks are truncated. Opened file descriptors behind the
  * new file size should proceed from the new file end.
@@ -161,6 +323,258 @@ ufs_resize(int fd, size_t new_size);
 
 #endif
 
+/** Modes of ufs_fallocate(). */
+enum ufs_fallocate_mode {
+	/** Don't change the file size, even if the range is beyond it. */
+	UFS_FALLOC_KEEP_SIZE = 0b0001,
+	/**
+	 * Free the blocks of the range, it becomes a hole. The size is
+	 * never changed.
+	 */
+	UFS_FALLOC_PUNCH_HOLE = 0b0010,
+	/** Zero the range and allocate the blocks of it. */
+	UFS_FALLOC_ZERO_RANGE = 0b0100,
+};
+
+/**
+ * Manipulate the storage of the range [@a offset, @a offset + @a len)
+ * of a file. Without PUNCH_HOLE and ZERO_RANGE the holes of the range
+ * are allocated and zeroed, and the data is not changed. So the next
+ * writes into the range don't allocate anything. The file is extended
+ * to the range end unless KEEP_SIZE is given. The blocks beyond the
+ * size are dropped by a shrink with ufs_resize().
+ *
+ * @param fd File descriptor from ufs_open().
+ * @param offset Range start.
+ * @param len Range length.
+ * @param mode Bitwise combination of ufs_fallocate_mode.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Nothing is changed then.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_PERMISSION - the descriptor can't write.
+ *     - UFS_ERR_INVALID - @a len is 0, or the mode is unknown or
+ *       has both PUNCH_HOLE and ZERO_RANGE.
+ *     - UFS_ERR_NO_MEM - not enough memory, or the range end is
+ *       beyond the max file size.
+ */
+int
+ufs_fallocate(int fd, size_t offset, size_t len, int mode);
+
+/**
+ * Make the file @a dst_name a copy of the file @a src_name. The
+ * copy shares all the blocks with the source, so it takes time
+ * proportional to the number of blocks and no memory for data.
+ * A block is copied when either of the files writes into it. If
+ * @a dst_name does not exist, it is created. Otherwise its content
+ * is replaced and its opened descriptors behave like after a resize
+ * to the new size.
+ * @param src_name Name of a file to copy.
+ * @param dst_name Name of the copy.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such source file, or no parent
+ *       directory of the copy.
+ *     - UFS_ERR_IS_DIR - the copy path is a directory.
+ *     - UFS_ERR_INVALID - the copy name can't be created.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_clone(const char *src_name, const char *dst_name);
+
+/**
+ * Take a snapshot of all the files. The snapshot is a frozen copy
+ * of them, which can be read while the live files keep changing.
+ * Like clones, the snapshot shares the blocks with the live files.
+ *
+ * @retval >= 0 Snapshot ID.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_snapshot_create(void);
+
+/**
+ * Open a file of a snapshot. The descriptor is read only and is
+ * used like any other. It stays valid even if the snapshot is
+ * deleted.
+ * @param snapshot_id ID from ufs_snapshot_create().
+ * @param filename Path of the file in the snapshot.
+ *
+ * @retval >= 0 File descriptor.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such snapshot or no such file in it.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_snapshot_open(int snapshot_id, const char *filename);
+
+/**
+ * Delete a snapshot and release the blocks only it references.
+ * @param snapshot_id ID from ufs_snapshot_create().
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such snapshot.
+ */
+int
+ufs_snapshot_delete(int snapshot_id);
+
+/** File information. */
+struct ufs_stat {
+	/** Logical file size, holes included. */
+	size_t size;
+	/** Memory taken by the materialized blocks of the file. */
+	size_t allocated;
+	/** The path is a directory. Then the sizes are zero. */
+	bool is_dir;
+};
+
+/**
+ * Get information about a file opened by the descriptor @a fd.
+ * @param fd File descriptor from ufs_open().
+ * @param[out] stat Result.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+int
+ufs_fstat(int fd, struct ufs_stat *stat);
+
+/**
+ * Get information about a file or a directory by its path.
+ * @param path Path of a file or a directory.
+ * @param[out] stat Result.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such file or directory.
+ */
+int
+ufs_stat(const char *path, struct ufs_stat *stat);
+
+/** Memory usage of the whole filesystem. */
+struct ufs_mem_stat {
+	/** Sum of the file sizes, holes included. */
+	size_t logical_size;
+	/** Memory taken by the materialized file blocks. */
+	size_t physical_size;
+	/** Memory mapped for the blocks, used and free. */
+	size_t mapped_size;
+	/** Part of the mapped memory backed by huge pages. */
+	size_t huge_mapped_size;
+	/** Free block memory in the mapped chunks. */
+	size_t free_size;
+	/**
+	 * Part of the free memory lying in partially used chunks. It can't
+	 * be returned to the system until the chunks are emptied.
+	 */
+	size_t fragmented_size;
+	/** Memory limit, see ufs_set_memory_limit(). */
+	size_t limit;
+	/** Size of the image mapped by ufs_load(). */
+	size_t image_size;
+	/** Memory of the unique blocks known to dedup. */
+	size_t dedup_size;
+	/**
+	 * Size of the file data backed by those blocks. Divided by
+	 * dedup_size, it gives the dedup ratio.
+	 */
+	size_t dedup_logical_size;
+	/** Memory of the compressed data of cold files. */
+	size_t compressed_size;
+	/** Size of the blocks compressed into that data. */
+	size_t compressed_logical_size;
+};
+
+/**
+ * Get memory usage of the filesystem.
+ * @param[out] stat Result.
+ */
+void
+ufs_get_mem_stat(struct ufs_mem_stat *stat);
+
+/**
+ * Limit the memory of all the file blocks. A write which would need
+ * more memory fails with UFS_ERR_NO_MEM and doesn't change the file.
+ * The check depends only on the number of used blocks, so the result
+ * is deterministic.
+ * @param limit Limit in bytes. 0 means no limit, the default.
+ */
+void
+ufs_set_memory_limit(size_t limit);
+
+/**
+ * Enable or disable block deduplication. When enabled, each block
+ * completely written by a write is hashed, and the files having
+ * blocks with the same content share one copy of them. A shared
+ * block is copied on the next write into it, like after
+ * ufs_clone(). A block of zeros is dropped and becomes a hole.
+ * Blocks written before enabling are not deduplicated. Disabled by
+ * default.
+ */
+void
+ufs_set_dedup(bool enable);
+
+/**
+ * Enable or disable huge pages for big files. When enabled, the file
+ * blocks beyond the first 4MB are taken from separate chunks, which
+ * are advised to the kernel to be backed by 2MB pages. The other
+ * blocks are advised to stay on small pages, so when disabled no file
+ * uses huge pages even with THP enabled system-wide. Changing it
+ * affects only the blocks allocated afterwards. Enabled by default.
+ */
+void
+ufs_set_huge_pages(bool enable);
+
+/**
+ * Compress the coldest files until the block memory fits into
+ * @a budget. The files are taken in the order of their last access.
+ * A compressed file frees its blocks and is decompressed back on the
+ * next read, write, or resize. Files with open buffered writes,
+ * shared blocks, or data which doesn't compress well are skipped.
+ * @param budget Wanted block memory in bytes.
+ * @retval Number of the compressed files.
+ */
+int
+ufs_compact(size_t budget);
+
+/**
+ * Save all the files into an image file at @a path. The image is
+ * written into a temporary file first and then renamed, so the
+ * old image at the same path stays intact on a failure and can be
+ * the image the filesystem was loaded from.
+ * @param path Path in the real filesystem.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_IO - can't write the image.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_save(const char *path);
+
+/**
+ * Replace all the files with the ones from an image made by
+ * ufs_save(). The image is mapped into the memory and the reads
+ * are served right from the mapping. A block is copied only on the
+ * first write into it, so the loading time doesn't depend on the
+ * data size. All the opened descriptors and snapshots are dropped
+ * like in ufs_destroy(). If the image can't be read, the
+ * filesystem is not changed. If the memory ends while the files
+ * are being built, or their paths clash, the filesystem is left
+ * empty.
+ * @param path Path in the real filesystem.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_IO - can't read the image or it is corrupted.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_load(const char *path);
+
 /**
  * Destroy all the global variables, free all the memory, close and delete all
  * the files. After the destruction neither of the ufs functions are supposed to
@@ -0,0 +1,638 @@
+/**
+ * Thread pool benchmarks. Each one prints a JSON object with its name,
+ * the number of executed tasks, and the time:
+ *
+ *     ./bench [name_filter]
+ *
+ * Only the benchmarks with the filter in the name are run. The scaling
+ * ones are run for the thread counts from 1 to TPOOL_MAX_THREADS. They
+ * can show linear growth only on a machine with that many cores.
+ */
+#include "thread_parallel.h"
+#include "thread_pool.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+/** A running benchmark. */
+struct bench {
+	char name[64];
+	int threads;
+	uint64_t ops;
+	uint64_t start_ns;
+	uint64_t pause_ns;
+};
+
+static const char *bench_filter = NULL;
+static bool bench_is_first = true;
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static bool
+bench_is_enabled(const char *name)
+{
+	return bench_filter == NULL || strstr(name, bench_filter) != NULL;
+}
+
+/** Start measuring. Setup of the benchmark has to be done before. */
+static void
+bench_start(struct bench *b, const char *name, int threads)
+{
+	snprintf(b->name, sizeof(b->name), "%s_%d", name, threads);
+	b->threads = threads;
+	b->ops = 0;
+	b->start_ns = bench_now_ns();
+}
+
+/** Exclude the time until bench_resume() from the measurement. */
+static void
+bench_pause(struct bench *b)
+{
+	b->pause_ns = bench_now_ns();
+}
+
+static void
+bench_resume(struct bench *b)
+{
+	b->start_ns += bench_now_ns() - b->pause_ns;
+}
+
+static void
+bench_finish(struct bench *b)
+{
+	uint64_t ns = bench_now_ns() - b->start_ns;
+	uint64_t ops = b->ops != 0 ? b->ops : 1;
+	printf("%s\n    {\"name\": \"%s\", \"threads\": %d, \"ops\": %llu, "
+	       "\"ns\": %llu, \"ns_per_op\": %.1f, \"ops_per_sec\": %.0f}",
+	       bench_is_first ? "" : ",", b->name, b->threads,
+	       (unsigned long long)b->ops, (unsigned long long)ns,
+	       (double)ns / ops, ops / (ns / 1e9));
+	fflush(stdout);
+	bench_is_first = false;
+}
+
+static void
+bench_check(bool ok)
+{
+	if (!ok) {
+		fprintf(stderr, "benchmark failed\n");
+		abort();
+	}
+}
+
+enum {
+	/** Tasks spawning the tiny ones. */
+	BENCH_ROOT_COUNT = 64,
+	BENCH_CHILD_COUNT = 1024,
+	/** Iterations of the work loop of a tiny task. */
+	BENCH_TASK_WORK = 100,
+	/** Size of the batches of the external pushes. */
+	BENCH_BATCH_SIZE = 1000,
+	BENCH_BATCH_COUNT = 100,
+	/** Push and join rounds of the latency benchmark. */
+	BENCH_LATENCY_COUNT = 20000,
+	/** Pause rounds of the idle workers in the spinning variant. */
+	BENCH_SPIN_COUNT = 10000,
+	/** Bursts of the elastic benchmark, with a pause in between. */
+	BENCH_BURST_COUNT = 20,
+	BENCH_BURST_PAUSE_US = 5000,
+	/** Batch tasks queued before the interactive ones. */
+	BENCH_BACKLOG_COUNT = 20000,
+	BENCH_INTERACTIVE_COUNT = 100,
+	/** Independent chains of dependent tasks. */
+	BENCH_CHAIN_COUNT = 64,
+	BENCH_CHAIN_LENGTH = 64,
+	/** Sizes of the parallel algorithm benchmarks. */
+	BENCH_ALGO_MEMORY_SIZE = 1 << 22,
+	BENCH_ALGO_COMPUTE_SIZE = 1 << 16,
+	BENCH_ALGO_SORT_SIZE = 1 << 20,
+	BENCH_ALGO_GRAIN = 4096,
+	/** Iterations of the compute-bound kernel per element. */
+	BENCH_ALGO_COMPUTE_WORK = 1000,
+};
+
+/** A counter taking a whole cache line, not to be shared. */
+struct bench_counter {
+	alignas(64) uint64_t value;
+};
+
+static void
+bench_tiny_work(uint64_t *counter)
+{
+	uint64_t x = *counter;
+	for (int i = 0; i < BENCH_TASK_WORK; ++i)
+		x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+	/* Keep the loop from being optimized out. */
+	__asm__ __volatile__("" : : "r"(x));
+	__atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+static void
+bench_wait_counters(struct bench_counter *counters, int count,
+		    uint64_t total)
+{
+	while (true) {
+		uint64_t sum = 0;
+		for (int i = 0; i < count; ++i)
+			sum += __atomic_load_n(&counters[i].value,
+					       __ATOMIC_RELAXED);
+		if (sum == total)
+			return;
+		usleep(50);
+	}
+}
+
+/**
+ * Tiny tasks spawned from inside the pool. They go to the local deques
+ * of the workers, and the idle workers steal them. The cached variant
+ * takes the task memory from the pool, and the numa variant also keeps
+ * the queues and the memory per node.
+ */
+static void
+bench_spawn(int thread_count, bool is_cached, bool is_numa)
+{
+	const char *name = is_numa ? "spawn_numa_threads" :
+			   is_cached ? "spawn_cached_threads" : "spawn_threads";
+	if (!bench_is_enabled(name))
+		return;
+	struct thread_pool_options opts;
+	thread_pool_options_create(&opts);
+	opts.thread_count = thread_count;
+	opts.numa_aware = is_numa;
+	struct thread_pool *pool;
+	bench_check(thread_pool_new_ex(&opts, &pool) == 0);
+	struct bench_counter counters[BENCH_ROOT_COUNT];
+	memset(counters, 0, sizeof(counters));
+	struct thread_task *roots[BENCH_ROOT_COUNT];
+	for (int i = 0; i < BENCH_ROOT_COUNT; ++i) {
+		uint64_t *counter = &counters[i].value;
+		bench_check(thread_task_new(&roots[i], [pool, counter,
+							is_cached]() {
+			for (int j = 0; j < BENCH_CHILD_COUNT; ++j) {
+				struct thread_task *t;
+				auto f = [counter]() {
+					bench_tiny_work(counter);
+				};
+				if (is_cached)
+					thread_pool_task_new(pool, &t, f);
+				else
+					thread_task_new(&t, f);
+				bench_check(thread_pool_push_task(pool,
+								  t) == 0);
+				thread_task_detach(t);
+			}
+		}) == 0);
+	}
+	/* The first round is not measured, it warms the caches up. */
+	struct bench b;
+	for (int round = 0; round < 2; ++round) {
+		memset(counters, 0, sizeof(counters));
+		if (round == 1)
+			bench_start(&b, name, thread_count);
+		for (int i = 0; i < BENCH_ROOT_COUNT; ++i)
+			bench_check(thread_pool_push_task(pool, roots[i]) == 0);
+		bench_wait_counters(counters, BENCH_ROOT_COUNT,
+				    BENCH_ROOT_COUNT * BENCH_CHILD_COUNT);
+		for (int i = 0; i < BENCH_ROOT_COUNT; ++i)
+			bench_check(thread_task_join(roots[i]) == 0);
+	}
+	b.ops = BENCH_ROOT_COUNT * BENCH_CHILD_COUNT;
+	bench_finish(&b);
+	for (int i = 0; i < BENCH_ROOT_COUNT; ++i)
+		bench_check(thread_task_delete(roots[i]) == 0);
+	while (thread_pool_delete(pool) != 0)
+		usleep(100);
+}
+
+/**
+ * Tiny tasks pushed from outside of the pool in batches and joined.
+ * They go through the injection queue.
+ */
+static void
+bench_external(int thread_count)
+{
+	const char *name = "external_threads";
+	if (!bench_is_enabled(name))
+		return;
+	struct thread_pool *pool;
+	bench_check(thread_pool_new(thread_count, &pool) == 0);
+	struct bench_counter counter;
+	counter.value = 0;
+	struct thread_task **tasks = new thread_task*[BENCH_BATCH_SIZE];
+	for (int i = 0; i < BENCH_BATCH_SIZE; ++i) {
+		bench_check(thread_task_new(&tasks[i], [&counter]() {
+			bench_tiny_work(&counter.value);
+		}) == 0);
+	}
+	struct bench b;
+	bench_start(&b, name, thread_count);
+	for (int k = 0; k < BENCH_BATCH_COUNT; ++k) {
+		for (int i = 0; i < BENCH_BATCH_SIZE; ++i)
+			bench_check(thread_pool_push_task(pool, tasks[i]) == 0);
+		for (int i = 0; i < BENCH_BATCH_SIZE; ++i)
+			bench_check(thread_task_join(tasks[i]) == 0);
+		b.ops += BENCH_BATCH_SIZE;
+	}
+	bench_finish(&b);
+	for (int i = 0; i < BENCH_BATCH_SIZE; ++i)
+		bench_check(thread_task_delete(tasks[i]) == 0);
+	delete[] tasks;
+	bench_check(thread_pool_delete(pool) == 0);
+}
+
+/**
+ * Latency of push and join of one empty task at a time. It is the
+ * overhead of the pool itself, the task does nothing. With spinning
+ * the workers don't park between the tasks.
+ */
+static void
+bench_push_join(int thread_count, int spin_count)
+{
+	const char *name = spin_count == 0 ? "push_join_threads" :
+			   "push_join_spin_threads";
+	if (!bench_is_enabled(name))
+		return;
+	struct thread_pool_options opts;
+	thread_pool_options_create(&opts);
+	opts.thread_count = thread_count;
+	opts.spin_count = spin_count;
+	struct thread_pool *pool;
+	bench_check(thread_pool_new_ex(&opts, &pool) == 0);
+	struct thread_task *task;
+	bench_check(thread_task_new(&task, []() {}) == 0);
+	struct bench b;
+	bench_start(&b, name, thread_count);
+	for (int i = 0; i < BENCH_LATENCY_COUNT; ++i) {
+		bench_check(thread_pool_push_task(pool, task) == 0);
+		bench_check(thread_task_join(task) == 0);
+	}
+	b.ops = BENCH_LATENCY_COUNT;
+	bench_finish(&b);
+	bench_check(thread_task_delete(task) == 0);
+	bench_check(thread_pool_delete(pool) == 0);
+}
+
+/**
+ * Submission rate of the tiny tasks, one by one or in batches. Only the
+ * pushes are measured, not the execution.
+ */
+static void
+bench_submit(int thread_count, bool is_batch)
+{
+	const char *name = is_batch ? "submit_batch_threads" :
+			   "submit_single_threads";
+	if (!bench_is_enabled(name))
+		return;
+	struct thread_pool *pool;
+	bench_check(thread_pool_new(thread_count, &pool) == 0);
+	struct bench_counter counter;
+	counter.value = 0;
+	struct thread_task **tasks = new thread_task*[BENCH_BATCH_SIZE];
+	for (int i = 0; i < BENCH_BATCH_SIZE; ++i) {
+		bench_check(thread_task_new(&tasks[i], [&counter]() {
+			bench_tiny_work(&counter.value);
+		}) == 0);
+	}
+	struct bench b;
+	bench_start(&b, name, thread_count);
+	for (int k = 0; k < BENCH_BATCH_COUNT; ++k) {
+		if (is_batch) {
+			bench_check(thread_pool_push_tasks(
+				pool, tasks, BENCH_BATCH_SIZE) == 0);
+		} else {
+			for (int i = 0; i < BENCH_BATCH_SIZE; ++i) {
+				bench_check(thread_pool_push_task(
+					pool, tasks[i]) == 0);
+			}
+		}
+		b.ops += BENCH_BATCH_SIZE;
+		bench_pause(&b);
+		for (int i = 0; i < BENCH_BATCH_SIZE; ++i)
+			bench_check(thread_task_join(tasks[i]) == 0);
+		bench_resume(&b);
+	}
+	bench_finish(&b);
+	for (int i = 0; i < BENCH_BATCH_SIZE; ++i)
+		bench_check(thread_task_delete(tasks[i]) == 0);
+	delete[] tasks;
+	bench_check(thread_pool_delete(pool) == 0);
+}
+
+/**
+ * Bursts of the tiny tasks pushed from outside, with idle pauses longer
+ * than the idle timeout in between. The elastic pool retires the
+ * threads in the pauses, and starts them again for each burst. The
+ * pauses are not measured.
+ */
+static void
+bench_burst(int thread_count, bool is_elastic)
+{
+	const char *name = is_elastic ? "burst_elastic_threads" :
+			   "burst_fixed_threads";
+	if (!bench_is_enabled(name))
+		return;
+	struct thread_pool_options opts;
+	thread_pool_options_create(&opts);
+	opts.thread_count = thread_count;
+	if (is_elastic) {
+		opts.min_threads = 1;
+		opts.idle_timeout = BENCH_BURST_PAUSE_US / 1000000.0 / 5;
+	}
+	struct thread_pool *pool;
+	bench_check(thread_pool_new_ex(&opts, &pool) == 0);
+	struct bench_counter counter;
+	counter.value = 0;
+	struct thread_task **tasks = new thread_task*[BENCH_BATCH_SIZE];
+	for (int i = 0; i < BENCH_BATCH_SIZE; ++i) {
+		bench_check(thread_task_new(&tasks[i], [&counter]() {
+			bench_tiny_work(&counter.value);
+		}) == 0);
+	}
+	struct bench b;
+	bench_start(&b, name, thread_count);
+	for (int k = 0; k < BENCH_BURST_COUNT; ++k) {
+		bench_check(thread_pool_push_tasks(pool, tasks,
+						   BENCH_BATCH_SIZE) == 0);
+		for (int i = 0; i < BENCH_BATCH_SIZE; ++i)
+			bench_check(thread_task_join(tasks[i]) == 0);
+		b.ops += BENCH_BATCH_SIZE;
+		bench_pause(&b);
+		usleep(BENCH_BURST_PAUSE_US);
+		bench_resume(&b);
+	}
+	bench_finish(&b);
+	for (int i = 0; i < BENCH_BATCH_SIZE; ++i)
+		bench_check(thread_task_delete(tasks[i]) == 0);
+	delete[] tasks;
+	bench_check(thread_pool_delete(pool) == 0);
+}
+
+/**
+ * Latency of push and join of an interactive task while the pool works
+ * through a backlog of batch tasks. In the priority variant the batch
+ * ones are low priority and the interactive ones are high, otherwise
+ * all are in one FIFO.
+ */
+static void
+bench_interactive(int thread_count, bool is_prio)
+{
+	const char *name = is_prio ? "interactive_prio_threads" :
+			   "interactive_fifo_threads";
+	if (!bench_is_enabled(name))
+		return;
+	struct thread_pool *pool;
+	bench_check(thread_pool_new(thread_count, &pool) == 0);
+	struct bench_counter counter;
+	counter.value = 0;
+	struct thread_task **tasks = new thread_task*[BENCH_BACKLOG_COUNT];
+	for (int i = 0; i < BENCH_BACKLOG_COUNT; ++i) {
+		bench_check(thread_task_new(&tasks[i], [&counter]() {
+			bench_tiny_work(&counter.value);
+		}) == 0);
+		if (is_prio) {
+			bench_check(thread_task_set_priority(
+				tasks[i], TPOOL_PRIORITY_LOW) == 0);
+		}
+	}
+	struct thread_task *task;
+	bench_check(thread_task_new(&task, []() {}) == 0);
+	if (is_prio)
+		bench_check(thread_task_set_priority(task,
+						     TPOOL_PRIORITY_HIGH) == 0);
+	bench_check(thread_pool_push_tasks(pool, tasks,
+					   BENCH_BACKLOG_COUNT) == 0);
+	struct bench b;
+	bench_start(&b, name, thread_count);
+	for (int i = 0; i < BENCH_INTERACTIVE_COUNT; ++i) {
+		bench_check(thread_pool_push_task(pool, task) == 0);
+		bench_check(thread_task_join(task) == 0);
+	}
+	b.ops = BENCH_INTERACTIVE_COUNT;
+	bench_finish(&b);
+	for (int i = 0; i < BENCH_BACKLOG_COUNT; ++i) {
+		bench_check(thread_task_join(tasks[i]) == 0);
+		bench_check(thread_task_delete(tasks[i]) == 0);
+	}
+	delete[] tasks;
+	bench_check(thread_task_delete(task) == 0);
+	bench_check(thread_pool_delete(pool) == 0);
+}
+
+/**
+ * Chains of dependent tiny tasks. With dependencies the workers queue
+ * each next task themselves. Without, the caller pushes the tasks stage
+ * by stage and joins each stage, the way it is done with push and join
+ * only.
+ */
+static void
+bench_chain(int thread_count, bool is_dag)
+{
+	const char *name = is_dag ? "chain_dag_threads" :
+			   "chain_join_threads";
+	if (!bench_is_enabled(name))
+		return;
+	struct thread_pool *pool;
+	bench_check(thread_pool_new(thread_count, &pool) == 0);
+	struct bench_counter counter;
+	counter.value = 0;
+	int count = BENCH_CHAIN_COUNT * BENCH_CHAIN_LENGTH;
+	/* Stage by stage, chain by chain. */
+	struct thread_task **tasks = new thread_task*[count];
+	for (int i = 0; i < count; ++i) {
+		bench_check(thread_task_new(&tasks[i], [&counter]() {
+			bench_tiny_work(&counter.value);
+		}) == 0);
+	}
+	struct bench b;
+	bench_start(&b, name, thread_count);
+	if (is_dag) {
+		bench_check(thread_pool_push_tasks(pool, tasks,
+						   BENCH_CHAIN_COUNT) == 0);
+		for (int i = BENCH_CHAIN_COUNT; i < count; ++i) {
+			bench_check(thread_pool_push_after(pool, tasks[i],
+				&tasks[i - BENCH_CHAIN_COUNT], 1) == 0);
+		}
+		for (int i = count - BENCH_CHAIN_COUNT; i < count; ++i)
+			bench_check(thread_task_join(tasks[i]) == 0);
+	} else {
+		for (int i = 0; i < count; i += BENCH_CHAIN_COUNT) {
+			bench_check(thread_pool_push_tasks(pool, &tasks[i],
+				BENCH_CHAIN_COUNT) == 0);
+			for (int j = i; j < i + BENCH_CHAIN_COUNT; ++j)
+				bench_check(thread_task_join(tasks[j]) == 0);
+		}
+	}
+	b.ops = count;
+	bench_finish(&b);
+	for (int i = 0; i < count; ++i) {
+		bench_check(thread_task_join(tasks[i]) == 0);
+		bench_check(thread_task_delete(tasks[i]) == 0);
+	}
+	delete[] tasks;
+	bench_check(thread_pool_delete(pool) == 0);
+}
+
+static uint64_t
+bench_compute_kernel(size_t i)
+{
+	uint64_t x = i;
+	for (int k = 0; k < BENCH_ALGO_COMPUTE_WORK; ++k)
+		x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+	return x;
+}
+
+/**
+ * Parallel algorithms on memory-bound and compute-bound kernels. With
+ * zero threads the serial version is run, the baseline of the speedup.
+ */
+static void
+bench_algo(int thread_count)
+{
+	bool is_serial = thread_count == 0;
+	struct thread_pool *pool = NULL;
+	if (thread_count != 0)
+		bench_check(thread_pool_new(thread_count, &pool) == 0);
+	const char *name;
+	struct bench b;
+
+	/* Memory-bound: a = a + k * c over arrays bigger than caches. */
+	name = is_serial ? "algo_triad_serial" : "algo_triad_threads";
+	if (bench_is_enabled(name)) {
+		std::vector<double> a(BENCH_ALGO_MEMORY_SIZE, 1);
+		std::vector<double> c(BENCH_ALGO_MEMORY_SIZE, 2);
+		bench_start(&b, name, thread_count);
+		auto triad = [&](size_t i) { a[i] += 3 * c[i]; };
+		if (is_serial) {
+			for (size_t i = 0; i < a.size(); ++i)
+				triad(i);
+		} else {
+			bench_check(tpool_parallel_for(pool, 0, a.size(),
+				BENCH_ALGO_GRAIN * 16, triad) == 0);
+		}
+		b.ops = a.size();
+		bench_finish(&b);
+		bench_check(a[a.size() / 2] == 7);
+	}
+
+	/* Compute-bound: a long dependent chain per element, summed. */
+	name = is_serial ? "algo_compute_serial" : "algo_compute_threads";
+	if (bench_is_enabled(name)) {
+		uint64_t sum = 0;
+		bench_start(&b, name, thread_count);
+		if (is_serial) {
+			for (size_t i = 0; i < BENCH_ALGO_COMPUTE_SIZE; ++i)
+				sum += bench_compute_kernel(i);
+		} else {
+			bench_check(tpool_parallel_reduce(pool, 0,
+				BENCH_ALGO_COMPUTE_SIZE, 64, (uint64_t)0,
+				bench_compute_kernel,
+				[](uint64_t x, uint64_t y) { return x + y; },
+				&sum) == 0);
+		}
+		b.ops = BENCH_ALGO_COMPUTE_SIZE;
+		bench_finish(&b);
+		__asm__ __volatile__("" : : "r"(sum));
+	}
+
+	/* Memory-bound scan. */
+	name = is_serial ? "algo_scan_serial" : "algo_scan_threads";
+	if (bench_is_enabled(name)) {
+		std::vector<int64_t> v(BENCH_ALGO_MEMORY_SIZE, 1);
+		bench_start(&b, name, thread_count);
+		if (is_serial) {
+			for (size_t i = 1; i < v.size(); ++i)
+				v[i] += v[i - 1];
+		} else {
+			bench_check(tpool_parallel_scan(pool, v.data(),
+				v.data(), v.size(), BENCH_ALGO_GRAIN * 16,
+				(int64_t)0, [](int64_t x, int64_t y) {
+					return x + y;
+				}) == 0);
+		}
+		b.ops = v.size();
+		bench_finish(&b);
+		bench_check(v.back() == (int64_t)v.size());
+	}
+
+	name = is_serial ? "algo_sort_serial" : "algo_sort_threads";
+	if (bench_is_enabled(name)) {
+		std::vector<uint32_t> keys(BENCH_ALGO_SORT_SIZE);
+		uint64_t x = 1;
+		for (uint32_t &k : keys) {
+			x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+			k = x >> 32;
+		}
+		bench_start(&b, name, thread_count);
+		if (is_serial) {
+			std::sort(keys.begin(), keys.end());
+		} else {
+			bench_check(tpool_parallel_sort(pool, keys.begin(),
+				keys.end(), BENCH_ALGO_GRAIN * 4) == 0);
+		}
+		b.ops = keys.size();
+		bench_finish(&b);
+		bench_check(std::is_sorted(keys.begin(), keys.end()));
+	}
+
+	if (pool != NULL)
+		bench_check(thread_pool_delete(pool) == 0);
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc > 1)
+		bench_filter = argv[1];
+	printf("{\"cpus\": %ld, \"benchmarks\": [",
+	       sysconf(_SC_NPROCESSORS_ONLN));
+
+	int thread_counts[] = {1, 2, 4, 8, 12, 16, TPOOL_MAX_THREADS};
+	int count = sizeof(thread_counts) / sizeof(thread_counts[0]);
+	for (int i = 0; i < count; ++i)
+		bench_spawn(thread_counts[i], false, false);
+	for (int i = 0; i < count; ++i)
+		bench_spawn(thread_counts[i], true, false);
+	for (int i = 0; i < count; ++i)
+		bench_spawn(thread_counts[i], true, true);
+	for (int i = 0; i < count; ++i)
+		bench_external(thread_counts[i]);
+	for (int i = 0; i < count; ++i)
+		bench_push_join(thread_counts[i], 0);
+	for (int i = 0; i < count; ++i)
+		bench_push_join(thread_counts[i], BENCH_SPIN_COUNT);
+	for (int i = 0; i < count; ++i) {
+		bench_submit(thread_counts[i], false);
+		bench_submit(thread_counts[i], true);
+	}
+	for (int i = 0; i < count; ++i) {
+		bench_burst(thread_counts[i], false);
+		bench_burst(thread_counts[i], true);
+	}
+	for (int i = 0; i < count; ++i) {
+		bench_interactive(thread_counts[i], false);
+		bench_interactive(thread_counts[i], true);
+	}
+	for (int i = 0; i < count; ++i) {
+		bench_chain(thread_counts[i], false);
+		bench_chain(thread_counts[i], true);
+	}
+	bench_algo(0);
+	for (int i = 0; i < count; ++i)
+		bench_algo(thread_counts[i]);
+
+	printf("\n]}\n");
+	return 0;
+}
@@ -1,6 +1,12 @@
 #include "thread_pool.h"
+#include "thread_future.h"
+#include "thread_parallel.h"
 #include "unit.h"
+#include <algorithm>
+#include <memory>
 #include <pthread.h>
+#include <sched.h>
+#include <string.h>
 #include <unistd.h>
 #include <stdint.h>
 
@@ -341,6 +347,908 @@ test_detach_long(void)
 #endif
 }
 
+static void
+test_push_from_task(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	const int count = 1000;
+	struct thread_task **tasks = new thread_task*[count];
+	int arg = 0;
+	int rc = 0;
+	struct thread_task *root;
+	/*
+	 * The tasks pushed by a task go to its worker. The root blocks the
+	 * worker, so the other ones have to steal them.
+	 */
+	unit_fail_if(thread_task_new(&root, [&]() {
+		for (int i = 0; i < count; ++i) {
+			thread_task_new(&tasks[i], task_make_inc(&arg));
+			rc |= thread_pool_push_task(p, tasks[i]);
+		}
+		while (__atomic_load_n(&arg, __ATOMIC_RELAXED) != count)
+			usleep(100);
+	}) != 0);
+	unit_fail_if(thread_pool_push_task(p, root) != 0);
+	unit_fail_if(thread_task_join(root) != 0);
+	unit_check(rc == 0 && __atomic_load_n(&arg, __ATOMIC_RELAXED) == count,
+		   "tasks pushed from a task are stolen");
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_join(tasks[i]) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	unit_fail_if(thread_task_delete(root) != 0);
+	delete[] tasks;
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void *
+test_join_concurrent_f(void *arg)
+{
+	struct thread_task *task = (struct thread_task *)arg;
+	return (void *)(intptr_t)thread_task_join(task);
+}
+
+static void
+test_join_concurrent(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_task *task;
+	int arg = 0;
+	unit_fail_if(thread_pool_new(2, &p) != 0);
+	unit_fail_if(thread_task_new(&task, task_make_wait_for(&arg)) != 0);
+	unit_fail_if(thread_pool_push_task(p, task) != 0);
+	/* All of them sleep on the task until it is finished. */
+	const int count = 4;
+	pthread_t threads[count];
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(pthread_create(&threads[i], NULL,
+					    test_join_concurrent_f, task) != 0);
+	}
+	usleep(10000);
+	unit_check(!thread_task_is_finished(task), "not finished yet");
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	intptr_t rc = 0;
+	for (int i = 0; i < count; ++i) {
+		void *res;
+		unit_fail_if(pthread_join(threads[i], &res) != 0);
+		rc |= (intptr_t)res;
+	}
+	unit_check(rc == 0, "all the joiners are woken up");
+	unit_check(thread_task_is_finished(task), "finished");
+	unit_fail_if(thread_task_delete(task) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_idle_strategy(void)
+{
+	unit_test_start();
+
+	struct thread_pool_options opts;
+	thread_pool_options_create(&opts);
+	struct thread_pool *p;
+	opts.spin_count = -1;
+	unit_check(thread_pool_new_ex(&opts, &p) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "negative spin count");
+	opts.thread_count = 2;
+	opts.spin_count = 1000;
+	opts.yield_count = 10;
+	unit_fail_if(thread_pool_new_ex(&opts, &p) != 0);
+
+	struct thread_task *task;
+	int arg = 0;
+	unit_fail_if(thread_task_new(&task, task_make_inc(&arg)) != 0);
+	unit_fail_if(thread_pool_push_task(p, task) != 0);
+	unit_fail_if(thread_task_join(task) != 0);
+	/* Let the worker run out of polling and park. */
+	struct thread_pool_stats stats;
+	do {
+		usleep(1000);
+		unit_fail_if(thread_pool_get_stats(p, &stats) != 0);
+	} while (stats.parks == 0);
+	unit_check(stats.spins >= 1000 && stats.yields >= 10,
+		   "polled before parking");
+
+	unit_fail_if(thread_pool_push_task(p, task) != 0);
+	unit_fail_if(thread_task_join(task) != 0);
+	unit_fail_if(thread_pool_get_stats(p, &stats) != 0);
+	unit_check(stats.wakeups >= 1, "parked worker is woken up");
+	unit_check(arg == 2, "tasks are done");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	/*
+	 * A polling worker saves a wakeup to each push while it polls,
+	 * but takes only one task. The next one must not be left behind
+	 * with the other worker parked, when the first waits for it.
+	 */
+	opts.spin_count = 0;
+	opts.yield_count = 20000;
+	unit_fail_if(thread_pool_new_ex(&opts, &p) != 0);
+	int stuck = 0;
+	for (int round = 0; round < 20; ++round) {
+		/* Both park, then one is woken up and polls. */
+		usleep(50000);
+		unit_fail_if(thread_pool_push_task(p, task) != 0);
+		unit_fail_if(thread_task_join(task) != 0);
+		int is_set = 0;
+		bool is_stuck = false;
+		struct thread_task *waiter, *setter;
+		unit_fail_if(thread_task_new(&waiter, [&is_set, &is_stuck]() {
+			for (int i = 0; i < 2000; ++i) {
+				if (__atomic_load_n(&is_set, __ATOMIC_ACQUIRE))
+					return;
+				usleep(100);
+			}
+			is_stuck = true;
+		}) != 0);
+		unit_fail_if(thread_task_new(&setter, [&is_set]() {
+			__atomic_store_n(&is_set, 1, __ATOMIC_RELEASE);
+		}) != 0);
+		unit_fail_if(thread_pool_push_task(p, waiter) != 0);
+		unit_fail_if(thread_pool_push_task(p, setter) != 0);
+		unit_fail_if(thread_task_join(waiter) != 0);
+		unit_fail_if(thread_task_join(setter) != 0);
+		unit_fail_if(thread_task_delete(waiter) != 0);
+		unit_fail_if(thread_task_delete(setter) != 0);
+		stuck += is_stuck;
+	}
+	unit_check(stuck == 0, "a task waiting for the next one is not stuck");
+	unit_fail_if(thread_task_delete(task) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_elastic(void)
+{
+	unit_test_start();
+
+	struct thread_pool_options opts;
+	thread_pool_options_create(&opts);
+	struct thread_pool *p;
+	opts.thread_count = 2;
+	opts.min_threads = 3;
+	unit_check(thread_pool_new_ex(&opts, &p) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "min threads above max");
+	opts.min_threads = 0;
+	opts.idle_timeout = -1;
+	unit_check(thread_pool_new_ex(&opts, &p) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "negative idle timeout");
+	opts.idle_timeout = 0;
+	opts.thread_count = TPOOL_THREADS_LIMIT + 1;
+	unit_check(thread_pool_new_ex(&opts, &p) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "too many threads");
+	opts.thread_count = TPOOL_MAX_THREADS * 2;
+	unit_check(thread_pool_new_ex(&opts, &p) == 0,
+		   "more than TPOOL_MAX_THREADS with options");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	/* Grow to max by the blocked tasks, then shrink to min. */
+	const int max = 4;
+	opts.thread_count = max;
+	opts.min_threads = 2;
+	opts.idle_timeout = 0.02;
+	unit_fail_if(thread_pool_new_ex(&opts, &p) != 0);
+	struct thread_pool_stats stats;
+	unit_fail_if(thread_pool_get_stats(p, &stats) != 0);
+	unit_check(stats.threads == 2, "min threads are started");
+	int arg = 0;
+	struct thread_task *tasks[max];
+	for (int round = 0; round < 2; ++round) {
+		arg = 0;
+		for (int i = 0; i < max; ++i) {
+			unit_fail_if(thread_task_new(&tasks[i],
+						     task_make_wait_for(&arg)) != 0);
+			unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+			while (!thread_task_is_running(tasks[i]))
+				usleep(100);
+		}
+		unit_fail_if(thread_pool_get_stats(p, &stats) != 0);
+		unit_check(stats.threads == max, "grown to max");
+		__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+		for (int i = 0; i < max; ++i) {
+			unit_fail_if(thread_task_join(tasks[i]) != 0);
+			unit_fail_if(thread_task_delete(tasks[i]) != 0);
+		}
+		do {
+			usleep(1000);
+			unit_fail_if(thread_pool_get_stats(p, &stats) != 0);
+		} while (stats.threads > 2);
+		unit_check(stats.threads == 2 && stats.thread_retires ==
+			   stats.thread_starts - 2, "idle threads retired");
+	}
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	/* A task stuck behind a long one gets a thread after a delay. */
+	thread_pool_options_create(&opts);
+	opts.thread_count = 2;
+	opts.min_threads = 1;
+	opts.grow_delay = 0.01;
+	unit_fail_if(thread_pool_new_ex(&opts, &p) != 0);
+	arg = 0;
+	struct thread_task *release;
+	unit_fail_if(thread_task_new(&tasks[0], task_make_wait_for(&arg)) != 0);
+	unit_fail_if(thread_task_new(&release, task_make_inc(&arg)) != 0);
+	unit_fail_if(thread_pool_push_task(p, tasks[0]) != 0);
+	while (!thread_task_is_running(tasks[0]))
+		usleep(100);
+	unit_fail_if(thread_pool_push_task(p, release) != 0);
+	unit_fail_if(thread_task_join(release) != 0);
+	unit_fail_if(thread_task_join(tasks[0]) != 0);
+	unit_fail_if(thread_pool_get_stats(p, &stats) != 0);
+	unit_check(stats.thread_starts == 2, "started for the waiting task");
+	unit_fail_if(thread_task_delete(release) != 0);
+	unit_fail_if(thread_task_delete(tasks[0]) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	/* Grow only with 2 queued tasks per thread. */
+	thread_pool_options_create(&opts);
+	opts.thread_count = 4;
+	opts.min_threads = 1;
+	opts.grow_backlog = 2;
+	unit_fail_if(thread_pool_new_ex(&opts, &p) != 0);
+	arg = 0;
+	for (int i = 0; i < 3; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i],
+					     task_make_wait_for(&arg)) != 0);
+	}
+	unit_fail_if(thread_pool_push_task(p, tasks[0]) != 0);
+	while (!thread_task_is_running(tasks[0]))
+		usleep(100);
+	unit_fail_if(thread_pool_push_task(p, tasks[1]) != 0);
+	unit_fail_if(thread_pool_get_stats(p, &stats) != 0);
+	unit_check(stats.thread_starts == 1, "small backlog is fine");
+	unit_fail_if(thread_pool_push_task(p, tasks[2]) != 0);
+	unit_fail_if(thread_pool_get_stats(p, &stats) != 0);
+	unit_check(stats.thread_starts == 2, "big backlog starts a thread");
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < 3; ++i) {
+		unit_fail_if(thread_task_join(tasks[i]) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_priority(void)
+{
+	unit_test_start();
+
+	struct thread_pool_options opts;
+	thread_pool_options_create(&opts);
+	opts.track_wait = true;
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new_ex(&opts, &p) != 0);
+	int gate = 0;
+	struct thread_task *blocker;
+	unit_fail_if(thread_task_new(&blocker, task_make_wait_for(&gate)) != 0);
+	unit_check(thread_task_set_priority(blocker, TPOOL_PRIORITY_COUNT) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "bad priority");
+	unit_check(thread_task_set_deadline(blocker, -1, TPOOL_DEADLINE_FLAG) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "negative deadline");
+	unit_fail_if(thread_pool_push_task(p, blocker) != 0);
+	unit_check(thread_task_set_priority(blocker, TPOOL_PRIORITY_HIGH) ==
+		   TPOOL_ERR_TASK_IN_POOL, "priority of a pushed task");
+	while (!thread_task_is_running(blocker))
+		usleep(100);
+
+	/*
+	 * The only worker is blocked, so the queued ones run in the
+	 * priority order, and by the deadline within a class.
+	 */
+	int order[8];
+	int pos = 0;
+	struct thread_task *tasks[8];
+	const enum thread_task_priority prio[8] = {
+		TPOOL_PRIORITY_LOW, TPOOL_PRIORITY_NORMAL, TPOOL_PRIORITY_HIGH,
+		TPOOL_PRIORITY_HIGH, TPOOL_PRIORITY_HIGH, TPOOL_PRIORITY_LOW,
+		TPOOL_PRIORITY_NORMAL, TPOOL_PRIORITY_HIGH,
+	};
+	const double timeout[8] = {0, 0, 30, 0, 10, 0, 60, 20};
+	const int expected[8] = {4, 7, 2, 3, 6, 1, 0, 5};
+	for (int i = 0; i < 8; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], [&order, &pos, i]() {
+			order[__atomic_fetch_add(&pos, 1,
+						 __ATOMIC_RELAXED)] = i;
+		}) != 0);
+		unit_fail_if(thread_task_set_priority(tasks[i], prio[i]) != 0);
+		unit_fail_if(thread_task_set_deadline(tasks[i], timeout[i],
+						      TPOOL_DEADLINE_FLAG) != 0);
+	}
+	unit_fail_if(thread_pool_push_tasks(p, tasks, 8) != 0);
+	__atomic_store_n(&gate, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < 8; ++i)
+		unit_fail_if(thread_task_join(tasks[i]) != 0);
+	unit_fail_if(thread_task_join(blocker) != 0);
+	unit_check(memcmp(order, expected, sizeof(order)) == 0,
+		   "priority classes, then deadlines, then FIFO");
+	bool is_late = false;
+	for (int i = 0; i < 8; ++i)
+		is_late = is_late || thread_task_is_late(tasks[i]);
+	unit_check(!is_late, "not late");
+
+	/* Missed deadlines: one is still run, one is dropped. */
+	gate = 0;
+	int arg = 0;
+	unit_fail_if(thread_pool_push_task(p, blocker) != 0);
+	while (!thread_task_is_running(blocker))
+		usleep(100);
+	unit_fail_if(thread_task_set_deadline(tasks[0], 0.001,
+					      TPOOL_DEADLINE_FLAG) != 0);
+	unit_fail_if(thread_task_set_deadline(tasks[1], 0.001,
+					      TPOOL_DEADLINE_DROP) != 0);
+	struct thread_task *late[2];
+	unit_fail_if(thread_task_new(&late[0], task_make_inc(&arg)) != 0);
+	unit_fail_if(thread_task_new(&late[1], task_make_inc(&arg)) != 0);
+	unit_fail_if(thread_task_set_deadline(late[0], 0.001,
+					      TPOOL_DEADLINE_FLAG) != 0);
+	unit_fail_if(thread_task_set_deadline(late[1], 0.001,
+					      TPOOL_DEADLINE_DROP) != 0);
+	unit_fail_if(thread_pool_push_tasks(p, late, 2) != 0);
+	usleep(10000);
+	__atomic_store_n(&gate, 1, __ATOMIC_RELAXED);
+	unit_fail_if(thread_task_join(late[0]) != 0);
+	unit_fail_if(thread_task_join(late[1]) != 0);
+	unit_fail_if(thread_task_join(blocker) != 0);
+	unit_check(thread_task_is_late(late[0]) && thread_task_is_late(late[1]),
+		   "late tasks are flagged");
+	unit_check(arg == 1, "late task is dropped");
+
+	struct thread_pool_wait_stats stats;
+	unit_check(thread_pool_get_wait_stats(p, TPOOL_PRIORITY_COUNT,
+					      &stats) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "bad priority of stats");
+	unit_fail_if(thread_pool_get_wait_stats(p, TPOOL_PRIORITY_NORMAL,
+						&stats) != 0);
+	unit_check(stats.late == 2 && stats.dropped == 1, "late stats");
+	unit_check(stats.count == 6, "all the normal tasks are counted");
+	unit_check(stats.max_ns >= 10000000, "max wait");
+	unit_check(thread_pool_wait_stats_quantile(&stats, 1) >= stats.max_ns &&
+		   thread_pool_wait_stats_quantile(&stats, 0.5) <=
+		   thread_pool_wait_stats_quantile(&stats, 1), "quantiles");
+	unit_fail_if(thread_pool_get_wait_stats(p, TPOOL_PRIORITY_HIGH,
+						&stats) != 0);
+	unit_check(stats.count == 4 && stats.late == 0, "high class stats");
+
+	for (int i = 0; i < 8; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	unit_fail_if(thread_task_delete(late[0]) != 0);
+	unit_fail_if(thread_task_delete(late[1]) != 0);
+	unit_fail_if(thread_task_delete(blocker) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_affinity(void)
+{
+	unit_test_start();
+
+	cpu_set_t allowed;
+	unit_fail_if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0);
+	int cpu = 0;
+	while (!CPU_ISSET(cpu, &allowed))
+		++cpu;
+
+	struct thread_pool_options opts;
+	thread_pool_options_create(&opts);
+	struct thread_pool *p;
+	int bad[] = {-1, CPU_SETSIZE};
+	opts.cpu_count = 1;
+	for (int i = 0; i < 2; ++i) {
+		opts.cpus = &bad[i];
+		unit_check(thread_pool_new_ex(&opts, &p) ==
+			   TPOOL_ERR_INVALID_ARGUMENT, "bad cpu is forbidden");
+	}
+	opts.cpus = &cpu;
+	opts.cpu_count = 0;
+	unit_check(thread_pool_new_ex(&opts, &p) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "empty cpu list is forbidden");
+
+	/* Every worker is pinned to the only given CPU. */
+	opts.cpu_count = 1;
+	opts.thread_count = 3;
+	opts.pin_per_cpu = true;
+	unit_fail_if(thread_pool_new_ex(&opts, &p) != 0);
+	bool is_pinned[3] = {false, false, false};
+	struct thread_task *tasks[3];
+	for (int i = 0; i < 3; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], [&is_pinned, cpu, i]() {
+			cpu_set_t set;
+			if (sched_getaffinity(0, sizeof(set), &set) != 0)
+				return;
+			is_pinned[i] = CPU_COUNT(&set) == 1 &&
+				       CPU_ISSET(cpu, &set) &&
+				       sched_getcpu() == cpu;
+		}) != 0);
+	}
+	unit_fail_if(thread_pool_push_tasks(p, tasks, 3) != 0);
+	for (int i = 0; i < 3; ++i) {
+		unit_fail_if(thread_task_join(tasks[i]) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	unit_check(is_pinned[0] && is_pinned[1] && is_pinned[2],
+		   "workers are pinned");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	/* Node-local queues and task memory. */
+	thread_pool_options_create(&opts);
+	opts.thread_count = 4;
+	opts.numa_aware = true;
+	unit_fail_if(thread_pool_new_ex(&opts, &p) != 0);
+	const int count = 1000;
+	int arg = 0;
+	struct thread_task *root;
+	unit_fail_if(thread_pool_task_new(p, &root, [&]() {
+		for (int i = 0; i < count; ++i) {
+			struct thread_task *child;
+			thread_pool_task_new(p, &child, task_make_inc(&arg));
+			thread_pool_push_task(p, child);
+			thread_task_detach(child);
+		}
+	}) != 0);
+	unit_fail_if(thread_pool_push_task(p, root) != 0);
+	unit_fail_if(thread_task_join(root) != 0);
+	unit_fail_if(thread_task_delete(root) != 0);
+	while (thread_pool_delete(p) != 0)
+		usleep(100);
+	unit_check(__atomic_load_n(&arg, __ATOMIC_RELAXED) == count,
+		   "tasks are done on the numa pool");
+
+	unit_test_finish();
+}
+
+static void
+test_stats(void)
+{
+	unit_test_start();
+
+	struct thread_pool_options opts;
+	thread_pool_options_create(&opts);
+	opts.thread_count = 2;
+	opts.min_threads = 2;
+	opts.track_wait = true;
+	opts.track_run = true;
+	opts.trace_size = 4;
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new_ex(&opts, &p) != 0);
+
+	/* The parent waits for its child, so the other worker steals it. */
+	int is_done = 0;
+	struct thread_task *parent;
+	unit_fail_if(thread_task_new(&parent, [p, &is_done]() {
+		struct thread_task *child;
+		thread_task_new(&child, [&is_done]() {
+			__atomic_store_n(&is_done, 1, __ATOMIC_RELEASE);
+		});
+		thread_pool_push_task(p, child);
+		thread_task_detach(child);
+		while (__atomic_load_n(&is_done, __ATOMIC_ACQUIRE) == 0)
+			usleep(100);
+	}) != 0);
+	unit_fail_if(thread_pool_push_task(p, parent) != 0);
+	unit_fail_if(thread_task_join(parent) != 0);
+	unit_fail_if(thread_task_delete(parent) != 0);
+
+	const int count = 10;
+	struct thread_task *tasks[count];
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], []() {
+			usleep(1000);
+		}) != 0);
+	}
+	unit_fail_if(thread_pool_push_tasks(p, tasks, count) != 0);
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_join(tasks[i]) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	/* The detached child might be not deleted yet. */
+	struct thread_pool_stats stats;
+	do {
+		usleep(100);
+		unit_fail_if(thread_pool_get_stats(p, &stats) != 0);
+	} while (stats.pending != 0);
+	unit_check(stats.pushed == count + 2 && stats.completed == count + 2,
+		   "pushed and completed");
+	unit_check(stats.detached == 1, "detached");
+	unit_check(stats.queued == 0 && stats.pending_max >= count,
+		   "queue depth");
+	unit_check(stats.steals >= 1, "steals");
+	unit_check(stats.run.count == count + 2 &&
+		   stats.wait.count == count + 2, "run and wait times");
+	unit_check(stats.busy_ns >= count * 1000000ull &&
+		   stats.run.max_ns >= 1000000 &&
+		   thread_pool_wait_stats_quantile(&stats.run, 0.5) >= 1000000,
+		   "busy time");
+
+	FILE *f = tmpfile();
+	unit_fail_if(f == NULL);
+	unit_check(thread_pool_write_trace(p, NULL) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "trace into NULL");
+	unit_fail_if(thread_pool_write_trace(p, f) != 0);
+	rewind(f);
+	char buf[4096];
+	size_t size = fread(buf, 1, sizeof(buf) - 1, f);
+	buf[size] = 0;
+	fclose(f);
+	int events = 0;
+	for (const char *pos = buf; (pos = strstr(pos, "\"ph\":\"X\"")) != NULL;
+	     ++pos)
+		++events;
+	unit_check(strncmp(buf, "{\"displayTimeUnit\"", 18) == 0 &&
+		   strstr(buf, "\"worker 1\"") != NULL, "trace is written");
+	unit_check(events > 0 && events <= 2 * opts.trace_size,
+		   "trace keeps the last tasks");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	unit_check(thread_pool_write_trace(p, stdout) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "no trace");
+	unit_fail_if(thread_pool_get_stats(p, &stats) != 0);
+	unit_check(stats.pushed == 0 && stats.run.count == 0, "no tasks");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_push_tasks(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	const int count = 1000;
+	struct thread_task **tasks = new thread_task*[count];
+	int arg = 0;
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_new(&tasks[i], task_make_inc(&arg)) != 0);
+	unit_check(thread_pool_push_tasks(p, tasks, -1) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "negative count");
+	unit_check(thread_pool_push_tasks(p, tasks, 0) == 0, "empty batch");
+
+	unit_fail_if(thread_pool_push_tasks(p, tasks, count) != 0);
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_join(tasks[i]) != 0);
+	unit_check(arg == count, "all the batch is done");
+
+	/* A batch from a task goes to its worker. */
+	struct thread_task *root;
+	int rc = -1;
+	unit_fail_if(thread_task_new(&root, [&]() {
+		rc = thread_pool_push_tasks(p, tasks, count);
+	}) != 0);
+	unit_fail_if(thread_pool_push_task(p, root) != 0);
+	unit_fail_if(thread_task_join(root) != 0);
+	unit_check(rc == 0, "pushed from a task");
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_join(tasks[i]) != 0);
+	unit_check(arg == 2 * count, "all the batch is done");
+
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	unit_fail_if(thread_task_delete(root) != 0);
+	delete[] tasks;
+
+	/* A batch not fitting into the pool is not pushed at all. */
+	int big_count = TPOOL_MAX_TASKS + 1;
+	tasks = new thread_task*[big_count];
+	for (int i = 0; i < big_count; ++i)
+		unit_fail_if(thread_task_new(&tasks[i], task_make_inc(&arg)) != 0);
+	unit_check(thread_pool_push_tasks(p, tasks, big_count) ==
+		   TPOOL_ERR_TOO_MANY_TASKS, "too many tasks");
+	bool is_pushed = false;
+	for (int i = 0; i < big_count; ++i)
+		is_pushed |= thread_task_delete(tasks[i]) != 0;
+	unit_check(!is_pushed, "none is pushed");
+	delete[] tasks;
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_task_function(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(2, &p) != 0);
+	/* Too big to be inline. */
+	char big[200];
+	memset(big, 1, sizeof(big));
+	int sum = 0;
+	struct thread_task *t1;
+	unit_fail_if(thread_task_new(&t1, [big, &sum]() {
+		for (size_t i = 0; i < sizeof(big); ++i)
+			sum += big[i];
+	}) != 0);
+	/* Move-only. */
+	std::unique_ptr<int> ptr(new int(5));
+	int value = 0;
+	struct thread_task *t2;
+	unit_fail_if(thread_task_new(&t2, [ptr = std::move(ptr), &value]() {
+		value = *ptr;
+	}) != 0);
+	unit_fail_if(thread_pool_push_task(p, t1) != 0);
+	unit_fail_if(thread_pool_push_task(p, t2) != 0);
+	unit_fail_if(thread_task_join(t1) != 0);
+	unit_fail_if(thread_task_join(t2) != 0);
+	unit_check(sum == (int)sizeof(big), "heap function");
+	unit_check(value == 5, "move-only function");
+	unit_fail_if(thread_task_delete(t1) != 0);
+	unit_fail_if(thread_task_delete(t2) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_pool_task_new(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(3, &p) != 0);
+	struct thread_task *t;
+	int arg = 0;
+	unit_fail_if(thread_pool_task_new(p, &t, task_make_inc(&arg)) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_fail_if(thread_task_join(t) != 0);
+	unit_check(thread_pool_delete(p) == TPOOL_ERR_HAS_TASKS,
+		   "can't delete the pool with its task");
+	unit_fail_if(thread_task_delete(t) != 0);
+	struct thread_task *t2;
+	unit_fail_if(thread_pool_task_new(p, &t2, task_make_inc(&arg)) != 0);
+	unit_check(t2 == t, "memory is reused");
+	unit_fail_if(thread_task_delete(t2) != 0);
+
+	/* Spawned and auto-deleted in the workers. */
+	const int count = 1000;
+	struct thread_task *root;
+	unit_fail_if(thread_task_new(&root, [&]() {
+		for (int i = 0; i < count; ++i) {
+			struct thread_task *child;
+			thread_pool_task_new(p, &child, task_make_inc(&arg));
+			thread_pool_push_task(p, child);
+			thread_task_detach(child);
+		}
+	}) != 0);
+	unit_fail_if(thread_pool_push_task(p, root) != 0);
+	unit_fail_if(thread_task_join(root) != 0);
+	unit_fail_if(thread_task_delete(root) != 0);
+	while (thread_pool_delete(p) != 0)
+		usleep(100);
+	unit_check(__atomic_load_n(&arg, __ATOMIC_RELAXED) == count + 1,
+		   "detached tasks are done");
+
+	unit_test_finish();
+}
+
+static void
+test_push_after(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(3, &p) != 0);
+	/*
+	 * A diamond: a -> b, c -> d. The order is recorded by the tasks,
+	 * and a blocks until released, so the others surely wait.
+	 */
+	int gate = 0;
+	int order[4];
+	int pos = 0;
+	auto record = [&](int id) {
+		order[__atomic_fetch_add(&pos, 1, __ATOMIC_RELAXED)] = id;
+	};
+	struct thread_task *a, *b, *c, *d, *free_task;
+	unit_fail_if(thread_task_new(&a, [&]() {
+		while (__atomic_load_n(&gate, __ATOMIC_RELAXED) == 0)
+			usleep(100);
+		record(0);
+	}) != 0);
+	unit_fail_if(thread_task_new(&b, [&]() { record(1); }) != 0);
+	unit_fail_if(thread_task_new(&c, [&]() { record(1); }) != 0);
+	unit_fail_if(thread_task_new(&d, [&]() { record(2); }) != 0);
+	unit_fail_if(thread_task_new(&free_task, [&]() {}) != 0);
+	struct thread_task *deps_d[] = {b, c};
+	unit_check(thread_pool_push_after(p, d, deps_d, 2) ==
+		   TPOOL_ERR_TASK_NOT_PUSHED, "deps must be pushed");
+	unit_fail_if(thread_pool_push_task(p, a) != 0);
+	unit_fail_if(thread_pool_push_after(p, b, &a, 1) != 0);
+	unit_fail_if(thread_pool_push_after(p, c, &a, 1) != 0);
+	unit_fail_if(thread_pool_push_after(p, d, deps_d, 2) != 0);
+	unit_fail_if(thread_pool_push_after(p, free_task, NULL, 0) != 0);
+	unit_fail_if(thread_task_join(free_task) != 0);
+	usleep(10000);
+	unit_check(__atomic_load_n(&pos, __ATOMIC_RELAXED) == 0 &&
+		   !thread_task_is_running(d), "tasks wait");
+	__atomic_store_n(&gate, 1, __ATOMIC_RELAXED);
+	unit_fail_if(thread_task_join(d) != 0);
+	unit_check(__atomic_load_n(&pos, __ATOMIC_RELAXED) == 4 &&
+		   order[0] == 0 && order[1] == 1 &&
+		   order[2] == 1 && order[3] == 2, "the order is kept");
+
+	/* Finished and joined dependencies are satisfied. */
+	unit_fail_if(thread_task_join(a) != 0);
+	unit_fail_if(thread_pool_push_after(p, free_task, &a, 1) != 0);
+	unit_fail_if(thread_task_join(free_task) != 0);
+
+	/* Any of them. */
+	__atomic_store_n(&gate, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&pos, 0, __ATOMIC_RELAXED);
+	unit_fail_if(thread_task_join(b) != 0);
+	unit_fail_if(thread_task_join(c) != 0);
+	unit_fail_if(thread_pool_push_task(p, a) != 0);
+	unit_fail_if(thread_pool_push_task(p, b) != 0);
+	struct thread_task *deps_any[] = {a, b};
+	unit_fail_if(thread_pool_push_after_any(p, d, deps_any, 2) != 0);
+	unit_fail_if(thread_task_join(d) != 0);
+	unit_check(order[0] == 1 && order[1] == 2, "run after any");
+	__atomic_store_n(&gate, 1, __ATOMIC_RELAXED);
+
+	struct thread_task *tasks[] = {a, b, c, d, free_task};
+	for (struct thread_task *t : tasks) {
+		unit_fail_if(thread_task_join(t) != 0);
+		unit_fail_if(thread_task_delete(t) != 0);
+	}
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_future(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	/* Outlives the futures, their tasks can still run after them. */
+	int gate = 0;
+	{
+		thread_future<int> f = thread_async(p, []() { return 20; });
+		thread_future<int> g = f.then([](int v) { return v + 1; })
+					.then([](int v) { return v * 2; });
+		unit_check(g.get() == 42, "then chain");
+		unit_check(f.is_ready() && f.get() == 20, "source is ready");
+
+		std::vector<thread_future<int>> parts;
+		for (int i = 0; i < 10; ++i)
+			parts.push_back(thread_async(p, [i]() { return i; }));
+		thread_future<int> sum = when_all(parts).then(
+			[](const std::vector<int> &values) {
+				int s = 0;
+				for (int v : values)
+					s += v;
+				return s;
+			});
+		unit_check(sum.get() == 45, "when_all");
+
+		std::vector<thread_future<int>> racers;
+		racers.push_back(thread_async(p, [&gate]() {
+			while (__atomic_load_n(&gate, __ATOMIC_RELAXED) == 0)
+				usleep(100);
+			return 1;
+		}));
+		racers.push_back(thread_async(p, []() { return 2; }));
+		thread_future<size_t> first = when_any(racers);
+		unit_check(first.get() == 1, "when_any");
+		__atomic_store_n(&gate, 1, __ATOMIC_RELAXED);
+
+		/* Dropped unfinished, the tasks are detached. */
+		thread_async(p, []() { usleep(10000); return 0; })
+			.then([](int v) { return v; });
+	}
+	while (thread_pool_delete(p) != 0)
+		usleep(100);
+
+	unit_test_finish();
+}
+
+static void
+test_parallel(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	const size_t count = 100000;
+	std::vector<int64_t> values(count);
+	unit_fail_if(tpool_parallel_for(p, 0, count, 1000, [&](size_t i) {
+		values[i] = i;
+	}) != 0);
+	bool is_ok = true;
+	for (size_t i = 0; i < count; ++i)
+		is_ok = is_ok && values[i] == (int64_t)i;
+	unit_check(is_ok, "parallel_for");
+
+	int64_t sum = 0;
+	unit_fail_if(tpool_parallel_reduce(p, 0, count, 1000, (int64_t)0,
+		[&](size_t i) { return values[i]; },
+		[](int64_t a, int64_t b) { return a + b; }, &sum) != 0);
+	unit_check(sum == (int64_t)(count * (count - 1) / 2),
+		   "parallel_reduce");
+
+	std::vector<int64_t> scanned(count);
+	unit_fail_if(tpool_parallel_scan(p, values.data(), scanned.data(),
+		count, 777, (int64_t)0,
+		[](int64_t a, int64_t b) { return a + b; }) != 0);
+	is_ok = true;
+	int64_t acc = 0;
+	for (size_t i = 0; i < count; ++i) {
+		acc += values[i];
+		is_ok = is_ok && scanned[i] == acc;
+	}
+	unit_check(is_ok, "parallel_scan");
+
+	std::vector<int> keys(count);
+	for (size_t i = 0; i < count; ++i)
+		keys[i] = rand() % 1000;
+	std::vector<int> expected = keys;
+	std::sort(expected.begin(), expected.end());
+	unit_fail_if(tpool_parallel_sort(p, keys.begin(), keys.end(),
+					 1000) != 0);
+	unit_check(keys == expected, "parallel_sort");
+	unit_fail_if(tpool_parallel_sort(p, keys.begin(), keys.end(), 333,
+					 std::greater<int>()) != 0);
+	std::reverse(expected.begin(), expected.end());
+	unit_check(keys == expected, "parallel_sort with a comparator");
+
+	/*
+	 * The range tasks are freed on the way, so a fine grain doesn't
+	 * fill the pool up for the other pushers.
+	 */
+	const size_t fine_count = 3 * TPOOL_MAX_TASKS;
+	struct thread_task *other;
+	unit_fail_if(thread_task_new(&other, []() {}) != 0);
+	int push_rc = -1;
+	unit_fail_if(tpool_parallel_for(p, 0, fine_count, 1, [&](size_t i) {
+		if (i == fine_count / 2)
+			push_rc = thread_pool_push_task(p, other);
+	}) != 0);
+	unit_check(push_rc == 0, "push during a fine-grained parallel_for");
+	unit_fail_if(thread_task_join(other) != 0);
+	unit_fail_if(thread_task_delete(other) != 0);
+	struct thread_pool_stats stats;
+	unit_fail_if(thread_pool_get_stats(p, &stats) != 0);
+	unit_check(stats.pending_max < TPOOL_MAX_TASKS,
+		   "finished range tasks are not held");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	/* Nested in a task of a pool with a single thread. */
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	struct thread_task *t;
+	int64_t nested_sum = 0;
+	unit_fail_if(thread_task_new(&t, [&]() {
+		tpool_parallel_reduce(p, 0, count, 100, (int64_t)0,
+			[&](size_t i) { return values[i]; },
+			[](int64_t a, int64_t b) { return a + b; },
+			&nested_sum);
+	}) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_fail_if(thread_task_join(t) != 0);
+	unit_check(nested_sum == sum, "nested in a task");
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
 int
 main(int argc, char **argv)
 {
@@ -364,6 +1272,19 @@ main(int argc, char **argv)
 	test_timed_join();
 	test_detach_stress();
 	test_detach_long();
+	test_push_from_task();
+	test_join_concurrent();
+	test_idle_strategy();
+	test_elastic();
+	test_priority();
+	test_affinity();
+	test_stats();
+	test_push_tasks();
+	test_task_function();
+	test_pool_task_new();
+	test_push_after();
+	test_future();
+	test_parallel();
 
 	unit_test_finish();
 	return 0;
@@ -0,0 +1,241 @@
+#pragma once
+
+#include "thread_pool.h"
+
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <vector>
+
+/**
+ * Typed futures on top of the thread pool tasks. A future is the result
+ * of a task pushed with thread_async(). Continuations attached with
+ * then(), when_all() and when_any() are pushed with
+ * thread_pool_push_after(), so a chain of them runs without blocking
+ * any worker. Only get() blocks, and only the caller.
+ *
+ * A future is shared: copies refer to the same result. When the last
+ * copy is gone, the task is deleted, or detached if it isn't finished.
+ * The tasks are created with thread_pool_task_new(), so the pool can't
+ * be deleted while there are futures of it.
+ *
+ * If a task can't be pushed, the returned future is not valid(), and
+ * the ones depending on it are not valid either. The result type can't
+ * be void.
+ */
+
+template<typename T>
+class thread_future;
+
+namespace thread_future_detail {
+
+/** Result of a task. It is shared by the future and the functions. */
+template<typename T>
+struct cell {
+	std::optional<T> value;
+	/** Set after the value. */
+	std::atomic<bool> is_ready{false};
+
+	template<typename F, typename... Args>
+	void
+	fill(F &f, Args&&... args)
+	{
+		value.emplace(f(std::forward<Args>(args)...));
+		is_ready.store(true, std::memory_order_release);
+	}
+};
+
+/** The task owned by the futures. */
+struct owned_task {
+	struct thread_task *task = nullptr;
+
+	~owned_task()
+	{
+		if (task == nullptr)
+			return;
+		if (thread_task_is_finished(task))
+			thread_task_delete(task);
+		else
+			thread_task_detach(task);
+	}
+};
+
+template<typename T>
+struct state {
+	struct thread_pool *pool = nullptr;
+	std::shared_ptr<cell<T>> result;
+	owned_task owner;
+};
+
+template<typename F, typename... Args>
+using result_of = typename std::decay<
+	typename std::invoke_result<F, Args...>::type>::type;
+
+/**
+ * Create a task computing @a f into a new cell, and push it after the
+ * @a deps, all or any of them.
+ */
+template<typename R, typename F>
+thread_future<R>
+push(struct thread_pool *pool, F &&f, struct thread_task **deps,
+     int dep_count, bool is_any)
+{
+	auto st = std::make_shared<state<R>>();
+	st->pool = pool;
+	st->result = std::make_shared<cell<R>>();
+	struct thread_task *task;
+	if (thread_pool_task_new(pool, &task, [result = st->result,
+			f = std::forward<F>(f)]() mutable {
+		result->fill(f);
+	}) != 0)
+		return thread_future<R>();
+	int rc;
+	if (is_any)
+		rc = thread_pool_push_after_any(pool, task, deps, dep_count);
+	else
+		rc = thread_pool_push_after(pool, task, deps, dep_count);
+	if (rc != 0) {
+		thread_task_delete(task);
+		return thread_future<R>();
+	}
+	st->owner.task = task;
+	return thread_future<R>(std::move(st));
+}
+
+} /* namespace thread_future_detail */
+
+template<typename T>
+class thread_future {
+public:
+	thread_future() = default;
+
+	bool
+	valid() const
+	{
+		return st != nullptr;
+	}
+
+	/** Check if the result is computed. Never blocks. */
+	bool
+	is_ready() const
+	{
+		return st->result->is_ready.load(std::memory_order_acquire);
+	}
+
+	/** Wait for the result. */
+	const T &
+	get() const
+	{
+		thread_task_join(st->owner.task);
+		return *st->result->value;
+	}
+
+	/**
+	 * Run @a f(result) when the result is ready.
+	 * @retval Future of the f's result.
+	 */
+	template<typename F>
+	thread_future<thread_future_detail::result_of<F, const T &>>
+	then(F &&f) const
+	{
+		using R = thread_future_detail::result_of<F, const T &>;
+		if (!valid())
+			return thread_future<R>();
+		struct thread_task *dep = st->owner.task;
+		return thread_future_detail::push<R>(st->pool,
+			[input = st->result, f = std::forward<F>(f)]() mutable {
+				return f(*input->value);
+			}, &dep, 1, false);
+	}
+
+private:
+	template<typename U>
+	friend class thread_future;
+	template<typename R, typename F>
+	friend thread_future<R>
+	thread_future_detail::push(struct thread_pool *, F &&,
+				   struct thread_task **, int, bool);
+	template<typename F>
+	friend thread_future<thread_future_detail::result_of<F>>
+	thread_async(struct thread_pool *pool, F &&f);
+	template<typename U>
+	friend thread_future<std::vector<U>>
+	when_all(const std::vector<thread_future<U>> &futures);
+	template<typename U>
+	friend thread_future<size_t>
+	when_any(const std::vector<thread_future<U>> &futures);
+
+	explicit thread_future(
+		std::shared_ptr<thread_future_detail::state<T>> st)
+		: st(std::move(st)) {}
+
+	std::shared_ptr<thread_future_detail::state<T>> st;
+};
+
+/** Run @a f() in @a pool. */
+template<typename F>
+thread_future<thread_future_detail::result_of<F>>
+thread_async(struct thread_pool *pool, F &&f)
+{
+	using R = thread_future_detail::result_of<F>;
+	return thread_future_detail::push<R>(pool, std::forward<F>(f),
+					     nullptr, 0, false);
+}
+
+/**
+ * Collect the results of all the @a futures, in their order. They must
+ * be of the same pool and not empty.
+ */
+template<typename T>
+thread_future<std::vector<T>>
+when_all(const std::vector<thread_future<T>> &futures)
+{
+	using R = std::vector<T>;
+	std::vector<struct thread_task *> deps;
+	std::vector<std::shared_ptr<thread_future_detail::cell<T>>> inputs;
+	for (const thread_future<T> &f : futures) {
+		if (!f.valid())
+			return thread_future<R>();
+		deps.push_back(f.st->owner.task);
+		inputs.push_back(f.st->result);
+	}
+	if (futures.empty())
+		return thread_future<R>();
+	return thread_future_detail::push<R>(futures[0].st->pool,
+		[inputs = std::move(inputs)]() {
+			R values;
+			values.reserve(inputs.size());
+			for (const auto &input : inputs)
+				values.push_back(*input->value);
+			return values;
+		}, deps.data(), (int)deps.size(), false);
+}
+
+/**
+ * Wait for the first of the @a futures. They must be of the same pool
+ * and not empty.
+ * @retval Future of the index of a ready one.
+ */
+template<typename T>
+thread_future<size_t>
+when_any(const std::vector<thread_future<T>> &futures)
+{
+	std::vector<struct thread_task *> deps;
+	std::vector<std::shared_ptr<thread_future_detail::cell<T>>> inputs;
+	for (const thread_future<T> &f : futures) {
+		if (!f.valid())
+			return thread_future<size_t>();
+		deps.push_back(f.st->owner.task);
+		inputs.push_back(f.st->result);
+	}
+	if (futures.empty())
+		return thread_future<size_t>();
+	return thread_future_detail::push<size_t>(futures[0].st->pool,
+		[inputs = std::move(inputs)]() {
+			size_t i = 0;
+			while (!inputs[i]->is_ready.load(
+				std::memory_order_acquire))
+				i = (i + 1) % inputs.size();
+			return i;
+		}, deps.data(), (int)deps.size(), true);
+}
@@ -0,0 +1,255 @@
+#pragma once
+
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <vector>
+
+/**
+ * Parallel algorithms on top of tpool_parallel_for_ranges(). The work
+ * is split recursively down to a grain, and the idle workers steal the
+ * pieces, so the load is balanced without splitting it by hand. All the
+ * functions block until done, and can be called from the pool's own
+ * tasks too.
+ */
+
+namespace thread_parallel_detail {
+
+template<typename F>
+void
+call_range(void *arg, size_t begin, size_t end)
+{
+	(*static_cast<F *>(arg))(begin, end);
+}
+
+/** Call fn(begin, end) for subranges of [begin, end). */
+template<typename F>
+int
+for_ranges(struct thread_pool *pool, size_t begin, size_t end, size_t grain,
+	   F &fn)
+{
+	return tpool_parallel_for_ranges(pool, begin, end, grain,
+					 call_range<F>, &fn);
+}
+
+static inline size_t
+chunk_count(size_t count, size_t grain)
+{
+	if (grain == 0)
+		grain = 1;
+	return (count + grain - 1) / grain;
+}
+
+/**
+ * Index in @a a of the first element of the stable merge of @a a and
+ * @a b which is at @a pos in the output (merge path).
+ */
+template<typename It, typename Compare>
+size_t
+merge_split(It a, size_t a_size, It b, size_t b_size, size_t pos,
+	    Compare &cmp)
+{
+	size_t lo = pos > b_size ? pos - b_size : 0;
+	size_t hi = pos < a_size ? pos : a_size;
+	while (lo < hi) {
+		size_t i = lo + (hi - lo) / 2;
+		/* Equal ones are taken from a first. */
+		if (cmp(b[pos - i - 1], a[i]))
+			hi = i;
+		else
+			lo = i + 1;
+	}
+	return lo;
+}
+
+} /* namespace thread_parallel_detail */
+
+/**
+ * Call @a fn(i) for each i in [begin, end) in parallel.
+ * @param grain Max number of indexes done by one task.
+ * @retval 0 Success.
+ * @retval != 0 Error code, see tpool_parallel_for_ranges().
+ */
+template<typename F>
+int
+tpool_parallel_for(struct thread_pool *pool, size_t begin, size_t end,
+		   size_t grain, F &&fn)
+{
+	auto body = [&fn](size_t b, size_t e) {
+		for (size_t i = b; i < e; ++i)
+			fn(i);
+	};
+	return thread_parallel_detail::for_ranges(pool, begin, end, grain,
+						  body);
+}
+
+/**
+ * Reduce @a map(i) for each i in [begin, end) with @a combine. Each
+ * grain is folded from @a identity in order, then the grains are
+ * folded in order too, so @a combine only has to be associative.
+ * @param[out] result Result.
+ * @retval 0 Success.
+ * @retval != 0 Error code, see tpool_parallel_for_ranges().
+ */
+template<typename T, typename Map, typename Combine>
+int
+tpool_parallel_reduce(struct thread_pool *pool, size_t begin, size_t end,
+		      size_t grain, const T &identity, Map &&map,
+		      Combine &&combine, T *result)
+{
+	if (grain == 0)
+		grain = 1;
+	size_t count = end > begin ? end - begin : 0;
+	std::vector<T> partial(thread_parallel_detail::chunk_count(count,
+								   grain),
+			       identity);
+	auto body = [&](size_t chunk_begin, size_t chunk_end) {
+		for (size_t c = chunk_begin; c < chunk_end; ++c) {
+			size_t b = begin + c * grain;
+			size_t e = std::min(b + grain, end);
+			T acc = identity;
+			for (size_t i = b; i < e; ++i)
+				acc = combine(acc, map(i));
+			partial[c] = std::move(acc);
+		}
+	};
+	int rc = thread_parallel_detail::for_ranges(pool, 0, partial.size(),
+						    1, body);
+	if (rc != 0)
+		return rc;
+	T acc = identity;
+	for (const T &p : partial)
+		acc = combine(acc, p);
+	*result = std::move(acc);
+	return 0;
+}
+
+/**
+ * Inclusive prefix scan: out[i] = in[0] op ... op in[i]. It takes two
+ * passes: the grains are reduced in parallel, their sums are scanned
+ * serially, then the grains are scanned in parallel from their offsets.
+ * @a out can be @a in.
+ * @retval 0 Success.
+ * @retval != 0 Error code, see tpool_parallel_for_ranges().
+ */
+template<typename In, typename Out, typename T, typename Op>
+int
+tpool_parallel_scan(struct thread_pool *pool, In in, Out out, size_t count,
+		    size_t grain, const T &identity, Op &&op)
+{
+	if (grain == 0)
+		grain = 1;
+	size_t chunks = thread_parallel_detail::chunk_count(count, grain);
+	std::vector<T> offset(chunks, identity);
+	auto sum_body = [&](size_t chunk_begin, size_t chunk_end) {
+		for (size_t c = chunk_begin; c < chunk_end; ++c) {
+			size_t e = std::min((c + 1) * grain, count);
+			T acc = identity;
+			for (size_t i = c * grain; i < e; ++i)
+				acc = op(acc, in[i]);
+			offset[c] = std::move(acc);
+		}
+	};
+	int rc = thread_parallel_detail::for_ranges(pool, 0, chunks, 1,
+						    sum_body);
+	if (rc != 0)
+		return rc;
+	/* Exclusive scan of the sums. */
+	T acc = identity;
+	for (size_t c = 0; c < chunks; ++c) {
+		T sum = std::move(offset[c]);
+		offset[c] = acc;
+		acc = op(acc, sum);
+	}
+	auto scan_body = [&](size_t chunk_begin, size_t chunk_end) {
+		for (size_t c = chunk_begin; c < chunk_end; ++c) {
+			size_t e = std::min((c + 1) * grain, count);
+			T acc = offset[c];
+			for (size_t i = c * grain; i < e; ++i) {
+				acc = op(acc, in[i]);
+				out[i] = acc;
+			}
+		}
+	};
+	return thread_parallel_detail::for_ranges(pool, 0, chunks, 1,
+						  scan_body);
+}
+
+/**
+ * Merge sort of [begin, end). The grains are sorted with std::sort in
+ * parallel, then merged pairwise level by level. Each level is split
+ * over the output positions (merge path), so even the last merge of
+ * two halves runs in parallel. Not stable. The elements have to be
+ * default constructible and copyable, two buffers of the same size are
+ * used.
+ * @retval 0 Success.
+ * @retval != 0 Error code, see tpool_parallel_for_ranges().
+ */
+template<typename It, typename Compare = std::less<>>
+int
+tpool_parallel_sort(struct thread_pool *pool, It begin, It end, size_t grain,
+		    Compare cmp = Compare())
+{
+	using T = typename std::iterator_traits<It>::value_type;
+	if (grain == 0)
+		grain = 1;
+	size_t count = end - begin;
+	size_t chunks = thread_parallel_detail::chunk_count(count, grain);
+	auto sort_body = [&](size_t chunk_begin, size_t chunk_end) {
+		for (size_t c = chunk_begin; c < chunk_end; ++c) {
+			size_t e = std::min((c + 1) * grain, count);
+			std::sort(begin + c * grain, begin + e, cmp);
+		}
+	};
+	int rc = thread_parallel_detail::for_ranges(pool, 0, chunks, 1,
+						    sort_body);
+	if (rc != 0 || chunks <= 1)
+		return rc;
+
+	std::vector<T> buf(std::make_move_iterator(begin),
+			   std::make_move_iterator(end));
+	T *src = buf.data();
+	std::vector<T> other(count);
+	T *dst = other.data();
+	for (size_t run = grain; run < count; run *= 2) {
+		/*
+		 * Output positions are split, each finds its inputs. The
+		 * inputs are copied, not moved: the other parts read them
+		 * in their search.
+		 */
+		auto merge_body = [&](size_t b, size_t e) {
+			while (b < e) {
+				size_t pair = b / (2 * run) * (2 * run);
+				size_t mid = std::min(pair + run, count);
+				size_t pair_end = std::min(pair + 2 * run, count);
+				size_t stop = std::min(e, pair_end);
+				T *left = src + pair;
+				T *right = src + mid;
+				size_t left_size = mid - pair;
+				size_t right_size = pair_end - mid;
+				size_t i = thread_parallel_detail::merge_split(
+					left, left_size, right, right_size,
+					b - pair, cmp);
+				size_t j = b - pair - i;
+				for (size_t k = b; k < stop; ++k) {
+					if (j == right_size ||
+					    (i < left_size &&
+					     !cmp(right[j], left[i])))
+						dst[k] = left[i++];
+					else
+						dst[k] = right[j++];
+				}
+				b = stop;
+			}
+		};
+		rc = thread_parallel_detail::for_ranges(pool, 0, count, grain,
+							merge_body);
+		if (rc != 0)
+			return rc;
+		std::swap(src, dst);
+	}
+	std::move(src, src + count, begin);
+	return 0;
+}
@@ -1,142 +1,1845 @@
 #include "thread_pool.h"
 
-#include <deque>
+#include <algorithm>
+#include <atomic>
+#include <climits>
 #include <cmath>
 #include <cerrno>
+#include <linux/futex.h>
 #include <pthread.h>
+#include <sched.h>
+#include <linux/mempolicy.h>
+#include <map>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <time.h>
+#include <unistd.h>
 #include <vector>
 
+/** Phase of a task, the low bits of its state word. */
 enum task_state {
 	TASK_STATE_NEW = 0,
 	TASK_STATE_QUEUED,
 	TASK_STATE_RUNNING,
 	TASK_STATE_FINISHED,
+	TASK_STATE_JOINED,
+	TASK_STATE_MASK = 7,
+};
+
+enum {
+	/** The task is auto-deleted when finished. */
+	TASK_FLAG_DETACHED = 1 << 3,
+	/** Somebody sleeps on the state word, need to wake it up. */
+	TASK_FLAG_WAITERS = 1 << 4,
+	/** Taken from the queue after the deadline. */
+	TASK_FLAG_LATE = 1 << 5,
 };
 
 struct thread_task {
 	thread_task_f function;
+	/**
+	 * Phase and flags. All the transitions are atomic operations on
+	 * this word, and the joiners sleep on it as on a futex. So the
+	 * uncontended push, run and join take no locks.
+	 */
+	std::atomic<uint32_t> state{TASK_STATE_NEW};
+	struct thread_pool *pool = nullptr;
+	/** Pool caching the memory of the task, if any. */
+	struct thread_pool *owner = nullptr;
+	/** Link in a free list of the owner. */
+	thread_task *next_free = nullptr;
+	/**
+	 * Tasks waiting for this one, see thread_pool_push_after(). The
+	 * list is closed when the task is finished, no more can be added.
+	 */
+	std::atomic<struct task_edge*> successors{nullptr};
+	/** See thread_task_set_priority() and thread_task_set_deadline(). */
+	uint8_t priority = TPOOL_PRIORITY_NORMAL;
+	uint8_t deadline_policy = TPOOL_DEADLINE_FLAG;
+	double timeout = 0;
+	/** CLOCK_MONOTONIC nanoseconds of the deadline of the push, or 0. */
+	uint64_t deadline = 0;
+	/** CLOCK_MONOTONIC nanoseconds of the queuing, if tracked. */
+	uint64_t queue_time = 0;
+	/** Link in the FIFO of a class queue. */
+	thread_task *next_queued = nullptr;
+	/** Node of the memory of a task of thread_pool_task_new(). */
+	int node = 0;
+};
+
+/**
+ * Dependencies of a task pushed after other tasks. The task is queued
+ * when the wait count of them are finished. The block is shared by the
+ * edges in the successor lists of the dependencies and is freed by the
+ * last of them, which might be after the task is done.
+ */
+struct task_deps {
+	struct thread_task *task;
+	struct thread_pool *pool;
+	/** Dependencies to finish, plus one while the edges are added. */
+	std::atomic<int> remaining;
+	/** Edges not released, plus one while they are added. */
+	std::atomic<int> refs;
+	struct task_edge *edges;
+};
+
+/** A link from a dependency to a waiting task. */
+struct task_edge {
+	task_deps *deps;
+	task_edge *next;
+};
+
+/** Successor list of a finished task. */
+static task_edge *const TASK_EDGES_CLOSED = reinterpret_cast<task_edge*>(1);
+
+enum {
+	/** Initial capacity of a worker deque. It grows on demand. */
+	WS_DEQUE_MIN_CAPACITY = 64,
+	/** Max tasks a worker moves from the injection queue at once. */
+	INJECTION_BATCH_MAX = 32,
+	/**
+	 * Capacity of the injection queue. A power of 2 not less than
+	 * TPOOL_MAX_TASKS, so the queue never overflows.
+	 */
+	INJECTION_CAPACITY = 1 << 17,
+	/**
+	 * Free tasks moved between a worker cache and the pool depot at
+	 * once. A worker keeps up to twice as many.
+	 */
+	TASK_CACHE_BATCH = 128,
+	/** Memory of the tasks of a node is allocated by such chunks. */
+	TASK_SLAB_SIZE = 64 * 1024,
+	/** Max NUMA node id for the memory binding. */
+	NODE_ID_MAX = 1023,
+};
+
+/** Where the workers can run. */
+enum worker_affinity {
+	/** Anywhere, the default thread attributes. */
+	AFFINITY_NONE,
+	/** Any CPU of the pool set. */
+	AFFINITY_SET,
+	/** Any CPU of the node of the worker. */
+	AFFINITY_NODE,
+	/** The CPU of the worker slot. */
+	AFFINITY_CPU,
+};
+
+static_assert((int)INJECTION_CAPACITY >= (int)TPOOL_MAX_TASKS,
+	      "injection queue can overflow");
+
+/**
+ * Ring buffer of a work-stealing deque. The deque grows by replacing the
+ * buffer, but the old ones are kept until the deque is destroyed, since
+ * a thief might still read a task pointer from them.
+ */
+struct ws_buffer {
+	int64_t capacity;
+	std::atomic<thread_task*> *slots;
+	ws_buffer *prev;
+};
+
+/**
+ * Chase-Lev work-stealing deque. Only the owner pushes and pops, at the
+ * bottom. Other workers steal from the top. Only the races for the last
+ * task are resolved with a CAS.
+ */
+struct ws_deque {
+	std::atomic<int64_t> top{0};
+	std::atomic<int64_t> bottom{0};
+	std::atomic<ws_buffer*> buffer{nullptr};
+};
+
+/**
+ * A cell of the injection queue. Its sequence number tells whether it is
+ * free for the producer at the position, or filled for the consumer.
+ */
+struct injection_cell {
+	std::atomic<size_t> seq;
+	thread_task *task;
+	/** CLOCK_MONOTONIC nanoseconds of the push, if tracked, or 0. */
+	std::atomic<uint64_t> push_time{0};
+};
+
+/**
+ * Bounded lock-free MPMC queue of the tasks pushed from outside of the
+ * workers (D. Vyukov). Producers and consumers only contend on their own
+ * position counter.
+ */
+struct injection_queue {
+	injection_cell *cells = nullptr;
+	alignas(64) std::atomic<size_t> head{0};
+	alignas(64) std::atomic<size_t> tail{0};
+};
+
+/** A task with a deadline in a class queue, with its sort key inline. */
+struct class_entry {
+	uint64_t deadline;
+	/** Order of the queuing, for the equal deadlines. */
+	uint64_t seq;
+	thread_task *task;
+};
+
+/**
+ * Queue of a priority class, for its tasks except the normal ones
+ * without a deadline. The tasks with a deadline are in a binary heap by
+ * it, and go before the others, which are in a FIFO.
+ */
+struct alignas(64) class_queue {
 	pthread_mutex_t mutex;
-	pthread_cond_t cond;
-	task_state state = TASK_STATE_NEW;
-	bool is_pushed = false;
-	bool is_detached = false;
-	bool is_joined = false;
-	int join_waiters = 0;
+	std::vector<class_entry> heap;
+	uint64_t next_seq = 0;
+	thread_task *fifo_head = nullptr;
+	thread_task *fifo_tail = nullptr;
+	/** To skip an empty queue without the lock. */
+	std::atomic<size_t> size{0};
+};
+
+/** Wait or run times of the tasks. Only the worker writes them. */
+struct worker_wait_stats {
+	std::atomic<uint64_t> count{0};
+	std::atomic<uint64_t> total_ns{0};
+	std::atomic<uint64_t> max_ns{0};
+	std::atomic<uint64_t> late{0};
+	std::atomic<uint64_t> dropped{0};
+	std::atomic<uint64_t> histogram[TPOOL_WAIT_BUCKETS] = {};
+};
+
+/** A task run by a worker, for the trace. */
+struct trace_event {
+	/** Address of the task, the memory is reused by the next ones. */
+	uintptr_t task;
+	/** CLOCK_MONOTONIC nanoseconds. */
+	uint64_t queue_time;
+	uint64_t start;
+	uint64_t end;
+	uint8_t priority;
+	bool is_late;
+	bool is_dropped;
+};
+
+/** State of a worker slot. It is protected by the pool mutex. */
+enum worker_state {
+	/** Never started, or the retired thread is joined. */
+	WORKER_FREE,
+	WORKER_RUNNING,
+	/** The thread retired and has to be joined. */
+	WORKER_EXITED,
+};
+
+struct thread_worker {
 	struct thread_pool *pool = nullptr;
+	pthread_t tid;
+	int id = 0;
+	enum worker_state state = WORKER_FREE;
+	/** Node and CPU the slot is assigned to, -1 for no CPU. */
+	int node = 0;
+	int cpu = -1;
+	/** Tasks pushed by the tasks running in this worker. */
+	ws_deque deque;
+	/** State of the generator of the steal victims. */
+	uint64_t rand_state = 0;
+	/** Idle counters. Only the worker writes them. */
+	std::atomic<uint64_t> spins{0};
+	std::atomic<uint64_t> yields{0};
+	std::atomic<uint64_t> parks{0};
+	/** Free tasks of the pool. Only the worker accesses them. */
+	thread_task *task_cache = nullptr;
+	int task_cache_size = 0;
+	/** Tasks taken by the worker, by their priority. */
+	worker_wait_stats wait[TPOOL_PRIORITY_COUNT];
+	/** Task counters. Only the worker writes them. */
+	std::atomic<uint64_t> pushed{0};
+	std::atomic<uint64_t> completed{0};
+	std::atomic<uint64_t> steals{0};
+	std::atomic<uint64_t> busy_ns{0};
+	std::atomic<uint64_t> idle_ns{0};
+	worker_wait_stats run;
+	/** Tasks run inside of the running ones, like by a waiting join. */
+	int run_depth = 0;
+	/** End of the last outer task, or the thread start. */
+	uint64_t last_end = 0;
+	/**
+	 * Last trace_size run tasks, the next one goes to trace_count %
+	 * trace_size. The mutex is for the reader.
+	 */
+	std::vector<trace_event> trace;
+	uint64_t trace_count = 0;
+	pthread_mutex_t trace_mutex;
+};
+
+/**
+ * A sub-pool of the workers of a NUMA node. Without NUMA awareness there
+ * is just one.
+ */
+struct alignas(64) pool_node {
+	/** Node id in the system. */
+	int os_id = 0;
+	/** CPUs of the node the workers run on. */
+	std::vector<int> cpus;
+	/** Worker slots of the node, ascending. */
+	std::vector<int> slots;
+	/**
+	 * Normal tasks without a deadline pushed from outside of the
+	 * workers, by the threads running on the node.
+	 */
+	injection_queue injection;
+	/**
+	 * Free tasks of the node not fitting into the worker caches, or
+	 * freed outside of the workers.
+	 */
+	thread_task *task_depot = nullptr;
+	pthread_mutex_t task_depot_mutex;
+	/** Memory chunks of the tasks, and the free space in the last. */
+	std::vector<void*> slabs;
+	char *slab_pos = nullptr;
+	size_t slab_left = 0;
 };
 
 struct thread_pool {
 	int max_threads = 0;
-	std::vector<pthread_t> threads;
-	std::deque<thread_task*> queue;
-	size_t waiting_threads = 0;
-	size_t tasks_in_pool = 0;
-	bool is_stopping = false;
+	int min_threads = 0;
+	/** Idle strategy, see thread_pool_options. */
+	int spin_count = 0;
+	int yield_count = 0;
+	/** Scaling policy, see thread_pool_options. */
+	double idle_timeout = 0;
+	int grow_backlog = 0;
+	double grow_delay = 0;
+	bool track_wait = false;
+	bool track_run = false;
+	int trace_size = 0;
+	/** CLOCK_MONOTONIC nanoseconds of the creation, for the trace. */
+	uint64_t trace_epoch = 0;
+	/**
+	 * All the worker slots are allocated at once, but started lazily.
+	 * A retired worker leaves its slot to the next started one.
+	 */
+	thread_worker *workers = nullptr;
+	/**
+	 * Slots ever used. The workers steal from all of them, the ones of
+	 * the retired workers are just empty.
+	 */
+	std::atomic<int> thread_count{0};
+	/** Workers started and not retired. */
+	std::atomic<int> running_threads{0};
+	std::atomic<uint64_t> thread_starts{0};
+	std::atomic<uint64_t> thread_retires{0};
+	/** Tasks pushed and not joined or auto-deleted yet. */
+	std::atomic<size_t> tasks_in_pool{0};
+	std::atomic<size_t> tasks_in_pool_max{0};
+	/** Tasks pushed from outside of the workers. */
+	std::atomic<uint64_t> tasks_pushed{0};
+	std::atomic<uint64_t> tasks_detached{0};
+	/** Workers placement, see thread_pool_options. */
+	enum worker_affinity affinity = AFFINITY_NONE;
+	bool is_numa = false;
+	/** CPUs of the workers, for AFFINITY_SET. */
+	std::vector<int> cpus;
+	pool_node *nodes = nullptr;
+	int node_count = 0;
+	/** Node index of each CPU of the system, or -1. */
+	std::vector<int> cpu_node;
+	/** Tasks with a priority or a deadline. */
+	class_queue classes[TPOOL_PRIORITY_COUNT];
+	/** Workers sleeping on the condvar because found no tasks. */
+	std::atomic<int> parked_threads{0};
+	/**
+	 * Workers polling for tasks before parking. While there are any,
+	 * a pusher doesn't wake the parked ones up.
+	 */
+	std::atomic<int> spinning_threads{0};
+	/** Parked workers signaled by the pushers. */
+	std::atomic<uint64_t> wakeups{0};
+	/** Tasks created by thread_pool_task_new() and not deleted. */
+	std::atomic<size_t> tasks_allocated{0};
+	std::atomic<bool> is_stopping{false};
+	/** Protects parking, starting and retiring of the workers. */
 	pthread_mutex_t mutex;
 	pthread_cond_t cond;
+	/** Thread starting workers for the tasks waiting for grow_delay. */
+	pthread_t monitor_tid;
+	bool has_monitor = false;
+	pthread_cond_t monitor_cond;
 };
 
+/** The worker running the current thread, if any. */
+static thread_local thread_worker *current_worker = nullptr;
+
+static inline void
+cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+static ws_buffer *
+ws_buffer_new(int64_t capacity, ws_buffer *prev)
+{
+	ws_buffer *b = new ws_buffer();
+	b->capacity = capacity;
+	b->slots = new std::atomic<thread_task*>[capacity];
+	b->prev = prev;
+	return b;
+}
+
+static void
+ws_deque_create(ws_deque *d)
+{
+	d->buffer.store(ws_buffer_new(WS_DEQUE_MIN_CAPACITY, nullptr),
+			std::memory_order_relaxed);
+}
+
+static void
+ws_deque_destroy(ws_deque *d)
+{
+	ws_buffer *b = d->buffer.load(std::memory_order_relaxed);
+	while (b != nullptr) {
+		ws_buffer *prev = b->prev;
+		delete[] b->slots;
+		delete b;
+		b = prev;
+	}
+}
+
+/** Push a few tasks with one publication. Only for the owner. */
+static void
+ws_deque_push(ws_deque *d, thread_task *const *tasks, int count)
+{
+	int64_t bottom = d->bottom.load(std::memory_order_relaxed);
+	int64_t top = d->top.load(std::memory_order_acquire);
+	ws_buffer *b = d->buffer.load(std::memory_order_relaxed);
+	if (bottom - top + count > b->capacity) {
+		int64_t capacity = b->capacity * 2;
+		while (bottom - top + count > capacity)
+			capacity *= 2;
+		ws_buffer *grown = ws_buffer_new(capacity, b);
+		for (int64_t i = top; i < bottom; ++i) {
+			thread_task *t = b->slots[i % b->capacity].load(
+				std::memory_order_relaxed);
+			grown->slots[i % grown->capacity].store(
+				t, std::memory_order_relaxed);
+		}
+		d->buffer.store(grown, std::memory_order_release);
+		b = grown;
+	}
+	/* Release, so a thief sees the task filled in by the pusher. */
+	for (int i = 0; i < count; ++i) {
+		b->slots[(bottom + i) % b->capacity].store(
+			tasks[i], std::memory_order_release);
+	}
+	std::atomic_thread_fence(std::memory_order_release);
+	d->bottom.store(bottom + count, std::memory_order_relaxed);
+}
+
+/** Pop the last pushed task. Only for the owner. */
+static thread_task *
+ws_deque_pop(ws_deque *d)
+{
+	int64_t bottom = d->bottom.load(std::memory_order_relaxed) - 1;
+	ws_buffer *b = d->buffer.load(std::memory_order_relaxed);
+	d->bottom.store(bottom, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	int64_t top = d->top.load(std::memory_order_relaxed);
+	if (top > bottom) {
+		d->bottom.store(bottom + 1, std::memory_order_relaxed);
+		return nullptr;
+	}
+	thread_task *task = b->slots[bottom % b->capacity].load(
+		std::memory_order_relaxed);
+	if (top == bottom) {
+		/* The last one, race with the thieves. */
+		if (!d->top.compare_exchange_strong(top, top + 1,
+						    std::memory_order_seq_cst,
+						    std::memory_order_relaxed))
+			task = nullptr;
+		d->bottom.store(bottom + 1, std::memory_order_relaxed);
+	}
+	return task;
+}
+
+/**
+ * Steal the first pushed task.
+ * @param[out] is_contended Set when lost a race, and the deque might
+ *             still have tasks.
+ */
+static thread_task *
+ws_deque_steal(ws_deque *d, bool *is_contended)
+{
+	int64_t top = d->top.load(std::memory_order_acquire);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	int64_t bottom = d->bottom.load(std::memory_order_acquire);
+	if (top >= bottom)
+		return nullptr;
+	ws_buffer *b = d->buffer.load(std::memory_order_acquire);
+	thread_task *task = b->slots[top % b->capacity].load(
+		std::memory_order_acquire);
+	if (!d->top.compare_exchange_strong(top, top + 1,
+					    std::memory_order_seq_cst,
+					    std::memory_order_relaxed)) {
+		*is_contended = true;
+		return nullptr;
+	}
+	return task;
+}
+
+static void
+injection_create(injection_queue *q)
+{
+	q->cells = new injection_cell[INJECTION_CAPACITY];
+	for (size_t i = 0; i < INJECTION_CAPACITY; ++i)
+		q->cells[i].seq.store(i, std::memory_order_relaxed);
+}
+
+static void
+injection_destroy(injection_queue *q)
+{
+	delete[] q->cells;
+}
+
+/**
+ * Push a few tasks. The positions for all of them are reserved at once.
+ * The queue never overflows, so a reserved cell can only be still taken
+ * by a consumer, which is about to release it.
+ */
+static void
+injection_push(injection_queue *q, thread_task *const *tasks, int count,
+	       uint64_t push_time)
+{
+	size_t pos = q->tail.fetch_add(count, std::memory_order_relaxed);
+	for (int i = 0; i < count; ++i, ++pos) {
+		injection_cell *cell = &q->cells[pos & (INJECTION_CAPACITY - 1)];
+		while (cell->seq.load(std::memory_order_acquire) != pos)
+			cpu_relax();
+		cell->task = tasks[i];
+		cell->push_time.store(push_time, std::memory_order_relaxed);
+		cell->seq.store(pos + 1, std::memory_order_release);
+	}
+}
+
+static thread_task *
+injection_pop(injection_queue *q)
+{
+	size_t pos = q->head.load(std::memory_order_relaxed);
+	injection_cell *cell;
+	while (true) {
+		cell = &q->cells[pos & (INJECTION_CAPACITY - 1)];
+		size_t seq = cell->seq.load(std::memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+		if (diff == 0) {
+			if (q->head.compare_exchange_weak(
+				pos, pos + 1, std::memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return nullptr;
+		} else {
+			pos = q->head.load(std::memory_order_relaxed);
+		}
+	}
+	thread_task *task = cell->task;
+	cell->seq.store(pos + INJECTION_CAPACITY, std::memory_order_release);
+	return task;
+}
+
+/** Approximate number of tasks in the queue. */
+static size_t
+injection_size(const injection_queue *q)
+{
+	size_t tail = q->tail.load(std::memory_order_relaxed);
+	size_t head = q->head.load(std::memory_order_relaxed);
+	return tail > head ? tail - head : 0;
+}
+
+/**
+ * Push time of the oldest task in the queue, or 0 if it is empty or
+ * the time is not tracked. The cell can be taken concurrently, then the
+ * time of a newer task is returned.
+ */
+static uint64_t
+injection_oldest(injection_queue *q)
+{
+	size_t pos = q->head.load(std::memory_order_relaxed);
+	injection_cell *cell = &q->cells[pos & (INJECTION_CAPACITY - 1)];
+	if (cell->seq.load(std::memory_order_acquire) != pos + 1)
+		return 0;
+	return cell->push_time.load(std::memory_order_relaxed);
+}
+
+static void
+class_queue_create(class_queue *q)
+{
+	pthread_mutex_init(&q->mutex, nullptr);
+}
+
+static void
+class_queue_destroy(class_queue *q)
+{
+	pthread_mutex_destroy(&q->mutex);
+}
+
+/** A normal task without a deadline, for the lock-free queues. */
+static bool
+task_is_plain(const struct thread_task *task)
+{
+	return task->priority == TPOOL_PRIORITY_NORMAL && task->deadline == 0;
+}
+
+/** Heap order: the top is the earliest deadline. */
+static bool
+class_entry_is_later(const class_entry &a, const class_entry &b)
+{
+	if (a.deadline != b.deadline)
+		return a.deadline > b.deadline;
+	return a.seq > b.seq;
+}
+
+/** Queue the not plain tasks of the @a priority class out of @a tasks. */
+static void
+class_queue_push(class_queue *q, thread_task *const *tasks, int count,
+		 int priority)
+{
+	bool is_locked = false;
+	for (int i = 0; i < count; ++i) {
+		thread_task *task = tasks[i];
+		if (task->priority != priority || task_is_plain(task))
+			continue;
+		if (!is_locked) {
+			pthread_mutex_lock(&q->mutex);
+			is_locked = true;
+		}
+		if (task->deadline != 0) {
+			q->heap.push_back({task->deadline, q->next_seq++, task});
+			std::push_heap(q->heap.begin(), q->heap.end(),
+				       class_entry_is_later);
+		} else {
+			task->next_queued = nullptr;
+			if (q->fifo_tail != nullptr)
+				q->fifo_tail->next_queued = task;
+			else
+				q->fifo_head = task;
+			q->fifo_tail = task;
+		}
+		q->size.store(q->size.load(std::memory_order_relaxed) + 1,
+			      std::memory_order_relaxed);
+	}
+	if (is_locked)
+		pthread_mutex_unlock(&q->mutex);
+}
+
+static thread_task *
+class_queue_pop(class_queue *q)
+{
+	if (q->size.load(std::memory_order_relaxed) == 0)
+		return nullptr;
+	thread_task *task = nullptr;
+	pthread_mutex_lock(&q->mutex);
+	if (!q->heap.empty()) {
+		std::pop_heap(q->heap.begin(), q->heap.end(),
+			      class_entry_is_later);
+		task = q->heap.back().task;
+		q->heap.pop_back();
+	} else if (q->fifo_head != nullptr) {
+		task = q->fifo_head;
+		q->fifo_head = task->next_queued;
+		if (q->fifo_head == nullptr)
+			q->fifo_tail = nullptr;
+	}
+	if (task != nullptr) {
+		q->size.store(q->size.load(std::memory_order_relaxed) - 1,
+			      std::memory_order_relaxed);
+	}
+	pthread_mutex_unlock(&q->mutex);
+	return task;
+}
+
+static uint64_t
+clock_monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+timespec_add_seconds(struct timespec *ts, double seconds)
+{
+	if (seconds <= 0)
+		return;
+	double integral = 0;
+	double fractional = std::modf(seconds, &integral);
+	ts->tv_sec += static_cast<time_t>(integral);
+	long add_nsec = static_cast<long>(fractional * 1000000000.0);
+	ts->tv_nsec += add_nsec;
+	if (ts->tv_nsec >= 1000000000L) {
+		++ts->tv_sec;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+static void
+futex_wake_all(std::atomic<uint32_t> *word)
+{
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(word),
+		FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+}
+
+/**
+ * Sleep while the word equals @a value, or until the absolute
+ * CLOCK_MONOTONIC @a deadline if it is not NULL.
+ * @retval false The deadline has passed.
+ */
+static bool
+futex_wait(std::atomic<uint32_t> *word, uint32_t value,
+	   const struct timespec *deadline)
+{
+	long rc = syscall(SYS_futex, reinterpret_cast<uint32_t*>(word),
+			  FUTEX_WAIT_BITSET_PRIVATE, value, deadline, nullptr,
+			  FUTEX_BITSET_MATCH_ANY);
+	return rc == 0 || errno != ETIMEDOUT;
+}
+
+static void
+counter_add(std::atomic<uint64_t> *counter, uint64_t value)
+{
+	if (value != 0)
+		counter->fetch_add(value, std::memory_order_relaxed);
+}
+
+/** Add to a counter of the current worker, without a locked op. */
+static void
+counter_bump(std::atomic<uint64_t> *counter, uint64_t value)
+{
+	counter->store(counter->load(std::memory_order_relaxed) + value,
+		       std::memory_order_relaxed);
+}
+
+/** Account a wait or a run time. */
+static void
+time_stats_add(worker_wait_stats *stats, uint64_t ns)
+{
+	int bucket = 63 - __builtin_clzll(ns | 1);
+	if (bucket >= TPOOL_WAIT_BUCKETS)
+		bucket = TPOOL_WAIT_BUCKETS - 1;
+	counter_add(&stats->count, 1);
+	counter_add(&stats->total_ns, ns);
+	counter_add(&stats->histogram[bucket], 1);
+	if (ns > stats->max_ns.load(std::memory_order_relaxed))
+		stats->max_ns.store(ns, std::memory_order_relaxed);
+}
+
 static void
 thread_pool_task_done(struct thread_pool *pool)
 {
-	pthread_mutex_lock(&pool->mutex);
-	--pool->tasks_in_pool;
-	pthread_cond_broadcast(&pool->cond);
-	pthread_mutex_unlock(&pool->mutex);
+	pool->tasks_in_pool.fetch_sub(1, std::memory_order_release);
+}
+
+/**
+ * Take a task from the injection queues, of the worker node first. A
+ * few more are moved into the worker deque, so the next ones are taken
+ * without touching the shared queue, and the other workers can steal
+ * them.
+ */
+static thread_task *
+thread_worker_pop_injection(thread_worker *w)
+{
+	thread_pool *pool = w->pool;
+	injection_queue *q = nullptr;
+	thread_task *task = nullptr;
+	for (int i = 0; i < pool->node_count && task == nullptr; ++i) {
+		q = &pool->nodes[(w->node + i) % pool->node_count].injection;
+		task = injection_pop(q);
+	}
+	if (task == nullptr)
+		return nullptr;
+	int thread_count = pool->running_threads.load(std::memory_order_relaxed);
+	if (thread_count < 1)
+		thread_count = 1;
+	size_t batch = injection_size(q) / thread_count;
+	if (batch > INJECTION_BATCH_MAX)
+		batch = INJECTION_BATCH_MAX;
+	thread_task *moved[INJECTION_BATCH_MAX];
+	int count = 0;
+	for (; count < (int)batch; ++count) {
+		moved[count] = injection_pop(q);
+		if (moved[count] == nullptr)
+			break;
+	}
+	if (count > 0)
+		ws_deque_push(&w->deque, moved, count);
+	return task;
+}
+
+/**
+ * Steal from the @a count first @a victims, or from the slots
+ * [0, count) if it is NULL, starting from a random one.
+ */
+static thread_task *
+thread_worker_steal_from(thread_worker *w, const int *victims, int count)
+{
+	thread_pool *pool = w->pool;
+	bool is_contended;
+	do {
+		is_contended = false;
+		/* xorshift64. */
+		w->rand_state ^= w->rand_state << 13;
+		w->rand_state ^= w->rand_state >> 7;
+		w->rand_state ^= w->rand_state << 17;
+		int start = static_cast<int>(w->rand_state % count);
+		for (int i = 0; i < count; ++i) {
+			int victim = (start + i) % count;
+			if (victims != nullptr)
+				victim = victims[victim];
+			if (victim == w->id)
+				continue;
+			thread_task *task = ws_deque_steal(
+				&pool->workers[victim].deque, &is_contended);
+			if (task != nullptr)
+				return task;
+		}
+	} while (is_contended);
+	return nullptr;
+}
+
+/** Steal a task, from the workers of the same node first. */
+static thread_task *
+thread_worker_steal(thread_worker *w)
+{
+	thread_pool *pool = w->pool;
+	int count = pool->thread_count.load(std::memory_order_acquire);
+	thread_task *task = nullptr;
+	if (pool->node_count > 1) {
+		const std::vector<int> &slots = pool->nodes[w->node].slots;
+		int node_count = std::lower_bound(slots.begin(), slots.end(),
+						  count) - slots.begin();
+		task = thread_worker_steal_from(w, slots.data(), node_count);
+	}
+	if (task == nullptr)
+		task = thread_worker_steal_from(w, nullptr, count);
+	if (task != nullptr)
+		counter_bump(&w->steals, 1);
+	return task;
+}
+
+/**
+ * Take the next task by priority. Within the normal class the ones with
+ * a deadline go first, the local deques and the injection queue hold
+ * only the ones without it.
+ */
+static thread_task *
+thread_worker_find_task(thread_worker *w)
+{
+	thread_pool *pool = w->pool;
+	thread_task *task = class_queue_pop(
+		&pool->classes[TPOOL_PRIORITY_HIGH]);
+	if (task == nullptr)
+		task = class_queue_pop(&pool->classes[TPOOL_PRIORITY_NORMAL]);
+	if (task == nullptr)
+		task = ws_deque_pop(&w->deque);
+	if (task == nullptr)
+		task = thread_worker_pop_injection(w);
+	if (task == nullptr)
+		task = thread_worker_steal(w);
+	if (task == nullptr)
+		task = class_queue_pop(&pool->classes[TPOOL_PRIORITY_LOW]);
+	return task;
+}
+
+/** Destroy the tasks in the slab memory, it is freed separately. */
+static void
+task_list_destroy(thread_task *list)
+{
+	while (list != nullptr) {
+		thread_task *next = list->next_free;
+		list->~thread_task();
+		list = next;
+	}
+}
+
+/** Cut the first @a count tasks off the list. */
+static thread_task *
+task_list_cut(thread_task **list, int count)
+{
+	thread_task *head = *list;
+	thread_task *last = head;
+	for (int i = 1; i < count && last->next_free != nullptr; ++i)
+		last = last->next_free;
+	*list = last->next_free;
+	last->next_free = nullptr;
+	return head;
+}
+
+/** Put a list of free tasks of the node into its depot. */
+static void
+pool_node_put_tasks(pool_node *node, thread_task *head)
+{
+	thread_task *last = head;
+	while (last->next_free != nullptr)
+		last = last->next_free;
+	pthread_mutex_lock(&node->task_depot_mutex);
+	last->next_free = node->task_depot;
+	node->task_depot = head;
+	pthread_mutex_unlock(&node->task_depot_mutex);
+}
+
+/**
+ * Allocate a task in the memory of the node. The chunks of it are
+ * bound to the node, if the pool is NUMA aware. Called under the depot
+ * lock.
+ */
+static thread_task *
+pool_node_alloc_task(thread_pool *pool, int node_index)
+{
+	pool_node *node = &pool->nodes[node_index];
+	const size_t size = (sizeof(thread_task) + alignof(thread_task) - 1) &
+			    ~(alignof(thread_task) - 1);
+	if (node->slab_left < size) {
+		void *slab = mmap(nullptr, TASK_SLAB_SIZE,
+				  PROT_READ | PROT_WRITE,
+				  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (slab == MAP_FAILED)
+			throw std::bad_alloc();
+		if (pool->is_numa && node->os_id <= NODE_ID_MAX) {
+			/* Only a hint, the memory is usable anyway. */
+			unsigned long mask[(NODE_ID_MAX + 1) / 64] = {};
+			mask[node->os_id / 64] |= 1UL << (node->os_id % 64);
+			syscall(SYS_mbind, slab, TASK_SLAB_SIZE,
+				MPOL_PREFERRED, mask, NODE_ID_MAX + 1, 0);
+		}
+		node->slabs.push_back(slab);
+		node->slab_pos = static_cast<char*>(slab);
+		node->slab_left = TASK_SLAB_SIZE;
+	}
+	auto *task = new (node->slab_pos) thread_task();
+	task->node = node_index;
+	node->slab_pos += size;
+	node->slab_left -= size;
+	return task;
+}
+
+/** Node of the calling thread: of its worker, or of its CPU. */
+static int
+thread_pool_current_node(thread_pool *pool)
+{
+	thread_worker *w = current_worker;
+	if (w != nullptr && w->pool == pool)
+		return w->node;
+	if (pool->node_count == 1)
+		return 0;
+	int cpu = sched_getcpu();
+	if (cpu < 0 || cpu >= (int)pool->cpu_node.size() ||
+	    pool->cpu_node[cpu] < 0)
+		return 0;
+	return pool->cpu_node[cpu];
+}
+
+/**
+ * Take a free task of the pool, from the node of the caller. The
+ * workers take a batch at once from the depot into their caches.
+ */
+static thread_task *
+task_cache_get(thread_pool *pool)
+{
+	thread_task *task = nullptr;
+	thread_worker *w = current_worker;
+	int node_index = thread_pool_current_node(pool);
+	pool_node *node = &pool->nodes[node_index];
+	if (w != nullptr && w->pool == pool) {
+		if (w->task_cache == nullptr) {
+			pthread_mutex_lock(&node->task_depot_mutex);
+			if (node->task_depot != nullptr) {
+				w->task_cache = task_list_cut(&node->task_depot,
+							      TASK_CACHE_BATCH);
+			}
+			pthread_mutex_unlock(&node->task_depot_mutex);
+			for (task = w->task_cache; task != nullptr;
+			     task = task->next_free)
+				++w->task_cache_size;
+		}
+		task = w->task_cache;
+		if (task != nullptr) {
+			w->task_cache = task->next_free;
+			--w->task_cache_size;
+			return task;
+		}
+	}
+	pthread_mutex_lock(&node->task_depot_mutex);
+	task = node->task_depot;
+	if (task != nullptr)
+		node->task_depot = task->next_free;
+	else
+		task = pool_node_alloc_task(pool, node_index);
+	pthread_mutex_unlock(&node->task_depot_mutex);
+	return task;
+}
+
+static void
+task_cache_put(thread_pool *pool, thread_task *task)
+{
+	/* Captures of the function are released right away. */
+	task->function.reset();
+	thread_worker *w = current_worker;
+	if (w != nullptr && w->pool == pool && w->node == task->node) {
+		task->next_free = w->task_cache;
+		w->task_cache = task;
+		if (++w->task_cache_size == 2 * TASK_CACHE_BATCH) {
+			thread_task *head = task_list_cut(&w->task_cache,
+							  TASK_CACHE_BATCH);
+			w->task_cache_size -= TASK_CACHE_BATCH;
+			pool_node_put_tasks(&pool->nodes[w->node], head);
+		}
+	} else {
+		/* The memory goes back to its node. */
+		task->next_free = nullptr;
+		pool_node_put_tasks(&pool->nodes[task->node], task);
+	}
+	pool->tasks_allocated.fetch_sub(1, std::memory_order_release);
+}
+
+static void
+thread_task_free(thread_task *task)
+{
+	if (task->owner != nullptr)
+		task_cache_put(task->owner, task);
+	else
+		delete task;
+}
+
+static void
+thread_task_delete_now(thread_task *task, thread_pool *pool)
+{
+	/* Freed first, so the pool is not deleted before that. */
+	thread_task_free(task);
+	thread_pool_task_done(pool);
+}
+
+static void
+thread_pool_enqueue(struct thread_pool *pool, struct thread_task *const *tasks,
+		    int count);
+
+/** Release one dependency, the last one queues the task. */
+static void
+task_deps_release(task_deps *deps)
+{
+	if (deps->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		thread_pool_enqueue(deps->pool, &deps->task, 1);
+	if (deps->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		delete[] deps->edges;
+		delete deps;
+	}
+}
+
+/**
+ * Add a task waiting for @a task.
+ * @retval false The task is finished already.
+ */
+static bool
+task_add_successor(thread_task *task, task_edge *edge)
+{
+	task_edge *head = task->successors.load(std::memory_order_acquire);
+	do {
+		if (head == TASK_EDGES_CLOSED)
+			return false;
+		edge->next = head;
+	} while (!task->successors.compare_exchange_weak(
+		head, edge, std::memory_order_release,
+		std::memory_order_acquire));
+	return true;
+}
+
+static void
+task_release_successors(thread_task *task)
+{
+	task_edge *edge = task->successors.exchange(TASK_EDGES_CLOSED,
+						    std::memory_order_acq_rel);
+	while (edge != nullptr) {
+		/* The edge can be freed by the release. */
+		task_edge *next = edge->next;
+		task_deps_release(edge->deps);
+		edge = next;
+	}
+}
+
+/**
+ * Account the queue wait of a taken task and check its deadline.
+ * @retval true The task is late and has to be dropped.
+ */
+static bool
+thread_worker_take(thread_worker *w, thread_task *task)
+{
+	thread_pool *pool = w->pool;
+	if (task->deadline == 0 && !pool->track_wait)
+		return false;
+	uint64_t now = clock_monotonic_ns();
+	worker_wait_stats *stats = &w->wait[task->priority];
+	if (pool->track_wait) {
+		time_stats_add(stats, now > task->queue_time ?
+				      now - task->queue_time : 0);
+	}
+	if (task->deadline == 0 || now <= task->deadline)
+		return false;
+	task->state.fetch_or(TASK_FLAG_LATE, std::memory_order_relaxed);
+	counter_add(&stats->late, 1);
+	if (task->deadline_policy != TPOOL_DEADLINE_DROP)
+		return false;
+	counter_add(&stats->dropped, 1);
+	return true;
+}
+
+/** Account the run time of a task, and put it into the trace. */
+static void
+thread_worker_account_run(thread_worker *w, trace_event *event)
+{
+	thread_pool *pool = w->pool;
+	event->end = clock_monotonic_ns();
+	if (pool->track_run) {
+		time_stats_add(&w->run, event->end - event->start);
+		if (w->run_depth == 0) {
+			counter_bump(&w->busy_ns, event->end - event->start);
+			counter_bump(&w->idle_ns, event->start - w->last_end);
+			w->last_end = event->end;
+		}
+	}
+	if (pool->trace_size > 0) {
+		pthread_mutex_lock(&w->trace_mutex);
+		w->trace[w->trace_count++ % w->trace.size()] = *event;
+		pthread_mutex_unlock(&w->trace_mutex);
+	}
+}
+
+static void
+thread_worker_run(thread_worker *w, thread_task *task)
+{
+	thread_pool *pool = w->pool;
+	bool is_dropped = thread_worker_take(w, task);
+	/* The flags are kept, so it is the QUEUED -> RUNNING step. */
+	uint32_t state = task->state.fetch_add(1, std::memory_order_relaxed);
+
+	bool is_timed = pool->track_run || pool->trace_size > 0;
+	trace_event event;
+	if (is_timed) {
+		event.task = reinterpret_cast<uintptr_t>(task);
+		event.queue_time = task->queue_time;
+		event.priority = task->priority;
+		event.is_late = (state & TASK_FLAG_LATE) != 0;
+		event.is_dropped = is_dropped;
+		event.start = clock_monotonic_ns();
+	}
+	if (!is_dropped) {
+		++w->run_depth;
+		task->function();
+		--w->run_depth;
+	}
+	if (is_timed)
+		thread_worker_account_run(w, &event);
+	counter_bump(&w->completed, 1);
+	/* Before the finish, after it the task can be deleted. */
+	task_release_successors(task);
+
+	uint32_t old = task->state.fetch_add(1, std::memory_order_acq_rel);
+	if ((old & TASK_FLAG_DETACHED) != 0) {
+		/* Nobody can access a detached task anymore. */
+		thread_task_delete_now(task, w->pool);
+		return;
+	}
+	/*
+	 * The task might be joined and deleted by a joiner woken up
+	 * spuriously right after the add. The wakeup doesn't touch the
+	 * memory, so it is harmless then.
+	 */
+	if ((old & TASK_FLAG_WAITERS) != 0)
+		futex_wake_all(&task->state);
+}
+
+static size_t
+thread_pool_backlog(const struct thread_pool *pool);
+
+static void
+thread_pool_wakeup(struct thread_pool *pool, int count);
+
+/**
+ * Poll for a task before parking: spin_count rounds with a pause, then
+ * yield_count rounds with yielding the CPU.
+ */
+static thread_task *
+thread_worker_spin(thread_worker *w)
+{
+	thread_pool *pool = w->pool;
+	if (pool->spin_count == 0 && pool->yield_count == 0)
+		return nullptr;
+	pool->spinning_threads.fetch_add(1, std::memory_order_relaxed);
+	thread_task *task = nullptr;
+	int spins = 0;
+	int yields = 0;
+	for (; spins < pool->spin_count && task == nullptr; ++spins) {
+		cpu_relax();
+		task = thread_worker_find_task(w);
+	}
+	for (; yields < pool->yield_count && task == nullptr; ++yields) {
+		sched_yield();
+		task = thread_worker_find_task(w);
+	}
+	/*
+	 * The pushers skip the wakeups while any worker polls, but it
+	 * takes one task only. The last poller to find one hands the rest
+	 * over to a parked worker, like resetspinning() of the Go
+	 * scheduler. The pusher pushes, then checks the pollers, and the
+	 * poller does the reverse, so either of them sees the other.
+	 */
+	int left = pool->spinning_threads.fetch_sub(
+		1, std::memory_order_relaxed) - 1;
+	if (task != nullptr && left == 0) {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (thread_pool_backlog(pool) > 0)
+			thread_pool_wakeup(pool, 1);
+	}
+	counter_add(&w->spins, spins);
+	counter_add(&w->yields, yields);
+	return task;
+}
+
+/**
+ * Retire the parked worker if there are more than min_threads. Its free
+ * tasks go to the depot, its deque is empty, since only the worker
+ * pushes there.
+ */
+static bool
+thread_worker_retire_locked(thread_worker *w)
+{
+	thread_pool *pool = w->pool;
+	if (pool->running_threads.load(std::memory_order_relaxed) <=
+	    pool->min_threads)
+		return false;
+	if (w->task_cache != nullptr) {
+		pool_node_put_tasks(&pool->nodes[w->node], w->task_cache);
+		w->task_cache = nullptr;
+		w->task_cache_size = 0;
+	}
+	w->state = WORKER_EXITED;
+	pool->running_threads.fetch_sub(1, std::memory_order_relaxed);
+	pool->parked_threads.fetch_sub(1, std::memory_order_relaxed);
+	pool->thread_retires.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+static void *
+thread_pool_worker(void *arg)
+{
+	auto *w = static_cast<thread_worker*>(arg);
+	thread_pool *pool = w->pool;
+	current_worker = w;
+	if (pool->track_run)
+		w->last_end = clock_monotonic_ns();
+	while (true) {
+		thread_task *task = thread_worker_find_task(w);
+		if (task == nullptr)
+			task = thread_worker_spin(w);
+		if (task != nullptr) {
+			thread_worker_run(w, task);
+			continue;
+		}
+		/*
+		 * Announce the parking before the last check. A pusher
+		 * either sees it (or the spinning worker before) and wakes
+		 * the worker up, or pushed early enough for the check to see
+		 * the task.
+		 */
+		pthread_mutex_lock(&pool->mutex);
+		pool->parked_threads.fetch_add(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		bool is_timed_out = false;
+		while (!pool->is_stopping.load(std::memory_order_relaxed)) {
+			task = thread_worker_find_task(w);
+			if (task != nullptr)
+				break;
+			if (is_timed_out && thread_worker_retire_locked(w)) {
+				pthread_mutex_unlock(&pool->mutex);
+				return nullptr;
+			}
+			counter_add(&w->parks, 1);
+			/* The last min_threads never retire, so never wake. */
+			if (pool->idle_timeout > 0 &&
+			    pool->running_threads.load(
+				std::memory_order_relaxed) > pool->min_threads) {
+				struct timespec deadline;
+				clock_gettime(CLOCK_MONOTONIC, &deadline);
+				timespec_add_seconds(&deadline, pool->idle_timeout);
+				is_timed_out = pthread_cond_timedwait(
+					&pool->cond, &pool->mutex,
+					&deadline) == ETIMEDOUT;
+			} else {
+				pthread_cond_wait(&pool->cond, &pool->mutex);
+			}
+		}
+		pool->parked_threads.fetch_sub(1, std::memory_order_relaxed);
+		pthread_mutex_unlock(&pool->mutex);
+		if (task == nullptr)
+			return nullptr;
+		thread_worker_run(w, task);
+	}
+}
+
+/** CPUs the worker of the slot can run on. */
+static void
+thread_worker_cpu_set(const thread_worker *w, cpu_set_t *set)
+{
+	const thread_pool *pool = w->pool;
+	CPU_ZERO(set);
+	switch (pool->affinity) {
+	case AFFINITY_CPU:
+		CPU_SET(w->cpu, set);
+		break;
+	case AFFINITY_NODE:
+		for (int cpu : pool->nodes[w->node].cpus)
+			CPU_SET(cpu, set);
+		break;
+	default:
+		for (int cpu : pool->cpus)
+			CPU_SET(cpu, set);
+		break;
+	}
+}
+
+/**
+ * Start a worker in the first not running slot. The thread of a
+ * retired worker there is joined first.
+ */
+static bool
+thread_pool_start_worker_locked(struct thread_pool *pool)
+{
+	if (pool->running_threads.load(std::memory_order_relaxed) ==
+	    pool->max_threads)
+		return false;
+	int count = pool->thread_count.load(std::memory_order_relaxed);
+	thread_worker *w = nullptr;
+	for (int i = 0; i < count && w == nullptr; ++i) {
+		if (pool->workers[i].state != WORKER_RUNNING)
+			w = &pool->workers[i];
+	}
+	if (w == nullptr) {
+		w = &pool->workers[count];
+		ws_deque_create(&w->deque);
+		if (pool->trace_size > 0)
+			w->trace.resize(pool->trace_size);
+		/*
+		 * The count goes first, so the new worker sees itself among
+		 * the steal victims.
+		 */
+		pool->thread_count.store(count + 1, std::memory_order_release);
+	} else if (w->state == WORKER_EXITED) {
+		pthread_join(w->tid, nullptr);
+		w->state = WORKER_FREE;
+	}
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	if (pool->affinity != AFFINITY_NONE) {
+		cpu_set_t set;
+		thread_worker_cpu_set(w, &set);
+		pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+	}
+	/* Counted first, the worker can run a task before the create ends. */
+	pool->running_threads.fetch_add(1, std::memory_order_relaxed);
+	pool->thread_starts.fetch_add(1, std::memory_order_relaxed);
+	int rc = pthread_create(&w->tid, &attr, thread_pool_worker, w);
+	pthread_attr_destroy(&attr);
+	if (rc != 0) {
+		pool->running_threads.fetch_sub(1, std::memory_order_relaxed);
+		pool->thread_starts.fetch_sub(1, std::memory_order_relaxed);
+		return false;
+	}
+	w->state = WORKER_RUNNING;
+	return true;
+}
+
+/** Approximate number of the queued tasks, in all the queues. */
+static size_t
+thread_pool_backlog(const struct thread_pool *pool)
+{
+	size_t backlog = 0;
+	for (int i = 0; i < pool->node_count; ++i)
+		backlog += injection_size(&pool->nodes[i].injection);
+	for (int i = 0; i < TPOOL_PRIORITY_COUNT; ++i)
+		backlog += pool->classes[i].size.load(std::memory_order_relaxed);
+	int count = pool->thread_count.load(std::memory_order_acquire);
+	for (int i = 0; i < count; ++i) {
+		const ws_deque *d = &pool->workers[i].deque;
+		int64_t size = d->bottom.load(std::memory_order_relaxed) -
+			       d->top.load(std::memory_order_relaxed);
+		if (size > 0)
+			backlog += size;
+	}
+	return backlog;
+}
+
+/**
+ * Check if the queued tasks need one more thread, when all the running
+ * ones are busy.
+ */
+static bool
+thread_pool_should_grow(struct thread_pool *pool)
+{
+	int running = pool->running_threads.load(std::memory_order_relaxed);
+	if (running < pool->min_threads || running == 0)
+		return true;
+	if (pool->grow_backlog == 0 && pool->grow_delay == 0)
+		return true;
+	if (pool->grow_backlog > 0 && thread_pool_backlog(pool) >=
+	    (size_t)pool->grow_backlog * running)
+		return true;
+	if (pool->grow_delay > 0) {
+		uint64_t now = clock_monotonic_ns();
+		for (int i = 0; i < pool->node_count; ++i) {
+			uint64_t push_time =
+				injection_oldest(&pool->nodes[i].injection);
+			if (push_time != 0 && now - push_time >=
+			    pool->grow_delay * 1000000000.0)
+				return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Wake parked workers for @a count new tasks, one per task. If there
+ * are not enough, start new ones until the limit, if the scaling policy
+ * allows. The spinning workers take some of the tasks without a wakeup.
+ */
+static void
+thread_pool_wakeup(struct thread_pool *pool, int count)
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	count -= pool->spinning_threads.load(std::memory_order_relaxed);
+	if (count <= 0)
+		return;
+	bool is_parked = pool->parked_threads.load(std::memory_order_relaxed) > 0;
+	if (!is_parked && pool->running_threads.load(std::memory_order_relaxed) ==
+	    pool->max_threads)
+		return;
+	pthread_mutex_lock(&pool->mutex);
+	int parked = pool->parked_threads.load(std::memory_order_relaxed);
+	int wake = count < parked ? count : parked;
+	if (wake > 0) {
+		pool->wakeups.fetch_add(wake, std::memory_order_relaxed);
+		if (wake == parked) {
+			pthread_cond_broadcast(&pool->cond);
+		} else {
+			for (int i = 0; i < wake; ++i)
+				pthread_cond_signal(&pool->cond);
+		}
+		count -= wake;
+	}
+	for (; count > 0; --count) {
+		if (!thread_pool_should_grow(pool) ||
+		    !thread_pool_start_worker_locked(pool))
+			break;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/**
+ * Start workers for the tasks waiting for grow_delay while all the
+ * workers are busy. The pushers check it only when they push, so the
+ * tasks stuck behind the long ones after the last push are found here.
+ */
+static void *
+thread_pool_monitor(void *arg)
+{
+	auto *pool = static_cast<thread_pool*>(arg);
+	pthread_mutex_lock(&pool->mutex);
+	while (!pool->is_stopping.load(std::memory_order_relaxed)) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		timespec_add_seconds(&deadline, pool->grow_delay / 2);
+		pthread_cond_timedwait(&pool->monitor_cond, &pool->mutex,
+				       &deadline);
+		if (pool->parked_threads.load(std::memory_order_relaxed) == 0 &&
+		    pool->spinning_threads.load(std::memory_order_relaxed) == 0 &&
+		    thread_pool_backlog(pool) > 0 &&
+		    thread_pool_should_grow(pool))
+			thread_pool_start_worker_locked(pool);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return nullptr;
+}
+
+int
+thread_pool_new(int thread_count, struct thread_pool **pool)
+{
+	if (thread_count > TPOOL_MAX_THREADS)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	struct thread_pool_options opts;
+	thread_pool_options_create(&opts);
+	opts.thread_count = thread_count;
+	return thread_pool_new_ex(&opts, pool);
+}
+
+void
+thread_pool_options_create(struct thread_pool_options *opts)
+{
+	opts->thread_count = 1;
+	opts->min_threads = 0;
+	opts->spin_count = 0;
+	opts->yield_count = 0;
+	opts->idle_timeout = 0;
+	opts->grow_backlog = 0;
+	opts->grow_delay = 0;
+	opts->track_wait = false;
+	opts->track_run = false;
+	opts->trace_size = 0;
+	opts->cpus = nullptr;
+	opts->cpu_count = 0;
+	opts->pin_per_cpu = false;
+	opts->numa_aware = false;
+}
+
+static void
+thread_pool_cond_create(pthread_cond_t *cond)
+{
+	/* The timed waits are on CLOCK_MONOTONIC like the joins. */
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+/** Read a list like "0-3,8,10-11" from a sysfs file. */
+static bool
+sysfs_read_list(const char *path, std::vector<int> *list)
+{
+	FILE *f = fopen(path, "r");
+	if (f == nullptr)
+		return false;
+	char buf[4096];
+	bool is_read = fgets(buf, sizeof(buf), f) != nullptr;
+	fclose(f);
+	if (!is_read)
+		return false;
+	char *pos = buf;
+	while (*pos >= '0' && *pos <= '9') {
+		char *end;
+		long first = strtol(pos, &end, 10);
+		long last = first;
+		if (*end == '-')
+			last = strtol(end + 1, &end, 10);
+		for (long i = first; i <= last; ++i)
+			list->push_back(i);
+		pos = *end == ',' ? end + 1 : end;
+	}
+	return true;
+}
+
+/**
+ * Get the CPUs for the workers.
+ * @retval false A CPU is out of the process affinity.
+ */
+static bool
+thread_pool_options_cpus(const struct thread_pool_options *opts,
+			 std::vector<int> *cpus)
+{
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		return false;
+	if (opts->cpus == nullptr) {
+		for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+			if (CPU_ISSET(cpu, &allowed))
+				cpus->push_back(cpu);
+		}
+		return !cpus->empty();
+	}
+	if (opts->cpu_count <= 0)
+		return false;
+	for (int i = 0; i < opts->cpu_count; ++i) {
+		int cpu = opts->cpus[i];
+		if (cpu < 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed))
+			return false;
+		cpus->push_back(cpu);
+	}
+	std::sort(cpus->begin(), cpus->end());
+	cpus->erase(std::unique(cpus->begin(), cpus->end()), cpus->end());
+	return true;
 }
 
-static void *
-thread_pool_worker(void *arg)
+/**
+ * Group the CPUs by the NUMA nodes, and assign the worker slots to
+ * them round-robin over the nodes.
+ */
+static void
+thread_pool_place(struct thread_pool *pool,
+		  const struct thread_pool_options *opts,
+		  const std::vector<int> &cpus)
 {
-	auto *pool = static_cast<thread_pool*>(arg);
-	pthread_mutex_lock(&pool->mutex);
-	while (true) {
-		while (pool->queue.empty() && !pool->is_stopping) {
-			++pool->waiting_threads;
-			pthread_cond_wait(&pool->cond, &pool->mutex);
-			--pool->waiting_threads;
+	std::map<int, std::vector<int>> groups;
+	std::map<int, std::vector<int>> node_all_cpus;
+	if (opts->numa_aware) {
+		std::vector<int> online;
+		sysfs_read_list("/sys/devices/system/node/online", &online);
+		for (int id : online) {
+			char path[64];
+			snprintf(path, sizeof(path),
+				 "/sys/devices/system/node/node%d/cpulist", id);
+			sysfs_read_list(path, &node_all_cpus[id]);
 		}
-		if (pool->is_stopping && pool->queue.empty()) {
-			pthread_mutex_unlock(&pool->mutex);
-			return nullptr;
+	}
+	for (int cpu : cpus) {
+		int os_id = 0;
+		for (const auto &node : node_all_cpus) {
+			if (std::binary_search(node.second.begin(),
+					       node.second.end(), cpu))
+				os_id = node.first;
 		}
-		thread_task *task = pool->queue.front();
-		pool->queue.pop_front();
-		pthread_mutex_unlock(&pool->mutex);
+		groups[os_id].push_back(cpu);
+	}
+	pool->cpus = cpus;
+	pool->node_count = groups.size();
+	pool->nodes = new pool_node[pool->node_count];
+	int index = 0;
+	for (const auto &group : groups) {
+		pool_node *node = &pool->nodes[index];
+		node->os_id = group.first;
+		node->cpus = group.second;
+		auto all = node_all_cpus.find(group.first);
+		if (all != node_all_cpus.end()) {
+			for (int cpu : all->second) {
+				if (cpu >= (int)pool->cpu_node.size())
+					pool->cpu_node.resize(cpu + 1, -1);
+				pool->cpu_node[cpu] = index;
+			}
+		}
+		++index;
+	}
+	/* CPUs in the order of filling the nodes evenly. */
+	std::vector<std::pair<int, int>> order;
+	for (size_t round = 0; order.size() < cpus.size(); ++round) {
+		for (int i = 0; i < pool->node_count; ++i) {
+			if (round < pool->nodes[i].cpus.size())
+				order.push_back({pool->nodes[i].cpus[round], i});
+		}
+	}
+	for (int i = 0; i < pool->max_threads; ++i) {
+		thread_worker *w = &pool->workers[i];
+		w->cpu = order[i % order.size()].first;
+		w->node = order[i % order.size()].second;
+		pool->nodes[w->node].slots.push_back(i);
+	}
+	pool->is_numa = opts->numa_aware;
+	if (opts->pin_per_cpu)
+		pool->affinity = AFFINITY_CPU;
+	else if (opts->numa_aware)
+		pool->affinity = AFFINITY_NODE;
+	else
+		pool->affinity = AFFINITY_SET;
+}
 
-		pthread_mutex_lock(&task->mutex);
-		task->state = TASK_STATE_RUNNING;
-		pthread_mutex_unlock(&task->mutex);
+int
+thread_pool_new_ex(const struct thread_pool_options *opts,
+		   struct thread_pool **pool)
+{
+	if (pool == nullptr || opts == nullptr)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	int thread_count = opts->thread_count;
+	if (thread_count <= 0 || thread_count > TPOOL_THREADS_LIMIT ||
+	    opts->min_threads < 0 || opts->min_threads > thread_count ||
+	    opts->spin_count < 0 || opts->yield_count < 0 ||
+	    !(opts->idle_timeout >= 0) || opts->grow_backlog < 0 ||
+	    !(opts->grow_delay >= 0) || opts->trace_size < 0)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	bool is_placed = opts->cpus != nullptr || opts->pin_per_cpu ||
+			 opts->numa_aware;
+	std::vector<int> cpus;
+	if (is_placed && !thread_pool_options_cpus(opts, &cpus))
+		return TPOOL_ERR_INVALID_ARGUMENT;
 
-		task->function();
+	auto *result = new thread_pool();
+	result->max_threads = thread_count;
+	result->min_threads = opts->min_threads;
+	result->spin_count = opts->spin_count;
+	result->yield_count = opts->yield_count;
+	result->idle_timeout = opts->idle_timeout;
+	result->grow_backlog = opts->grow_backlog;
+	result->grow_delay = opts->grow_delay;
+	result->track_wait = opts->track_wait;
+	result->track_run = opts->track_run;
+	result->trace_size = opts->trace_size;
+	result->trace_epoch = clock_monotonic_ns();
+	/* The deques are created with the first start of their slot. */
+	result->workers = new thread_worker[thread_count];
+	for (int i = 0; i < thread_count; ++i) {
+		thread_worker *w = &result->workers[i];
+		w->pool = result;
+		w->id = i;
+		w->rand_state = i + 1;
+		pthread_mutex_init(&w->trace_mutex, nullptr);
+	}
+	if (is_placed) {
+		thread_pool_place(result, opts, cpus);
+	} else {
+		result->node_count = 1;
+		result->nodes = new pool_node[1];
+	}
+	for (int i = 0; i < result->node_count; ++i) {
+		injection_create(&result->nodes[i].injection);
+		pthread_mutex_init(&result->nodes[i].task_depot_mutex, nullptr);
+	}
+	for (int i = 0; i < TPOOL_PRIORITY_COUNT; ++i)
+		class_queue_create(&result->classes[i]);
+	pthread_mutex_init(&result->mutex, nullptr);
+	thread_pool_cond_create(&result->cond);
+	thread_pool_cond_create(&result->monitor_cond);
 
-		bool should_auto_delete = false;
-		pthread_mutex_lock(&task->mutex);
-		task->state = TASK_STATE_FINISHED;
-		if (task->is_detached && task->is_pushed &&
-		    task->join_waiters == 0 && !task->is_joined) {
-			task->is_pushed = false;
-			task->pool = nullptr;
-			should_auto_delete = true;
-		}
-		pthread_cond_broadcast(&task->cond);
-		pthread_mutex_unlock(&task->mutex);
+	pthread_mutex_lock(&result->mutex);
+	/* If some can't be started now, they are started on demand. */
+	for (int i = 0; i < result->min_threads; ++i) {
+		if (!thread_pool_start_worker_locked(result))
+			break;
+	}
+	pthread_mutex_unlock(&result->mutex);
+	if (result->grow_delay > 0) {
+		result->has_monitor = pthread_create(&result->monitor_tid,
+						     nullptr,
+						     thread_pool_monitor,
+						     result) == 0;
+	}
+	*pool = result;
+	return 0;
+}
 
-		if (should_auto_delete) {
-			thread_pool_task_done(pool);
-			pthread_cond_destroy(&task->cond);
-			pthread_mutex_destroy(&task->mutex);
-			delete task;
-		}
+/** Add the times of a worker to @a stats. */
+static void
+wait_stats_sum(struct thread_pool_wait_stats *stats,
+	       const worker_wait_stats *w)
+{
+	stats->count += w->count.load(std::memory_order_relaxed);
+	stats->total_ns += w->total_ns.load(std::memory_order_relaxed);
+	uint64_t max_ns = w->max_ns.load(std::memory_order_relaxed);
+	if (max_ns > stats->max_ns)
+		stats->max_ns = max_ns;
+	stats->late += w->late.load(std::memory_order_relaxed);
+	stats->dropped += w->dropped.load(std::memory_order_relaxed);
+	for (int i = 0; i < TPOOL_WAIT_BUCKETS; ++i)
+		stats->histogram[i] += w->histogram[i].load(
+			std::memory_order_relaxed);
+}
 
-		pthread_mutex_lock(&pool->mutex);
+int
+thread_pool_get_stats(const struct thread_pool *pool,
+		      struct thread_pool_stats *stats)
+{
+	if (pool == nullptr || stats == nullptr)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	memset(stats, 0, sizeof(*stats));
+	for (int i = 0; i < pool->max_threads; ++i) {
+		const thread_worker *w = &pool->workers[i];
+		stats->spins += w->spins.load(std::memory_order_relaxed);
+		stats->yields += w->yields.load(std::memory_order_relaxed);
+		stats->parks += w->parks.load(std::memory_order_relaxed);
+		stats->pushed += w->pushed.load(std::memory_order_relaxed);
+		stats->completed += w->completed.load(std::memory_order_relaxed);
+		stats->steals += w->steals.load(std::memory_order_relaxed);
+		stats->busy_ns += w->busy_ns.load(std::memory_order_relaxed);
+		stats->idle_ns += w->idle_ns.load(std::memory_order_relaxed);
+		for (int j = 0; j < TPOOL_PRIORITY_COUNT; ++j)
+			wait_stats_sum(&stats->wait, &w->wait[j]);
+		wait_stats_sum(&stats->run, &w->run);
 	}
+	stats->wakeups = pool->wakeups.load(std::memory_order_relaxed);
+	stats->threads = pool->running_threads.load(std::memory_order_relaxed);
+	stats->thread_starts =
+		pool->thread_starts.load(std::memory_order_relaxed);
+	stats->thread_retires =
+		pool->thread_retires.load(std::memory_order_relaxed);
+	stats->pushed += pool->tasks_pushed.load(std::memory_order_relaxed);
+	stats->detached = pool->tasks_detached.load(std::memory_order_relaxed);
+	stats->queued = thread_pool_backlog(pool);
+	stats->pending = pool->tasks_in_pool.load(std::memory_order_relaxed);
+	stats->pending_max =
+		pool->tasks_in_pool_max.load(std::memory_order_relaxed);
+	return 0;
 }
 
-static int
-thread_pool_maybe_start_worker_locked(struct thread_pool *pool)
+int
+thread_pool_get_wait_stats(const struct thread_pool *pool,
+			   enum thread_task_priority priority,
+			   struct thread_pool_wait_stats *stats)
 {
-	if (pool->threads.size() >= static_cast<size_t>(pool->max_threads))
-		return 0;
-	if (pool->waiting_threads > 0)
-		return 0;
-	pthread_t tid;
-	int rc = pthread_create(&tid, nullptr, thread_pool_worker, pool);
-	if (rc != 0)
-		return rc;
-	pool->threads.push_back(tid);
+	if (pool == nullptr || stats == nullptr || priority < 0 ||
+	    priority >= TPOOL_PRIORITY_COUNT)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	memset(stats, 0, sizeof(*stats));
+	for (int i = 0; i < pool->max_threads; ++i)
+		wait_stats_sum(stats, &pool->workers[i].wait[priority]);
 	return 0;
 }
 
-static void
-timespec_add_seconds(struct timespec *ts, double seconds)
+uint64_t
+thread_pool_wait_stats_quantile(const struct thread_pool_wait_stats *stats,
+				double quantile)
 {
-	if (seconds <= 0)
-		return;
-	double integral = 0;
-	double fractional = std::modf(seconds, &integral);
-	ts->tv_sec += static_cast<time_t>(integral);
-	long add_nsec = static_cast<long>(fractional * 1000000000.0);
-	ts->tv_nsec += add_nsec;
-	if (ts->tv_nsec >= 1000000000L) {
-		++ts->tv_sec;
-		ts->tv_nsec -= 1000000000L;
+	uint64_t total = 0;
+	for (int i = 0; i < TPOOL_WAIT_BUCKETS; ++i)
+		total += stats->histogram[i];
+	if (total == 0)
+		return 0;
+	double target = std::ceil(quantile * total);
+	uint64_t sum = 0;
+	for (int i = 0; i < TPOOL_WAIT_BUCKETS - 1; ++i) {
+		sum += stats->histogram[i];
+		if (sum >= target)
+			return (uint64_t)1 << (i + 1);
 	}
+	return stats->max_ns;
 }
 
 int
-thread_pool_new(int thread_count, struct thread_pool **pool)
+thread_pool_write_trace(struct thread_pool *pool, FILE *out)
 {
-	if (pool == nullptr || thread_count <= 0 ||
-	    thread_count > TPOOL_MAX_THREADS)
+	if (pool == nullptr || out == nullptr || pool->trace_size == 0)
 		return TPOOL_ERR_INVALID_ARGUMENT;
+	static const char *priority_names[TPOOL_PRIORITY_COUNT] = {
+		"high", "normal", "low",
+	};
+	fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+		"{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+		"\"args\":{\"name\":\"thread_pool\"}}");
+	std::vector<trace_event> events;
+	int count = pool->thread_count.load(std::memory_order_acquire);
+	for (int i = 0; i < count; ++i) {
+		thread_worker *w = &pool->workers[i];
+		/* Copied, not to stall the worker with the output. */
+		pthread_mutex_lock(&w->trace_mutex);
+		uint64_t size = w->trace.size();
+		uint64_t first = w->trace_count > size ?
+				 w->trace_count - size : 0;
+		events.clear();
+		for (uint64_t j = first; j < w->trace_count; ++j)
+			events.push_back(w->trace[j % size]);
+		pthread_mutex_unlock(&w->trace_mutex);
 
-	auto *result = new thread_pool();
-	result->max_threads = thread_count;
-	pthread_mutex_init(&result->mutex, nullptr);
-	pthread_cond_init(&result->cond, nullptr);
-	*pool = result;
+		fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\","
+			"\"pid\":1,\"tid\":%d,\"args\":{\"name\":"
+			"\"worker %d\"}}", i, i);
+		for (const trace_event &e : events) {
+			uint64_t wait = e.start > e.queue_time ?
+					e.start - e.queue_time : 0;
+			fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"%s\","
+				"\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+				"\"ts\":%.3f,\"dur\":%.3f,\"args\":{"
+				"\"task\":\"%p\",\"wait_us\":%.3f,"
+				"\"late\":%s}}",
+				e.is_dropped ? "dropped" : "task",
+				priority_names[e.priority], i,
+				(e.start - pool->trace_epoch) / 1000.0,
+				(e.end - e.start) / 1000.0,
+				reinterpret_cast<void*>(e.task), wait / 1000.0,
+				e.is_late ? "true" : "false");
+		}
+	}
+	fprintf(out, "\n]}\n");
 	return 0;
 }
 
@@ -146,78 +1849,262 @@ thread_pool_delete(struct thread_pool *pool)
 	if (pool == nullptr)
 		return TPOOL_ERR_INVALID_ARGUMENT;
 
-	pthread_mutex_lock(&pool->mutex);
-	if (pool->tasks_in_pool != 0) {
-		pthread_mutex_unlock(&pool->mutex);
+	if (pool->tasks_in_pool.load(std::memory_order_acquire) != 0 ||
+	    pool->tasks_allocated.load(std::memory_order_acquire) != 0)
 		return TPOOL_ERR_HAS_TASKS;
-	}
-	pool->is_stopping = true;
+	pthread_mutex_lock(&pool->mutex);
+	pool->is_stopping.store(true, std::memory_order_relaxed);
 	pthread_cond_broadcast(&pool->cond);
+	pthread_cond_signal(&pool->monitor_cond);
 	pthread_mutex_unlock(&pool->mutex);
 
-	for (pthread_t tid : pool->threads)
-		pthread_join(tid, nullptr);
+	if (pool->has_monitor)
+		pthread_join(pool->monitor_tid, nullptr);
+	/* No more starts, the monitor was the last one to start them. */
+	int thread_count = pool->thread_count.load(std::memory_order_acquire);
+	for (int i = 0; i < thread_count; ++i) {
+		thread_worker *w = &pool->workers[i];
+		if (w->state != WORKER_FREE)
+			pthread_join(w->tid, nullptr);
+		ws_deque_destroy(&w->deque);
+		pthread_mutex_destroy(&w->trace_mutex);
+		task_list_destroy(w->task_cache);
+	}
+	delete[] pool->workers;
+	for (int i = 0; i < pool->node_count; ++i) {
+		pool_node *node = &pool->nodes[i];
+		task_list_destroy(node->task_depot);
+		for (void *slab : node->slabs)
+			munmap(slab, TASK_SLAB_SIZE);
+		pthread_mutex_destroy(&node->task_depot_mutex);
+		injection_destroy(&node->injection);
+	}
+	delete[] pool->nodes;
 
+	pthread_cond_destroy(&pool->monitor_cond);
 	pthread_cond_destroy(&pool->cond);
 	pthread_mutex_destroy(&pool->mutex);
+	for (int i = 0; i < TPOOL_PRIORITY_COUNT; ++i)
+		class_queue_destroy(&pool->classes[i]);
 	delete pool;
 	return 0;
 }
 
+/** Account the tasks in the pool, before they are queued. */
+static int
+thread_pool_reserve(struct thread_pool *pool, struct thread_task *const *tasks,
+		    int count)
+{
+	if (pool->is_stopping.load(std::memory_order_relaxed))
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	size_t old = pool->tasks_in_pool.fetch_add(count,
+						   std::memory_order_relaxed);
+	if (old + count > TPOOL_MAX_TASKS) {
+		pool->tasks_in_pool.fetch_sub(count, std::memory_order_relaxed);
+		return TPOOL_ERR_TOO_MANY_TASKS;
+	}
+	thread_worker *w = current_worker;
+	if (w != nullptr && w->pool == pool)
+		counter_bump(&w->pushed, count);
+	else
+		pool->tasks_pushed.fetch_add(count, std::memory_order_relaxed);
+	size_t max = pool->tasks_in_pool_max.load(std::memory_order_relaxed);
+	while (old + count > max &&
+	       !pool->tasks_in_pool_max.compare_exchange_weak(
+			max, old + count, std::memory_order_relaxed))
+		;
+
+	/* Published to the workers by the queue push. */
+	uint64_t now = 0;
+	for (int i = 0; i < count; ++i) {
+		tasks[i]->deadline = 0;
+		if (tasks[i]->timeout > 0) {
+			if (now == 0)
+				now = clock_monotonic_ns();
+			tasks[i]->deadline = now + (uint64_t)(tasks[i]->timeout *
+							      1000000000.0);
+		}
+		tasks[i]->pool = pool;
+		tasks[i]->successors.store(nullptr, std::memory_order_relaxed);
+		tasks[i]->state.store(TASK_STATE_QUEUED,
+				      std::memory_order_relaxed);
+	}
+	return 0;
+}
+
+/** Queue normal tasks without a deadline. */
+static void
+thread_pool_enqueue_plain(struct thread_pool *pool,
+			  struct thread_task *const *tasks, int count)
+{
+	/* Tasks spawned by a task stay in its worker, if not stolen. */
+	thread_worker *w = current_worker;
+	if (w != nullptr && w->pool == pool)
+		ws_deque_push(&w->deque, tasks, count);
+	else
+		injection_push(&pool->nodes[thread_pool_current_node(pool)].
+			       injection, tasks, count,
+			       pool->grow_delay > 0 ? clock_monotonic_ns() : 0);
+}
+
+static void
+thread_pool_enqueue(struct thread_pool *pool, struct thread_task *const *tasks,
+		    int count)
+{
+	if (pool->track_wait || pool->trace_size > 0) {
+		uint64_t now = clock_monotonic_ns();
+		for (int i = 0; i < count; ++i)
+			tasks[i]->queue_time = now;
+	}
+	int plain = 0;
+	while (plain < count && task_is_plain(tasks[plain]))
+		++plain;
+	if (plain > 0)
+		thread_pool_enqueue_plain(pool, tasks, plain);
+	if (plain < count) {
+		for (int i = plain + 1; i < count; ++i) {
+			if (task_is_plain(tasks[i]))
+				thread_pool_enqueue_plain(pool, &tasks[i], 1);
+		}
+		for (int i = 0; i < TPOOL_PRIORITY_COUNT; ++i) {
+			class_queue_push(&pool->classes[i], tasks + plain,
+					 count - plain, i);
+		}
+	}
+	thread_pool_wakeup(pool, count);
+}
+
+static int
+thread_pool_push(struct thread_pool *pool, struct thread_task *const *tasks,
+		 int count)
+{
+	int rc = thread_pool_reserve(pool, tasks, count);
+	if (rc != 0)
+		return rc;
+	thread_pool_enqueue(pool, tasks, count);
+	return 0;
+}
+
+/**
+ * Push a task to be queued when @a wait_count of the dependencies are
+ * finished.
+ */
+static int
+thread_pool_push_deps(struct thread_pool *pool, struct thread_task *task,
+		      struct thread_task **deps, int dep_count, int wait_count)
+{
+	for (int i = 0; i < dep_count; ++i) {
+		if (deps[i] == nullptr)
+			return TPOOL_ERR_INVALID_ARGUMENT;
+		uint32_t state = deps[i]->state.load(std::memory_order_acquire);
+		if ((state & TASK_STATE_MASK) == TASK_STATE_NEW)
+			return TPOOL_ERR_TASK_NOT_PUSHED;
+	}
+	int rc = thread_pool_reserve(pool, &task, 1);
+	if (rc != 0)
+		return rc;
+	if (wait_count == 0) {
+		thread_pool_enqueue(pool, &task, 1);
+		return 0;
+	}
+	task_deps *d = new task_deps();
+	d->task = task;
+	d->pool = pool;
+	d->remaining.store(wait_count + 1, std::memory_order_relaxed);
+	d->refs.store(dep_count + 1, std::memory_order_relaxed);
+	d->edges = new task_edge[dep_count];
+	for (int i = 0; i < dep_count; ++i) {
+		d->edges[i].deps = d;
+		if (!task_add_successor(deps[i], &d->edges[i]))
+			task_deps_release(d);
+	}
+	task_deps_release(d);
+	return 0;
+}
+
 int
 thread_pool_push_task(struct thread_pool *pool, struct thread_task *task)
 {
 	if (pool == nullptr || task == nullptr)
 		return TPOOL_ERR_INVALID_ARGUMENT;
+	return thread_pool_push(pool, &task, 1);
+}
 
-	pthread_mutex_lock(&pool->mutex);
-	if (pool->is_stopping) {
-		pthread_mutex_unlock(&pool->mutex);
+int
+thread_pool_push_after(struct thread_pool *pool, struct thread_task *task,
+		       struct thread_task **deps, int dep_count)
+{
+	if (pool == nullptr || task == nullptr || dep_count < 0 ||
+	    (deps == nullptr && dep_count != 0))
 		return TPOOL_ERR_INVALID_ARGUMENT;
-	}
-	if (pool->tasks_in_pool >= TPOOL_MAX_TASKS) {
-		pthread_mutex_unlock(&pool->mutex);
-		return TPOOL_ERR_TOO_MANY_TASKS;
-	}
+	return thread_pool_push_deps(pool, task, deps, dep_count, dep_count);
+}
 
-	pthread_mutex_lock(&task->mutex);
-	task->pool = pool;
-	task->state = TASK_STATE_QUEUED;
-	task->is_pushed = true;
-	task->is_detached = false;
-	task->is_joined = false;
-	task->join_waiters = 0;
-	pthread_mutex_unlock(&task->mutex);
+int
+thread_pool_push_after_any(struct thread_pool *pool, struct thread_task *task,
+			   struct thread_task **deps, int dep_count)
+{
+	if (pool == nullptr || task == nullptr || deps == nullptr ||
+	    dep_count <= 0)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	return thread_pool_push_deps(pool, task, deps, dep_count, 1);
+}
 
-	pool->queue.push_back(task);
-	++pool->tasks_in_pool;
-	thread_pool_maybe_start_worker_locked(pool);
-	pthread_cond_signal(&pool->cond);
-	pthread_mutex_unlock(&pool->mutex);
-	return 0;
+int
+thread_pool_push_tasks(struct thread_pool *pool, struct thread_task **tasks,
+		       int count)
+{
+	if (pool == nullptr || (tasks == nullptr && count != 0) || count < 0)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	for (int i = 0; i < count; ++i) {
+		if (tasks[i] == nullptr)
+			return TPOOL_ERR_INVALID_ARGUMENT;
+	}
+	if (count == 0)
+		return 0;
+	return thread_pool_push(pool, tasks, count);
 }
 
 int
-thread_task_new(struct thread_task **task, const thread_task_f &function)
+thread_task_new(struct thread_task **task, thread_task_f &&function)
 {
 	auto *result = new thread_task();
-	result->function = function;
-	pthread_mutex_init(&result->mutex, nullptr);
-	pthread_cond_init(&result->cond, nullptr);
+	result->function = std::move(function);
+	*task = result;
+	return 0;
+}
+
+int
+thread_pool_task_new(struct thread_pool *pool, struct thread_task **task,
+		     thread_task_f &&function)
+{
+	if (pool == nullptr || task == nullptr)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	pool->tasks_allocated.fetch_add(1, std::memory_order_relaxed);
+	thread_task *result = task_cache_get(pool);
+	result->function = std::move(function);
+	result->state.store(TASK_STATE_NEW, std::memory_order_relaxed);
+	result->pool = nullptr;
+	result->owner = pool;
+	result->priority = TPOOL_PRIORITY_NORMAL;
+	result->deadline_policy = TPOOL_DEADLINE_FLAG;
+	result->timeout = 0;
 	*task = result;
 	return 0;
 }
 
+static uint32_t
+thread_task_phase(const struct thread_task *task)
+{
+	return task->state.load(std::memory_order_acquire) & TASK_STATE_MASK;
+}
+
 bool
 thread_task_is_finished(const struct thread_task *task)
 {
 	if (task == nullptr)
 		return false;
-	auto *mutable_task = const_cast<thread_task*>(task);
-	pthread_mutex_lock(&mutable_task->mutex);
-	bool is_finished = mutable_task->is_joined;
-	pthread_mutex_unlock(&mutable_task->mutex);
-	return is_finished;
+	return thread_task_phase(task) == TASK_STATE_JOINED;
 }
 
 bool
@@ -225,50 +2112,106 @@ thread_task_is_running(const struct thread_task *task)
 {
 	if (task == nullptr)
 		return false;
-	auto *mutable_task = const_cast<thread_task*>(task);
-	pthread_mutex_lock(&mutable_task->mutex);
-	bool is_running = mutable_task->state == TASK_STATE_RUNNING;
-	pthread_mutex_unlock(&mutable_task->mutex);
-	return is_running;
+	return thread_task_phase(task) == TASK_STATE_RUNNING;
+}
+
+/** The task settings can be changed only out of a pool. */
+static bool
+thread_task_is_in_pool(const struct thread_task *task)
+{
+	uint32_t phase = thread_task_phase(task);
+	return phase != TASK_STATE_NEW && phase != TASK_STATE_JOINED;
 }
 
 int
-thread_task_join(struct thread_task *task)
+thread_task_set_priority(struct thread_task *task,
+			 enum thread_task_priority priority)
 {
-	if (task == nullptr)
+	if (task == nullptr || priority < 0 ||
+	    priority >= TPOOL_PRIORITY_COUNT)
 		return TPOOL_ERR_INVALID_ARGUMENT;
+	if (thread_task_is_in_pool(task))
+		return TPOOL_ERR_TASK_IN_POOL;
+	task->priority = priority;
+	return 0;
+}
 
-	thread_pool *pool = nullptr;
-	pthread_mutex_lock(&task->mutex);
-	if (task->is_joined) {
-		pthread_mutex_unlock(&task->mutex);
-		return 0;
-	}
-	if (!task->is_pushed) {
-		pthread_mutex_unlock(&task->mutex);
-		return TPOOL_ERR_TASK_NOT_PUSHED;
-	}
-	++task->join_waiters;
-	while (task->is_pushed && task->state != TASK_STATE_FINISHED)
-		pthread_cond_wait(&task->cond, &task->mutex);
-	--task->join_waiters;
-	if (task->is_joined) {
-		pthread_mutex_unlock(&task->mutex);
-		return 0;
-	}
-	if (!task->is_pushed) {
-		pthread_mutex_unlock(&task->mutex);
-		return TPOOL_ERR_TASK_NOT_PUSHED;
+int
+thread_task_set_deadline(struct thread_task *task, double timeout,
+			 enum thread_task_deadline_policy policy)
+{
+	if (task == nullptr || !(timeout >= 0 && timeout <= 100000000.0) ||
+	    (policy != TPOOL_DEADLINE_FLAG && policy != TPOOL_DEADLINE_DROP))
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	if (thread_task_is_in_pool(task))
+		return TPOOL_ERR_TASK_IN_POOL;
+	task->timeout = timeout;
+	task->deadline_policy = policy;
+	return 0;
+}
+
+bool
+thread_task_is_late(const struct thread_task *task)
+{
+	if (task == nullptr)
+		return false;
+	return (task->state.load(std::memory_order_acquire) &
+		TASK_FLAG_LATE) != 0;
+}
+
+/**
+ * Join the task, waiting not longer than until the absolute
+ * CLOCK_MONOTONIC @a deadline. NULL means no limit.
+ */
+static int
+thread_task_join_until(struct thread_task *task,
+		       const struct timespec *deadline)
+{
+	bool is_expired = false;
+	uint32_t state = task->state.load(std::memory_order_acquire);
+	while (true) {
+		switch (state & TASK_STATE_MASK) {
+		case TASK_STATE_JOINED:
+			return 0;
+		case TASK_STATE_NEW:
+			return TPOOL_ERR_TASK_NOT_PUSHED;
+		case TASK_STATE_FINISHED: {
+			thread_pool *pool = task->pool;
+			/*
+			 * Concurrent joiners, only one of them wins. The
+			 * late flag stays for thread_task_is_late().
+			 */
+			if (!task->state.compare_exchange_weak(
+				state, TASK_STATE_JOINED |
+				(state & TASK_FLAG_LATE),
+				std::memory_order_acquire))
+				continue;
+			thread_pool_task_done(pool);
+			return 0;
+		}
+		default:
+			break;
+		}
+		if (is_expired)
+			return TPOOL_ERR_TIMEOUT;
+		if ((state & TASK_FLAG_WAITERS) == 0) {
+			if (!task->state.compare_exchange_weak(
+				state, state | TASK_FLAG_WAITERS,
+				std::memory_order_acquire))
+				continue;
+			state |= TASK_FLAG_WAITERS;
+		}
+		is_expired = !futex_wait(&task->state, state, deadline);
+		state = task->state.load(std::memory_order_acquire);
 	}
-	pool = task->pool;
-	task->is_pushed = false;
-	task->pool = nullptr;
-	task->is_detached = false;
-	task->is_joined = true;
-	pthread_mutex_unlock(&task->mutex);
+}
 
-	thread_pool_task_done(pool);
-	return 0;
+int
+thread_task_join(struct thread_task *task)
+{
+	if (task == nullptr)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	return thread_task_join_until(task, nullptr);
 }
 
 #if NEED_TIMED_JOIN
@@ -282,53 +2225,10 @@ thread_task_timed_join(struct thread_task *task, double timeout)
 	if (!std::isfinite(timeout) || timeout > 100000000.0)
 		return thread_task_join(task);
 
-	thread_pool *pool = nullptr;
-	pthread_mutex_lock(&task->mutex);
-	if (task->is_joined) {
-		pthread_mutex_unlock(&task->mutex);
-		return 0;
-	}
-	if (!task->is_pushed) {
-		pthread_mutex_unlock(&task->mutex);
-		return TPOOL_ERR_TASK_NOT_PUSHED;
-	}
-	if (timeout <= 0 && task->state != TASK_STATE_FINISHED) {
-		pthread_mutex_unlock(&task->mutex);
-		return TPOOL_ERR_TIMEOUT;
-	}
-	++task->join_waiters;
-	if (task->state != TASK_STATE_FINISHED) {
-		struct timespec deadline;
-		clock_gettime(CLOCK_REALTIME, &deadline);
-		timespec_add_seconds(&deadline, timeout);
-		while (task->is_pushed && task->state != TASK_STATE_FINISHED) {
-			int rc = pthread_cond_timedwait(&task->cond, &task->mutex,
-							&deadline);
-			if (rc == ETIMEDOUT && task->state != TASK_STATE_FINISHED) {
-				--task->join_waiters;
-				pthread_mutex_unlock(&task->mutex);
-				return TPOOL_ERR_TIMEOUT;
-			}
-		}
-	}
-	--task->join_waiters;
-	if (task->is_joined) {
-		pthread_mutex_unlock(&task->mutex);
-		return 0;
-	}
-	if (!task->is_pushed) {
-		pthread_mutex_unlock(&task->mutex);
-		return TPOOL_ERR_TASK_NOT_PUSHED;
-	}
-	pool = task->pool;
-	task->is_pushed = false;
-	task->pool = nullptr;
-	task->is_detached = false;
-	task->is_joined = true;
-	pthread_mutex_unlock(&task->mutex);
-
-	thread_pool_task_done(pool);
-	return 0;
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	timespec_add_seconds(&deadline, timeout);
+	return thread_task_join_until(task, &deadline);
 }
 
 #endif
@@ -339,14 +2239,9 @@ thread_task_delete(struct thread_task *task)
 	if (task == nullptr)
 		return TPOOL_ERR_INVALID_ARGUMENT;
 
-	pthread_mutex_lock(&task->mutex);
-	bool is_pushed = task->is_pushed;
-	pthread_mutex_unlock(&task->mutex);
-	if (is_pushed)
+	if (thread_task_is_in_pool(task))
 		return TPOOL_ERR_TASK_IN_POOL;
-	pthread_cond_destroy(&task->cond);
-	pthread_mutex_destroy(&task->mutex);
-	delete task;
+	thread_task_free(task);
 	return 0;
 }
 
@@ -358,35 +2253,172 @@ thread_task_detach(struct thread_task *task)
 	if (task == nullptr)
 		return TPOOL_ERR_INVALID_ARGUMENT;
 
-	thread_pool *pool = nullptr;
-	bool should_delete_now = false;
-
-	pthread_mutex_lock(&task->mutex);
-	if (task->is_joined) {
-		pthread_mutex_unlock(&task->mutex);
+	uint32_t phase = thread_task_phase(task);
+	if (phase == TASK_STATE_JOINED)
 		return 0;
-	}
-	if (!task->is_pushed) {
-		pthread_mutex_unlock(&task->mutex);
+	if (phase == TASK_STATE_NEW)
 		return TPOOL_ERR_TASK_NOT_PUSHED;
+	thread_pool *pool = task->pool;
+	/*
+	 * Either the worker sees the flag when finishes the task and
+	 * deletes it, or the task is finished already and is deleted
+	 * here.
+	 */
+	pool->tasks_detached.fetch_add(1, std::memory_order_relaxed);
+	uint32_t old = task->state.fetch_or(TASK_FLAG_DETACHED,
+					    std::memory_order_acq_rel);
+	if ((old & TASK_STATE_MASK) == TASK_STATE_FINISHED)
+		thread_task_delete_now(task, pool);
+	return 0;
+}
+
+#endif
+
+/** A running tpool_parallel_for_ranges(). */
+struct parallel_for_ctx {
+	struct thread_pool *pool;
+	tpool_range_f fn;
+	void *arg;
+	size_t grain;
+	/** Indexes not processed yet. */
+	std::atomic<size_t> remaining;
+	/** Futex word, set when nothing remains. */
+	std::atomic<uint32_t> is_done;
+	/**
+	 * Spawned tasks done with their ranges, linked via next_free. The
+	 * next spawn deletes them, so the pool holds only the tasks in
+	 * work, not all of them until the end.
+	 */
+	std::atomic<thread_task*> finished;
+	/** Spawned tasks not deleted yet. */
+	std::atomic<size_t> live_tasks;
+};
+
+static void
+parallel_for_run(parallel_for_ctx *ctx, size_t begin, size_t end);
+
+/**
+ * Delete the finished tasks. They are done with their ranges, the
+ * joins only wait for the workers to mark them finished.
+ */
+static void
+parallel_for_reclaim(parallel_for_ctx *ctx)
+{
+	if (ctx->finished.load(std::memory_order_relaxed) == nullptr)
+		return;
+	thread_task *task = ctx->finished.exchange(nullptr,
+						   std::memory_order_acquire);
+	while (task != nullptr) {
+		thread_task *next = task->next_free;
+		thread_task_join(task);
+		thread_task_delete(task);
+		ctx->live_tasks.fetch_sub(1, std::memory_order_relaxed);
+		task = next;
+	}
+}
+
+static bool
+parallel_for_spawn(parallel_for_ctx *ctx, size_t begin, size_t end)
+{
+	parallel_for_reclaim(ctx);
+	thread_task *task;
+	if (thread_pool_task_new(ctx->pool, &task, thread_task_f()) != 0)
+		return false;
+	/* Set afterwards, to know the task. */
+	task->function = [ctx, begin, end, task]() {
+		parallel_for_run(ctx, begin, end);
+		/*
+		 * The last touch of ctx by the task. The link is not used
+		 * until the task is deleted.
+		 */
+		thread_task *head = ctx->finished.load(
+			std::memory_order_relaxed);
+		do {
+			task->next_free = head;
+		} while (!ctx->finished.compare_exchange_weak(
+			head, task, std::memory_order_release,
+			std::memory_order_relaxed));
+	};
+	ctx->live_tasks.fetch_add(1, std::memory_order_relaxed);
+	if (thread_pool_push_task(ctx->pool, task) != 0) {
+		ctx->live_tasks.fetch_sub(1, std::memory_order_relaxed);
+		thread_task_delete(task);
+		return false;
 	}
-	task->is_detached = true;
-	if (task->state == TASK_STATE_FINISHED &&
-	    task->join_waiters == 0 && !task->is_joined) {
-		pool = task->pool;
-		task->is_pushed = false;
-		task->pool = nullptr;
-		should_delete_now = true;
+	return true;
+}
+
+/**
+ * Split the range in halves until the grain, leaving the upper halves
+ * to the other workers. The biggest ones are at the top of the deque,
+ * where the thieves take from.
+ */
+static void
+parallel_for_run(parallel_for_ctx *ctx, size_t begin, size_t end)
+{
+	while (end - begin > ctx->grain) {
+		size_t mid = begin + (end - begin) / 2;
+		/* On failure to push the rest is done right here. */
+		if (!parallel_for_spawn(ctx, mid, end))
+			break;
+		end = mid;
 	}
-	pthread_mutex_unlock(&task->mutex);
+	ctx->fn(ctx->arg, begin, end);
+	size_t count = end - begin;
+	if (ctx->remaining.fetch_sub(count, std::memory_order_acq_rel) ==
+	    count) {
+		/* ctx is alive until the waiter deletes this task. */
+		ctx->is_done.store(1, std::memory_order_release);
+		futex_wake_all(&ctx->is_done);
+	}
+}
 
-	if (should_delete_now) {
-		thread_pool_task_done(pool);
-		pthread_cond_destroy(&task->cond);
-		pthread_mutex_destroy(&task->mutex);
-		delete task;
+int
+tpool_parallel_for_ranges(struct thread_pool *pool, size_t begin, size_t end,
+			  size_t grain, tpool_range_f fn, void *arg)
+{
+	if (pool == nullptr || fn == nullptr)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	if (begin >= end)
+		return 0;
+	parallel_for_ctx ctx;
+	ctx.pool = pool;
+	ctx.fn = fn;
+	ctx.arg = arg;
+	ctx.grain = grain != 0 ? grain : 1;
+	ctx.remaining.store(end - begin, std::memory_order_relaxed);
+	ctx.is_done.store(0, std::memory_order_relaxed);
+	ctx.finished.store(nullptr, std::memory_order_relaxed);
+	ctx.live_tasks.store(0, std::memory_order_relaxed);
+	/* The caller does its share too. */
+	parallel_for_run(&ctx, begin, end);
+	thread_worker *w = current_worker;
+	if (w != nullptr && w->pool == pool) {
+		/*
+		 * A worker can't sleep, the pool might have no other
+		 * threads to finish the work. It runs the other tasks
+		 * meanwhile, likely its own ranges.
+		 */
+		while (ctx.remaining.load(std::memory_order_acquire) != 0) {
+			thread_task *task = thread_worker_find_task(w);
+			if (task != nullptr)
+				thread_worker_run(w, task);
+			else
+				sched_yield();
+		}
+	} else {
+		while (ctx.is_done.load(std::memory_order_acquire) == 0)
+			futex_wait(&ctx.is_done, 0, nullptr);
+	}
+	/*
+	 * All the ranges are done, so the spawns too, and the rest of the
+	 * tasks are about to put themselves into the finished list.
+	 */
+	while (true) {
+		parallel_for_reclaim(&ctx);
+		if (ctx.live_tasks.load(std::memory_order_relaxed) == 0)
+			break;
+		sched_yield();
 	}
 	return 0;
 }
-
-#endif
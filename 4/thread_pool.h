@@ -1,7 +1,13 @@
 #pragma once
 
-#include <functional>
+#include <new>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <type_traits>
+#include <utility>
 
 /**
  * Here you should specify which features do you want to implement via macros:
@@ -22,10 +28,155 @@
 struct thread_pool;
 struct thread_task;
 
-using thread_task_f = std::function<void(void)>;
+/**
+ * Function of a task. It is like std::function<void(void)>, but is
+ * move-only, and a callable of up to THREAD_TASK_F_INLINE_SIZE bytes
+ * is stored inline, without a heap allocation. Bigger ones are moved
+ * to the heap.
+ */
+struct thread_task_f {
+	enum { THREAD_TASK_F_INLINE_SIZE = 64 };
+
+	thread_task_f() = default;
+
+	template<typename F, typename = typename std::enable_if<
+		!std::is_same<typename std::decay<F>::type,
+			      thread_task_f>::value>::type>
+	thread_task_f(F &&f)
+	{
+		using T = typename std::decay<F>::type;
+		if constexpr (is_inline<T>()) {
+			new (buf) T(std::forward<F>(f));
+		} else {
+			T *heap = new T(std::forward<F>(f));
+			memcpy(buf, &heap, sizeof(heap));
+		}
+		ops = &ops_of<T>::value;
+	}
+
+	thread_task_f(thread_task_f &&other) noexcept
+	{
+		take(other);
+	}
+
+	thread_task_f &
+	operator=(thread_task_f &&other) noexcept
+	{
+		if (this != &other) {
+			reset();
+			take(other);
+		}
+		return *this;
+	}
+
+	thread_task_f(const thread_task_f &) = delete;
+	thread_task_f &operator=(const thread_task_f &) = delete;
+
+	~thread_task_f()
+	{
+		reset();
+	}
+
+	void
+	operator()()
+	{
+		ops->call(buf);
+	}
+
+	explicit operator bool() const
+	{
+		return ops != nullptr;
+	}
+
+	/** Destroy the callable, the function becomes empty. */
+	void
+	reset()
+	{
+		if (ops != nullptr) {
+			ops->destroy(buf);
+			ops = nullptr;
+		}
+	}
+
+private:
+	struct ops_table {
+		void (*call)(void *buf);
+		/** Move-construct into @a dst and destroy in @a src. */
+		void (*move)(void *dst, void *src);
+		void (*destroy)(void *buf);
+	};
+
+	template<typename T>
+	static constexpr bool
+	is_inline()
+	{
+		return sizeof(T) <= THREAD_TASK_F_INLINE_SIZE &&
+		       alignof(T) <= alignof(max_align_t) &&
+		       std::is_nothrow_move_constructible<T>::value;
+	}
+
+	template<typename T>
+	static T *
+	target(void *buf)
+	{
+		if constexpr (is_inline<T>())
+			return std::launder(static_cast<T *>(buf));
+		T *heap;
+		memcpy(&heap, buf, sizeof(heap));
+		return heap;
+	}
+
+	template<typename T>
+	struct ops_of {
+		static void
+		call(void *buf)
+		{
+			(*target<T>(buf))();
+		}
+
+		static void
+		move(void *dst, void *src)
+		{
+			if constexpr (is_inline<T>()) {
+				T *t = target<T>(src);
+				new (dst) T(std::move(*t));
+				t->~T();
+			} else {
+				memcpy(dst, src, sizeof(T *));
+			}
+		}
+
+		static void
+		destroy(void *buf)
+		{
+			if constexpr (is_inline<T>())
+				target<T>(buf)->~T();
+			else
+				delete target<T>(buf);
+		}
+
+		static constexpr ops_table value = {call, move, destroy};
+	};
+
+	void
+	take(thread_task_f &other)
+	{
+		ops = other.ops;
+		if (ops != nullptr) {
+			ops->move(buf, other.buf);
+			other.ops = nullptr;
+		}
+	}
+
+	alignas(max_align_t) unsigned char buf[THREAD_TASK_F_INLINE_SIZE];
+	const ops_table *ops = nullptr;
+};
 
 enum {
+	/** Max threads of thread_pool_new(). */
 	TPOOL_MAX_THREADS = 20,
+	/** Max threads of thread_pool_new_ex(). */
+	TPOOL_THREADS_LIMIT = 4096,
 	TPOOL_MAX_TASKS = 100000,
 };
 
@@ -39,8 +190,177 @@ enum thread_pool_errcode {
 	TPOOL_ERR_TIMEOUT,
 };
 
+/**
+ * Priority classes of the tasks. The workers take a task of a class
+ * only when the higher ones have none queued, so a flood of the low
+ * priority tasks doesn't delay the high priority ones, but the low
+ * ones can starve.
+ */
+enum thread_task_priority {
+	TPOOL_PRIORITY_HIGH,
+	TPOOL_PRIORITY_NORMAL,
+	TPOOL_PRIORITY_LOW,
+	TPOOL_PRIORITY_COUNT,
+};
+
+/** What to do with a task taken from the queue after its deadline. */
+enum thread_task_deadline_policy {
+	/** Run it anyway, thread_task_is_late() tells it was late. */
+	TPOOL_DEADLINE_FLAG,
+	/** Finish it without running. */
+	TPOOL_DEADLINE_DROP,
+};
+
+enum {
+	/** Buckets of the time histograms, see thread_pool_wait_stats. */
+	TPOOL_WAIT_BUCKETS = 40,
+};
+
 /** Thread pool API. */
 
+/**
+ * Pool settings. The idle strategy trades CPU for a lower latency of
+ * the task dispatch: a worker out of tasks polls for new ones for a
+ * while before parking, so a pushed task doesn't have to wake it up.
+ *
+ * The number of the threads floats between min_threads and
+ * thread_count. A worker parked for idle_timeout exits, unless it is
+ * one of the last min_threads. A new one is started for a pushed task
+ * when no worker is idle, and the backlog is big enough, or the oldest
+ * task pushed from outside of the pool has waited for long enough. With
+ * both grow_backlog and grow_delay being 0 a thread is started right
+ * away.
+ *
+ * The workers can be kept on a CPU set, and grouped by the NUMA nodes
+ * of the CPUs. Then each node has its own queue for the tasks pushed
+ * from outside of the pool by the threads running on the node, and its
+ * own memory for the tasks of thread_pool_task_new(). The workers look
+ * for the tasks on their node first. The worker slots are assigned to
+ * the CPUs round-robin over the nodes, so the lazily started workers
+ * are spread evenly.
+ */
+struct thread_pool_options {
+	/** Max number of the threads. */
+	int thread_count;
+	/** Threads started by the creation and never retired. */
+	int min_threads;
+	/** Polling rounds with the pause instruction. */
+	int spin_count;
+	/** Polling rounds with yielding the CPU, after the spinning. */
+	int yield_count;
+	/** Seconds of parking before a worker exits, 0 - never. */
+	double idle_timeout;
+	/** Queued tasks per running thread to start one more, 0 - off. */
+	int grow_backlog;
+	/** Seconds of a task waiting to start one more thread, 0 - off. */
+	double grow_delay;
+	/**
+	 * Collect the queue wait times, see thread_pool_get_wait_stats().
+	 * It costs two clock reads per task.
+	 */
+	bool track_wait;
+	/**
+	 * Collect the run times of the tasks and the busy time of the
+	 * workers, see thread_pool_stats. It costs two clock reads per
+	 * task.
+	 */
+	bool track_run;
+	/**
+	 * Tasks kept in the trace of each worker, the last ones, see
+	 * thread_pool_write_trace(). 0 - no trace. The trace costs the
+	 * clock reads of track_wait and track_run.
+	 */
+	int trace_size;
+	/**
+	 * CPUs for the workers, NULL - all the CPUs the process can run
+	 * on. Without the other placement options each worker can run on
+	 * any of them.
+	 */
+	const int *cpus;
+	int cpu_count;
+	/** Pin each worker to one CPU of the set. */
+	bool pin_per_cpu;
+	/**
+	 * Group the workers by the NUMA nodes, see above. Without
+	 * pin_per_cpu a worker can run on any CPU of its node.
+	 */
+	bool numa_aware;
+};
+
+/**
+ * Queue wait times of the tasks of a priority class: from the queuing
+ * until a worker takes the task. For a task pushed after others, the
+ * queuing is when its dependencies are done. Only the deadline misses
+ * are counted without thread_pool_options.track_wait.
+ */
+struct thread_pool_wait_stats {
+	/** Tasks taken from the queues. */
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	/** Tasks taken after their deadline, including the dropped ones. */
+	uint64_t late;
+	/** Late tasks finished without running. */
+	uint64_t dropped;
+	/** Tasks waited for [2^i, 2^(i+1)) ns, the last one is unbounded. */
+	uint64_t histogram[TPOOL_WAIT_BUCKETS];
+};
+
+/** Pool counters, see thread_pool_get_stats(). */
+struct thread_pool_stats {
+	/** Polling rounds of the idle workers with pause. */
+	uint64_t spins;
+	/** Polling rounds of the idle workers with yield. */
+	uint64_t yields;
+	/** Times a worker went to sleep. */
+	uint64_t parks;
+	/** Times a pusher woke a sleeping worker up. */
+	uint64_t wakeups;
+	/** Threads running now. */
+	uint64_t threads;
+	/** Threads started, including the retired ones. */
+	uint64_t thread_starts;
+	/** Threads exited after idle_timeout. */
+	uint64_t thread_retires;
+	/** Tasks pushed, including the ones pushed after others. */
+	uint64_t pushed;
+	/** Tasks finished, including the dropped ones. */
+	uint64_t completed;
+	uint64_t detached;
+	/** Tasks in the queues now, not taken by the workers yet. */
+	uint64_t queued;
+	/**
+	 * Tasks pushed and not joined or auto-deleted yet, now and the
+	 * most ever. It is the high-water mark of the queues plus the
+	 * running and the finished not joined tasks.
+	 */
+	uint64_t pending;
+	uint64_t pending_max;
+	/** Tasks taken from the deques of the other workers. */
+	uint64_t steals;
+	/**
+	 * Time the workers spent running the tasks, and between them,
+	 * with track_run. A task run by a worker waiting inside of
+	 * another task is counted once, in the outer one.
+	 */
+	uint64_t busy_ns;
+	uint64_t idle_ns;
+	/** Wait times of all the priority classes, with track_wait. */
+	struct thread_pool_wait_stats wait;
+	/**
+	 * Run times of the tasks, with track_run. The deadline counters
+	 * are always 0.
+	 */
+	struct thread_pool_wait_stats run;
+};
+
+/**
+ * Fill @a opts with the defaults: one thread, parking right away
+ * without polling, started on demand and never retired.
+ */
+void
+thread_pool_options_create(struct thread_pool_options *opts);
+
 /**
  * Create a new thread pool with the @a thread_count thread.
  * @param thread_count Pool size.
@@ -54,12 +374,79 @@ enum thread_pool_errcode {
 int
 thread_pool_new(int thread_count, struct thread_pool **pool);
 
+/**
+ * Create a new thread pool with the settings.
+ * @param opts Settings.
+ * @param[out] Pointer to store result pool object.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - thread_count is bigger than
+ *       TPOOL_THREADS_LIMIT or 0, min_threads is bigger than it,
+ *       a negative count or time, or a CPU the process can't run on.
+ */
+int
+thread_pool_new_ex(const struct thread_pool_options *opts,
+		   struct thread_pool **pool);
+
+/**
+ * Get the task, the idle strategy and the thread counters of @a pool.
+ * They are summed over the workers without a lock, so are a bit stale
+ * and not consistent with each other under load.
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - a NULL argument.
+ */
+int
+thread_pool_get_stats(const struct thread_pool *pool,
+		      struct thread_pool_stats *stats);
+
+/**
+ * Get the queue wait times of the tasks of the @a priority class in
+ * @a pool. They are summed over the workers without a lock, like
+ * thread_pool_get_stats().
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - a NULL argument or a bad
+ *       priority.
+ */
+int
+thread_pool_get_wait_stats(const struct thread_pool *pool,
+			   enum thread_task_priority priority,
+			   struct thread_pool_wait_stats *stats);
+
+/**
+ * Estimate a wait time quantile from the histogram of @a stats, like
+ * 0.99 for p99. It is rounded up to a power of 2.
+ * @retval Nanoseconds not exceeded by the @a quantile of the tasks, or
+ *         0 if there are none.
+ */
+uint64_t
+thread_pool_wait_stats_quantile(const struct thread_pool_wait_stats *stats,
+				double quantile);
+
+/**
+ * Write the trace of @a pool in the Chrome trace event format, for
+ * chrome://tracing or Perfetto. Each run task is an event on the
+ * timeline of its worker, with the queue wait in the arguments. The
+ * workers keep the last thread_pool_options.trace_size tasks each, and
+ * the trace goes on after the call. The write errors are left in the
+ * error flag of @a out.
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - a NULL argument, or the pool
+ *       has no trace.
+ */
+int
+thread_pool_write_trace(struct thread_pool *pool, FILE *out);
+
 /**
  * Delete @a pool, free its memory.
  * @param pool Pool to delete.
  * @retval 0 Success.
  * @retval != Error code.
- *     - TPOOL_ERR_HAS_TASKS - pool still has tasks.
+ *     - TPOOL_ERR_HAS_TASKS - pool still has tasks, or tasks
+ *       created by thread_pool_task_new() are not deleted.
  */
 int
 thread_pool_delete(struct thread_pool *pool);
@@ -67,7 +454,9 @@ thread_pool_delete(struct thread_pool *pool);
 /**
  * Push @a task into thread pool queue. The task must not be
  * already pushed or deleted - otherwise this is undefined
- * behaviour.
+ * behaviour. A task pushed from another task of the same pool
+ * goes to the queue of the current worker thread, and the idle
+ * workers steal from there.
  * @param pool Pool to push into.
  * @param task Task to push.
  *
@@ -79,6 +468,60 @@ thread_pool_delete(struct thread_pool *pool);
 int
 thread_pool_push_task(struct thread_pool *pool, struct thread_task *task);
 
+/**
+ * Push @a count tasks at once. It is cheaper than pushing them one by
+ * one: the queue space is reserved for all of them in one step, and
+ * only as many idle workers are woken up as there are tasks. Either
+ * all the tasks are pushed or none. The same rules as for
+ * thread_pool_push_task() apply to each task.
+ * @param pool Pool to push into.
+ * @param tasks Tasks to push.
+ * @param count Number of the tasks.
+ *
+ * @retval 0 Success.
+ * @retval != Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - a NULL task or a negative
+ *       count.
+ *     - TPOOL_ERR_TOO_MANY_TASKS - the tasks don't fit into the
+ *       pool, nothing is pushed.
+ */
+int
+thread_pool_push_tasks(struct thread_pool *pool, struct thread_task **tasks,
+		       int count);
+
+/**
+ * Push @a task to be queued when all of @a deps are finished. It
+ * doesn't block, and no worker waits for the dependencies: the worker
+ * finishing the last of them queues the task. Meanwhile the task is
+ * counted in the pool and is not running. The dependencies must be
+ * pushed and not joined or detached before the call, but can be
+ * afterwards.
+ * @param pool Pool to push into.
+ * @param task Task to push.
+ * @param deps Tasks to wait for.
+ * @param dep_count Number of the dependencies. With 0 the task is
+ *        queued right away.
+ *
+ * @retval 0 Success.
+ * @retval != Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - a NULL argument or a
+ *       negative count.
+ *     - TPOOL_ERR_TASK_NOT_PUSHED - a dependency is not pushed.
+ *     - TPOOL_ERR_TOO_MANY_TASKS - pool has too many tasks
+ *       already.
+ */
+int
+thread_pool_push_after(struct thread_pool *pool, struct thread_task *task,
+		       struct thread_task **deps, int dep_count);
+
+/**
+ * Like thread_pool_push_after(), but the task is queued when any one
+ * of @a deps is finished. @a dep_count must be positive.
+ */
+int
+thread_pool_push_after_any(struct thread_pool *pool, struct thread_task *task,
+			   struct thread_task **deps, int dep_count);
+
 /** Thread pool task API. */
 
 /**
@@ -89,7 +532,64 @@ thread_pool_push_task(struct thread_pool *pool, struct thread_task *task);
  * @retval Always 0.
  */
 int
-thread_task_new(struct thread_task **task, const thread_task_f &function);
+thread_task_new(struct thread_task **task, thread_task_f &&function);
+
+/**
+ * Like thread_task_new(), but the task memory is taken from a cache of
+ * @a pool and returns there when the task is deleted, explicitly or
+ * after detach. In a steady state such tasks are created and deleted
+ * without heap allocations. The pool can't be deleted until all its
+ * tasks are.
+ * @param pool Pool owning the task memory.
+ * @param[out] task Pointer to store result task object.
+ * @param function Function to run by this task.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - a NULL argument.
+ */
+int
+thread_pool_task_new(struct thread_pool *pool, struct thread_task **task,
+		     thread_task_f &&function);
+
+/**
+ * Set the priority class of @a task for its next pushes. It is
+ * TPOOL_PRIORITY_NORMAL by default. The normal tasks without a deadline
+ * go to the lock-free queues, the others to the queues of their class
+ * under a mutex.
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - a NULL task or a bad priority.
+ *     - TPOOL_ERR_TASK_IN_POOL - the task is in a pool.
+ */
+int
+thread_task_set_priority(struct thread_task *task,
+			 enum thread_task_priority priority);
+
+/**
+ * Set a deadline of @a task, @a timeout seconds after each its push.
+ * Within a priority class the workers take the task with the earliest
+ * deadline first, and the tasks without one after all of them. A task
+ * taken after the deadline is late, and is run or dropped depending on
+ * the @a policy. A dropped task is finished and joined as usual, its
+ * successors run too.
+ * @param timeout Seconds, 0 - no deadline.
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - a NULL task, a bad policy, or
+ *       the timeout is negative or too big.
+ *     - TPOOL_ERR_TASK_IN_POOL - the task is in a pool.
+ */
+int
+thread_task_set_deadline(struct thread_task *task, double timeout,
+			 enum thread_task_deadline_policy policy);
+
+/**
+ * Check if @a task was taken after its deadline in its last push. It
+ * is known once the task is running or finished.
+ */
+bool
+thread_task_is_late(const struct thread_task *task);
 
 /**
  * Check if @a task is finished and joined.
@@ -164,3 +664,30 @@ int
 thread_task_detach(struct thread_task *task);
 
 #endif
+
+/** Parallel loops. See thread_parallel.h for the typed wrappers. */
+
+typedef void (*tpool_range_f)(void *arg, size_t begin, size_t end);
+
+/**
+ * Call @a fn for subranges of [begin, end) covering it, in parallel,
+ * and wait for all of them. The range is split in halves recursively
+ * down to @a grain, and the idle workers steal the halves. The caller
+ * takes part in the work. If it is a worker of the pool, it runs the
+ * other tasks while waiting instead of sleeping, so the call can be
+ * nested. If the pool is full, the rest of a range is done without
+ * splitting.
+ * @param pool Pool to run in.
+ * @param begin First index.
+ * @param end Index after the last one.
+ * @param grain Max size of a subrange. 0 means 1.
+ * @param fn Function to call.
+ * @param arg Argument for the function.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - a NULL pool or function.
+ */
+int
+tpool_parallel_for_ranges(struct thread_pool *pool, size_t begin, size_t end,
+			  size_t grain, tpool_range_f fn, void *arg);
@@ -2,5 +2,10 @@
 
 #include <stdint.h>
 
+/** Number of not freed allocations. */
 uint64_t
 heaph_get_alloc_count(void);
+
+/** Number of allocations done since the process start. */
+uint64_t
+heaph_get_alloc_total(void);